@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <margo.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_types.h"
+#include "margo_auth_complete_auth_pool.h"
+#include "margo_auth_complete_connection.h"
+#include "margo_auth_complete_credentials.h"
+
+/* Measures how long it takes for many clients authenticating at the same
+ * time, as the ranks of a job starting, to all get a session, as a
+ * function of the bound of the server's authentication queue. The server
+ * runs in the same process and handles authenticate with the same
+ * auth_pool_handle as margo_auth_complete_server: its handler admits the
+ * authentication into the authentication pool, or answers
+ * RPC_ERR_RETRY_AFTER if the queue is full, and the credential is then
+ * decoded by the dedicated execution streams. Credentials use the local backend, decoding taking
+ * the given latency, so no munged is needed. Each client sends its
+ * credential with a timeout; a client that times out encodes a new
+ * credential and sends it again right away, the server still decoding
+ * the first one, giving up after AUTH_RETRY_MAX_ATTEMPTS timeouts, and
+ * a client told to retry later backs off with auth_backoff_next. One
+ * JSON object is printed per queue bound:
+ *
+ *   {"queue": ..., "clients": ..., "auth_xstreams": ..., "latency_us": ...,
+ *    "timeout_ms": ..., "authenticated": ..., "decoded": ..., "retries": ...,
+ *    "timeouts": ..., "time_ms": {"p50": ..., "p99": ..., "all": ...}}
+ *
+ * where decoded is the number of credentials the server decoded, and
+ * time_ms the time at which the clients got their session, from the
+ * start of the storm; a queue of 0 is unbounded. */
+
+#define BENCH_PAYLOAD_SIZE (32 + 3) /* key and session parameters */
+
+typedef struct {
+    credential_backend_t backend; /* decodes with the injected latency */
+    auth_pool_t          auth_pool;
+    _Atomic uint64_t     decoded;
+} bench_server_t;
+
+typedef struct {
+    margo_instance_id    mid;
+    hg_id_t              auth_id;
+    hg_addr_t            server_addr;
+    credential_backend_t backend; /* encodes without latency */
+    double               timeout_ms;
+    double               start;
+    double*              done;    /* time each client got its session, -1 if it failed */
+    _Atomic uint64_t     retries;
+    _Atomic uint64_t     timeouts;
+} bench_clients_t;
+
+typedef struct {
+    bench_clients_t* clients;
+    size_t           index;
+} bench_client_t;
+
+static void authenticate(hg_handle_t handle);
+DECLARE_MARGO_RPC_HANDLER(authenticate)
+
+static void run_authentication(void* arg);
+
+void authenticate(hg_handle_t handle)
+{
+    margo_instance_id     mid    = margo_hg_handle_get_instance(handle);
+    const struct hg_info* info   = margo_get_info(handle);
+    bench_server_t*       server = margo_registered_data(mid, info->id);
+
+    auth_pool_handle(&server->auth_pool, handle, run_authentication);
+}
+DEFINE_MARGO_RPC_HANDLER(authenticate)
+
+void run_authentication(void* arg)
+{
+    hg_handle_t handle  = (hg_handle_t)arg;
+    double      started = ABT_get_wtime();
+    auth_in_t   in      = {0};
+    auth_out_t  out     = {0};
+    void*       payload = NULL;
+    size_t      len     = 0;
+    uid_t       uid;
+    gid_t       gid;
+    time_t      encoded;
+
+    margo_instance_id     mid    = margo_hg_handle_get_instance(handle);
+    const struct hg_info* info   = margo_get_info(handle);
+    bench_server_t*       server = margo_registered_data(mid, info->id);
+
+    out.ret = -1;
+    if(margo_get_input(handle, &in) == HG_SUCCESS) {
+        int status = server->backend.decode(&server->backend, in.credential, &payload, &len,
+                                            &uid, &gid, &encoded);
+        atomic_fetch_add(&server->decoded, 1);
+        if(status == CREDENTIAL_SUCCESS && len == BENCH_PAYLOAD_SIZE) {
+            RAND_bytes((unsigned char*)&out.session_id, sizeof(out.session_id));
+            out.ret = 0;
+        }
+        if(payload) OPENSSL_cleanse(payload, len);
+        free(payload);
+        margo_free_input(handle, &in);
+    }
+    margo_respond(handle, &out);
+    margo_destroy(handle);
+    auth_pool_release(&server->auth_pool, started);
+}
+
+static void run_client(void* arg)
+{
+    bench_client_t*  client  = (bench_client_t*)arg;
+    bench_clients_t* clients = client->clients;
+    unsigned char    payload[BENCH_PAYLOAD_SIZE] = {0};
+    auth_in_t        in      = {0};
+    auth_backoff_t   backoff = {0};
+    unsigned         timeouts = 0;
+
+    clients->done[client->index] = -1;
+    payload[32] = MAC_HMAC_SHA256;
+    payload[33] = TOKEN_DEFAULT_TAG_LEN;
+    payload[34] = AEAD_NONE;
+
+    for(;;) {
+        hg_handle_t handle = HG_HANDLE_NULL;
+        auth_out_t  out    = {0};
+        hg_return_t hret;
+
+        // a new credential for the first attempt, and after a timeout,
+        // since the server may have decoded the one that timed out
+        if(!in.credential) {
+            RAND_bytes(payload, 32);
+            if(clients->backend.encode(&clients->backend, payload, sizeof(payload),
+                                       &in.credential) != 0) break;
+        }
+        if(margo_create(clients->mid, clients->server_addr, clients->auth_id, &handle) != HG_SUCCESS)
+            break;
+        hret = clients->timeout_ms > 0 ? margo_forward_timed(handle, &in, clients->timeout_ms)
+                                       : margo_forward(handle, &in);
+        if(hret == HG_TIMEOUT) {
+            atomic_fetch_add(&clients->timeouts, 1);
+            margo_destroy(handle);
+            free(in.credential);
+            in.credential = NULL;
+            if(++timeouts >= AUTH_RETRY_MAX_ATTEMPTS) break;
+            continue;
+        }
+        if(hret != HG_SUCCESS || margo_get_output(handle, &out) != HG_SUCCESS) {
+            margo_destroy(handle);
+            break;
+        }
+        int32_t  ret         = out.ret;
+        uint32_t retry_after = out.retry_after;
+        margo_free_output(handle, &out);
+        margo_destroy(handle);
+
+        if(ret == RPC_ERR_RETRY_AFTER) {
+            atomic_fetch_add(&clients->retries, 1);
+            double delay = auth_backoff_next(&backoff, retry_after);
+            if(delay < 0) break;
+            margo_thread_sleep(clients->mid, delay);
+            continue;
+        }
+        if(ret == 0) clients->done[client->index] = ABT_get_wtime() - clients->start;
+        break;
+    }
+    free(in.credential);
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int run_case(FILE* out, bench_clients_t* clients, bench_server_t* server,
+                    size_t num_clients, size_t queue, double latency_us)
+{
+    bench_client_t* args  = (bench_client_t*)calloc(num_clients, sizeof(*args));
+    ABT_thread*     ults  = (ABT_thread*)calloc(num_clients, sizeof(*ults));
+    ABT_pool        pool;
+    size_t          authenticated = 0;
+
+    margo_get_handler_pool(clients->mid, &pool);
+    server->auth_pool.capacity = queue;
+    atomic_store(&server->decoded, 0);
+    atomic_store(&clients->retries, 0);
+    atomic_store(&clients->timeouts, 0);
+
+    clients->start = ABT_get_wtime();
+    for(size_t i = 0; i < num_clients; ++i) {
+        args[i].clients = clients;
+        args[i].index   = i;
+        ABT_thread_create(pool, run_client, &args[i], ABT_THREAD_ATTR_NULL, &ults[i]);
+    }
+    for(size_t i = 0; i < num_clients; ++i) {
+        ABT_thread_join(ults[i]);
+        ABT_thread_free(&ults[i]);
+    }
+    uint64_t decoded = atomic_load(&server->decoded);
+
+    // the times of the clients that got a session, in order
+    for(size_t i = 0; i < num_clients; ++i)
+        if(clients->done[i] >= 0) clients->done[authenticated++] = clients->done[i];
+    qsort(clients->done, authenticated, sizeof(*clients->done), compare_doubles);
+    fprintf(out, "{\"queue\": %zu, \"clients\": %zu, \"auth_xstreams\": %d, \"latency_us\": %.0f, "
+                 "\"timeout_ms\": %.0f, \"authenticated\": %zu, \"decoded\": %lu, \"retries\": %lu, "
+                 "\"timeouts\": %lu, \"time_ms\": {\"p50\": %.1f, \"p99\": %.1f, \"all\": %.1f}}\n",
+            queue, num_clients, server->auth_pool.num_xstreams, latency_us, clients->timeout_ms,
+            authenticated, (unsigned long)decoded, (unsigned long)atomic_load(&clients->retries),
+            (unsigned long)atomic_load(&clients->timeouts),
+            authenticated ? clients->done[authenticated / 2] * 1e3 : 0,
+            authenticated ? clients->done[authenticated * 99 / 100] * 1e3 : 0,
+            authenticated ? clients->done[authenticated - 1] * 1e3 : 0);
+    fflush(out);
+
+    // let the server decode the credentials of the clients that timed
+    // out before starting the next case
+    while(atomic_load(&server->auth_pool.admitted) != 0) margo_thread_sleep(clients->mid, 10);
+
+    free(ults);
+    free(args);
+    return authenticated == num_clients ? 0 : -1;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -p <protocol>     Mercury protocol (default: na+sm)\n"
+        "  -c <n>            number of clients (default: 1000)\n"
+        "  -q <n>,...        bounds of the authentication queue, 0 for none (default: 0,16,64,256)\n"
+        "  -l <us>           latency of decoding a credential (default: 1000)\n"
+        "  -x <n>            execution streams decoding credentials (default: %d)\n"
+        "  -t <ms>           timeout of the clients' authenticate RPCs, 0 for none (default: 2000)\n"
+        "  -r <n>            execution streams running the handlers and clients (default: 4)\n"
+        "  -k <file>         key file of the local credential backend (default: bench_auth_storm.key)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program, AUTH_POOL_DEFAULT_XSTREAMS);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    const char*     protocol     = "na+sm";
+    size_t          num_clients  = 1000;
+    size_t          queues[16]   = { 0, 16, 64, 256 };
+    int             num_queues   = 0;
+    double          latency_us   = 1000;
+    int             auth_xstreams = AUTH_POOL_DEFAULT_XSTREAMS;
+    int             rpc_xstreams = 4;
+    const char*     key_file     = "bench_auth_storm.key";
+    FILE*           out          = stdout;
+    int             ret          = 0;
+    char            spec[4096];
+    bench_server_t  server       = {0};
+    bench_clients_t clients      = {0};
+
+    clients.timeout_ms = 2000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "p:c:q:l:x:t:r:k:o:")) != -1) {
+        switch(opt) {
+        case 'p':
+            protocol = optarg;
+            break;
+        case 'c':
+            num_clients = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            for(char* n = strtok(optarg, ","); n && num_queues < 16; n = strtok(NULL, ","))
+                queues[num_queues++] = strtoul(n, NULL, 10);
+            break;
+        case 'l':
+            latency_us = atof(optarg);
+            break;
+        case 'x':
+            auth_xstreams = atoi(optarg);
+            break;
+        case 't':
+            clients.timeout_ms = atof(optarg);
+            break;
+        case 'r':
+            rpc_xstreams = atoi(optarg);
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(num_clients == 0 || auth_xstreams < 0 || rpc_xstreams < 0) usage(argv[0]);
+    if(num_queues == 0) num_queues = 4;
+
+    clients.mid = margo_init(protocol, MARGO_SERVER_MODE, 1, rpc_xstreams);
+    if(clients.mid == MARGO_INSTANCE_NULL) {
+        fprintf(stderr, "Could not initialize margo with protocol %s\n", protocol);
+        exit(-1);
+    }
+
+    // the clients encode right away, the server takes the latency to decode
+    snprintf(spec, sizeof(spec), "local:%s", key_file);
+    if(credential_backend_init(&clients.backend, spec) != 0) exit(-1);
+    snprintf(spec, sizeof(spec), "local:%s:%f", key_file, latency_us);
+    if(credential_backend_init(&server.backend, spec) != 0) exit(-1);
+    if(auth_pool_start(&server.auth_pool, auth_xstreams, 0) != 0) {
+        fprintf(stderr, "Could not start the authentication execution streams\n");
+        exit(-1);
+    }
+
+    clients.auth_id = MARGO_REGISTER(clients.mid, "authenticate", auth_in_t, auth_out_t, authenticate);
+    margo_register_data(clients.mid, clients.auth_id, &server, NULL);
+    margo_addr_self(clients.mid, &clients.server_addr);
+    clients.done = (double*)calloc(num_clients, sizeof(*clients.done));
+
+    for(int q = 0; q < num_queues; ++q)
+        ret |= run_case(out, &clients, &server, num_clients, queues[q], latency_us);
+
+    free(clients.done);
+    margo_addr_free(clients.mid, clients.server_addr);
+    auth_pool_stop(&server.auth_pool);
+    credential_backend_finalize(&server.backend);
+    credential_backend_finalize(&clients.backend);
+    margo_finalize(clients.mid);
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
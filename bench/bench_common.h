@@ -0,0 +1,14 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <time.h>
+
+/* Returns the time of the monotonic clock, in seconds. */
+static inline double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <abt.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_sessions.h"
+#include "margo_auth_complete_expiry.h"
+#include "bench_common.h"
+
+/* Simulates client churn against the server's session table and expiry
+ * wheel, with a simulated clock so that hours of churn run in seconds.
+ * Every simulated second, `clients` new sessions are opened; of the
+ * sessions opened the second before, a fraction closes properly and the
+ * others send one more RPC and then disappear without closing, as dead
+ * clients do. The wheel is advanced every simulated second. One JSON
+ * object is printed every `report` simulated seconds:
+ *
+ *   {"time": ..., "live_sessions": ..., "opened": ..., "closed": ...,
+ *    "expired": ..., "rss_kb": ..., "advance_ns": ...}
+ *
+ * where opened, closed and expired are counted since the previous report
+ * and advance_ns is the average duration of a call to
+ * session_expiry_advance. With expiry working, live_sessions and rss_kb
+ * level off once the idle timeout has passed instead of growing. */
+
+static long rss_kb(void)
+{
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(!f) return -1;
+    if(fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -d <seconds>      simulated duration (default: 3600)\n"
+        "  -c <n>            sessions opened per simulated second (default: 1000)\n"
+        "  -p <percent>      percentage of clients closing their session (default: 50)\n"
+        "  -i <seconds>      idle timeout (default: 60)\n"
+        "  -l <seconds>      session lifetime, 0 to disable (default: 600)\n"
+        "  -r <seconds>      report every this many simulated seconds (default: 60)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t duration = 3600;
+    size_t clients = 1000;
+    unsigned close_percent = 50;
+    double idle_timeout = 60;
+    double lifetime = 600;
+    uint64_t report = 60;
+    FILE* out = stdout;
+
+    int opt;
+    while((opt = getopt(argc, argv, "d:c:p:i:l:r:o:")) != -1) {
+        switch(opt) {
+        case 'd': duration = strtoull(optarg, NULL, 10); break;
+        case 'c': clients = strtoul(optarg, NULL, 10); break;
+        case 'p': close_percent = (unsigned)atoi(optarg); break;
+        case 'i': idle_timeout = atof(optarg); break;
+        case 'l': lifetime = atof(optarg); break;
+        case 'r': report = strtoull(optarg, NULL, 10); break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(clients == 0 || report == 0 || close_percent > 100) usage(argv[0]);
+
+    ABT_init(0, NULL);
+
+    session_table_t  table;
+    session_expiry_t expiry;
+    if(session_table_init(&table, SESSION_TABLE_DEFAULT_SHARDS, 0) != 0) {
+        fprintf(stderr, "Could not initialize the session table\n");
+        exit(-1);
+    }
+    session_expiry_init(&expiry, &table, idle_timeout, lifetime, SESSION_EXPIRY_TICK, 0.0);
+
+    session_id_t* previous = (session_id_t*)calloc(clients, sizeof(*previous));
+    session_id_t* current  = (session_id_t*)calloc(clients, sizeof(*current));
+    size_t live = 0, opened = 0, closed = 0, expired = 0;
+    double advance_time = 0;
+
+    for(uint64_t t = 1; t <= duration; ++t) {
+        double sim_now = (double)t;
+
+        // the clients of the previous second either close or go silent
+        for(size_t i = 0; i < clients; ++i) {
+            session_t* session = session_table_find(&table, previous[i]);
+            if(!session) continue;
+            int close = (i % 100) < close_percent;
+            if(close) session_mark_closed(session);
+            else session->last_used = sim_now;
+            if(close) {
+                session_expiry_cancel(&expiry, session);
+                session_table_remove(&table, session);
+                ++closed;
+                --live;
+            }
+            session_release(session);
+        }
+
+        // new clients authenticate
+        for(size_t i = 0; i < clients; ++i) {
+            session_t* session = session_alloc(&table);
+            do {
+                RAND_bytes((unsigned char*)&session->session_id, sizeof(session->session_id));
+            } while(session->session_id == 0);
+            session->created = session->last_used = sim_now;
+            session_table_insert(&table, session);
+            session_expiry_add(&expiry, session);
+            current[i] = session->session_id;
+            ++opened;
+            ++live;
+        }
+        session_id_t* tmp = previous;
+        previous = current;
+        current  = tmp;
+
+        double t0 = now();
+        size_t n = session_expiry_advance(&expiry, sim_now);
+        advance_time += now() - t0;
+        expired += n;
+        live    -= n;
+
+        if(t % report == 0) {
+            fprintf(out, "{\"time\": %lu, \"live_sessions\": %zu, \"opened\": %zu, "
+                         "\"closed\": %zu, \"expired\": %zu, \"rss_kb\": %ld, "
+                         "\"advance_ns\": %.0f}\n",
+                    (unsigned long)t, live, opened, closed, expired, rss_kb(),
+                    advance_time * 1e9 / report);
+            fflush(out);
+            opened = closed = expired = 0;
+            advance_time = 0;
+        }
+    }
+
+    session_table_finalize(&table);
+    free(previous);
+    free(current);
+    ABT_finalize();
+
+    if(out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <abt.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_sessions.h"
+#include "bench_common.h"
+
+/* Hammers a single session from many execution streams, comparing the
+ * lock-free verification of the hello handler (check the sequence number,
+ * check the MAC, claim the sequence number with a compare-and-swap) with
+ * the same steps done under a mutex of the session, as the handler did
+ * before. Every ULT takes the next sequence number of the session, as a
+ * pipelining client would, and verifies its token. After a token is
+ * accepted, the ULT spins for `work` microseconds, standing for what
+ * the handler does next (printing the greeting), which the mutex variant
+ * also does with the lock held. One JSON object is printed per case:
+ *
+ *   {"mode": "lockfree"|"mutex", "xstreams": ..., "ults": ...,
+ *    "work_us": ..., "rpcs": ..., "rejected": ..., "rpcs_per_sec": ...}
+ *
+ * where ults is the number of ULTs per execution stream and rejected the
+ * number of tokens whose sequence number fell out of the window. */
+
+typedef struct {
+    session_t*       session;
+    const uint8_t*   tags;     /* tag of each sequence number */
+    uint64_t         rpcs;
+    int              words;
+    int              use_mutex;
+    double           work;
+    ABT_mutex_memory mtx;
+    _Atomic uint64_t client_seq;
+    _Atomic uint64_t rejected;
+    _Atomic int      ready;
+    _Atomic int      go;
+} bench_t;
+
+static void spin(double duration)
+{
+    if(duration <= 0) return;
+    double deadline = now() + duration;
+    while(now() < deadline) ;
+}
+
+static void run_ult(void* a)
+{
+    bench_t*   bench = (bench_t*)a;
+    session_t* s     = bench->session;
+    token_t    token;
+    memset(&token, 0, sizeof(token));
+    token.tag_len = s->mac.tag_len;
+
+    atomic_fetch_add(&bench->ready, 1);
+    while(!atomic_load(&bench->go)) ABT_thread_yield();
+
+    for(;;) {
+        uint64_t seq_no = atomic_fetch_add(&bench->client_seq, 1);
+        if(seq_no >= bench->rpcs) break;
+        memcpy(token.tag, bench->tags + seq_no * token.tag_len, token.tag_len);
+        int ok;
+        if(bench->use_mutex) {
+            ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&bench->mtx));
+            ok = replay_window_check(&s->replay, bench->words, &s->seq_no, seq_no) == 0
+              && check_token(&token, s->session_id, seq_no, &s->mac) == 0
+              && replay_window_claim(&s->replay, bench->words, &s->seq_no, seq_no) == 0;
+            if(ok) {
+                s->last_used = ABT_get_wtime();
+                spin(bench->work);
+            }
+            ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&bench->mtx));
+        } else {
+            ok = replay_window_check(&s->replay, bench->words, &s->seq_no, seq_no) == 0
+              && check_token(&token, s->session_id, seq_no, &s->mac) == 0
+              && replay_window_claim(&s->replay, bench->words, &s->seq_no, seq_no) == 0;
+            if(ok) {
+                s->last_used = ABT_get_wtime();
+                spin(bench->work);
+            }
+        }
+        if(!ok) atomic_fetch_add(&bench->rejected, 1);
+    }
+}
+
+static int run_case(FILE* out, bench_t* bench, int use_mutex, int num_xstreams, int ults_per_xstream)
+{
+    ABT_xstream xstreams[num_xstreams];
+    ABT_pool    pools[num_xstreams];
+    size_t      num_ults = (size_t)num_xstreams * ults_per_xstream;
+    ABT_thread* ults     = (ABT_thread*)calloc(num_ults, sizeof(*ults));
+    session_t*  s        = bench->session;
+
+    bench->use_mutex = use_mutex;
+    atomic_store(&bench->client_seq, 0);
+    atomic_store(&bench->rejected, 0);
+    atomic_store(&bench->ready, 0);
+    atomic_store(&bench->go, 0);
+    atomic_store(&s->seq_no, 0);
+    replay_window_restore(&s->replay, bench->words, 0);
+
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_create(ABT_SCHED_NULL, &xstreams[x]);
+        ABT_xstream_get_main_pools(xstreams[x], 1, &pools[x]);
+    }
+    for(size_t u = 0; u < num_ults; ++u)
+        ABT_thread_create(pools[u % num_xstreams], run_ult, bench, ABT_THREAD_ATTR_NULL, &ults[u]);
+    while(atomic_load(&bench->ready) != (int)num_ults) ;
+    double t0 = now();
+    atomic_store(&bench->go, 1);
+    for(size_t u = 0; u < num_ults; ++u) {
+        ABT_thread_join(ults[u]);
+        ABT_thread_free(&ults[u]);
+    }
+    double elapsed = now() - t0;
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_join(xstreams[x]);
+        ABT_xstream_free(&xstreams[x]);
+    }
+
+    uint64_t rejected = atomic_load(&bench->rejected);
+    fprintf(out, "{\"mode\": \"%s\", \"xstreams\": %d, \"ults\": %d, \"work_us\": %.1f, "
+                 "\"rpcs\": %lu, \"rejected\": %lu, \"rpcs_per_sec\": %.0f}\n",
+            use_mutex ? "mutex" : "lockfree", num_xstreams, ults_per_xstream, bench->work * 1e6,
+            (unsigned long)bench->rpcs, (unsigned long)rejected, bench->rpcs / elapsed);
+    fflush(out);
+    free(ults);
+    return 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -n <rpcs>         RPCs per case (default: 200000)\n"
+        "  -x <n>,...        numbers of execution streams (default: 1,2,4,8)\n"
+        "  -u <n>            ULTs per execution stream (default: 4)\n"
+        "  -w <n>            replay window (default: %d)\n"
+        "  -s <us>           work done by the handler after the check (default: 0)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program, REPLAY_DEFAULT_WINDOW);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    bench_t         bench = {0};
+    session_table_t table;
+    unsigned char   key[32];
+    int             xstreams[16] = { 1, 2, 4, 8 };
+    int             num_xstreams = 0;
+    int             ults_per_xstream = 4;
+    size_t          window = REPLAY_DEFAULT_WINDOW;
+    FILE*           out = stdout;
+    int             ret = 0;
+
+    bench.rpcs = 200000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:x:u:w:s:o:")) != -1) {
+        switch(opt) {
+        case 'n':
+            bench.rpcs = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            for(char* n = strtok(optarg, ","); n && num_xstreams < 16; n = strtok(NULL, ","))
+                xstreams[num_xstreams++] = atoi(n);
+            break;
+        case 'u':
+            ults_per_xstream = atoi(optarg);
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            bench.work = atof(optarg) * 1e-6;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(bench.rpcs == 0 || ults_per_xstream <= 0) usage(argv[0]);
+    if(num_xstreams == 0) num_xstreams = 4;
+    bench.words = replay_window_words(window);
+    if(bench.words < 0) {
+        fprintf(stderr, "Replay window %zu is too large\n", window);
+        exit(-1);
+    }
+
+    ABT_init(0, NULL);
+
+    // the hot session, and the client's tokens computed ahead so that
+    // only the server's side is measured
+    if(session_table_init(&table, SESSION_TABLE_DEFAULT_SHARDS, 0) != 0) return 1;
+    RAND_bytes(key, sizeof(key));
+    bench.session = session_alloc(&table);
+    bench.session->session_id = 2;
+    mac_init(&bench.session->mac, MAC_HMAC_SHA256, TOKEN_DEFAULT_TAG_LEN, key, sizeof(key));
+    session_table_insert(&table, bench.session);
+    uint8_t* tags = (uint8_t*)malloc(bench.rpcs * TOKEN_DEFAULT_TAG_LEN);
+    for(uint64_t seq_no = 0; seq_no < bench.rpcs; ++seq_no) {
+        token_t token;
+        create_token(&token, bench.session->session_id, seq_no, &bench.session->mac);
+        memset(token.args_digest, 0, sizeof(token.args_digest));
+        sign_token(&token);
+        memcpy(tags + seq_no * TOKEN_DEFAULT_TAG_LEN, token.tag, TOKEN_DEFAULT_TAG_LEN);
+    }
+    bench.tags = tags;
+
+    for(int x = 0; x < num_xstreams; ++x) {
+        if(xstreams[x] <= 0) continue;
+        ret |= run_case(out, &bench, 1, xstreams[x], ults_per_xstream);
+        ret |= run_case(out, &bench, 0, xstreams[x], ults_per_xstream);
+    }
+
+    free(tags);
+    session_table_finalize(&table);
+    ABT_finalize();
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <abt.h>
+#include <openssl/rand.h>
+#include "uthash.h"
+#include "margo_auth_complete_sessions.h"
+#include "bench_common.h"
+
+/* Compares the latency of looking up a session in the session index
+ * (open addressing, see margo_auth_complete_session_index.h) with the
+ * uthash table that the server used before, for several numbers of live
+ * sessions. The uthash case uses the former layout of session_t, with the
+ * hash handle in the middle of the session and sessions allocated with
+ * calloc. Each lookup then reads and updates the fields of the session
+ * that a hello RPC uses, so that the cost of the cache lines touched in
+ * the session is counted too. Lookups are in a random order, so that with
+ * enough sessions most of them miss in the caches. No lock is taken, as
+ * locking costs the same in both cases. One JSON object is printed per
+ * case:
+ *
+ *   {"index": ..., "sessions": ..., "lookups": ..., "ns_per_lookup": ...,
+ *    "session_size": ...}
+ */
+
+typedef struct legacy_session_t {
+    session_id_t     session_id;
+    UT_hash_handle   hh;
+    uid_t            uid;
+    uint64_t         seq_no;
+    unsigned char    key[32];
+    mac_alg_t        mac_alg;
+    mac_t            mac;
+    aead_t           aead;
+    double           created;
+    double           last_used;
+    timer_node_t     timer;
+    int              closed;
+    ABT_mutex_memory mtx;
+    _Atomic uint32_t refcount;
+} legacy_session_t;
+
+static volatile uint64_t sink; /* keeps the reads from being optimized out */
+
+static session_id_t* random_ids(size_t n)
+{
+    session_id_t* ids = (session_id_t*)malloc(n * sizeof(*ids));
+    RAND_bytes((unsigned char*)ids, n * sizeof(*ids));
+    for(size_t i = 0; i < n; ++i) if(ids[i] == 0) ids[i] = 1; // duplicates are harmless
+    return ids;
+}
+
+/* Order in which the sessions are looked up. */
+static size_t* random_order(size_t n, size_t lookups)
+{
+    size_t* order = (size_t*)malloc(lookups * sizeof(*order));
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for(size_t i = 0; i < lookups; ++i) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        order[i] = (size_t)((state * 2685821657736338717ULL) % n);
+    }
+    return order;
+}
+
+static void run_uthash(FILE* out, const session_id_t* ids, size_t n,
+                       const size_t* order, size_t lookups)
+{
+    legacy_session_t* table = NULL;
+    for(size_t i = 0; i < n; ++i) {
+        legacy_session_t* session;
+        HASH_FIND(hh, table, &ids[i], sizeof(ids[i]), session);
+        if(session) continue;
+        session = (legacy_session_t*)calloc(1, sizeof(*session));
+        session->session_id = ids[i];
+        HASH_ADD(hh, table, session_id, sizeof(session->session_id), session);
+    }
+
+    uint64_t found = 0;
+    double t0 = now();
+    for(size_t i = 0; i < lookups; ++i) {
+        legacy_session_t* session;
+        HASH_FIND(hh, table, &ids[order[i]], sizeof(session_id_t), session);
+        if(!session) continue;
+        atomic_fetch_add_explicit(&session->refcount, 1, memory_order_relaxed);
+        found += session->closed + (session->mac.ctx != NULL);
+        session->seq_no   += 1;
+        session->last_used = (double)i;
+        atomic_fetch_sub_explicit(&session->refcount, 1, memory_order_relaxed);
+    }
+    double elapsed = now() - t0;
+    sink = found;
+
+    fprintf(out, "{\"index\": \"uthash\", \"sessions\": %zu, \"lookups\": %zu, "
+                 "\"ns_per_lookup\": %.1f, \"session_size\": %zu}\n",
+            n, lookups, elapsed * 1e9 / lookups, sizeof(legacy_session_t));
+    fflush(out);
+
+    legacy_session_t *session, *tmp;
+    HASH_ITER(hh, table, session, tmp) {
+        HASH_DELETE(hh, table, session);
+        free(session);
+    }
+}
+
+static void run_index(FILE* out, const session_id_t* ids, size_t n,
+                      const size_t* order, size_t lookups)
+{
+    session_index_t index;
+    slab_t          slab;
+    session_index_init(&index);
+    slab_init(&slab, sizeof(session_t), 0);
+    for(size_t i = 0; i < n; ++i) {
+        if(session_index_find(&index, ids[i])) continue;
+        session_t* session  = (session_t*)slab_alloc(&slab);
+        session->session_id = ids[i];
+        session_index_insert(&index, ids[i], session);
+    }
+
+    uint64_t found = 0;
+    double t0 = now();
+    for(size_t i = 0; i < lookups; ++i) {
+        session_t* session = (session_t*)session_index_find(&index, ids[order[i]]);
+        if(!session) continue;
+        atomic_fetch_add_explicit(&session->refcount, 1, memory_order_relaxed);
+        found += session->closed + (session->mac.ctx != NULL);
+        session->seq_no   += 1;
+        session->last_used = (double)i;
+        atomic_fetch_sub_explicit(&session->refcount, 1, memory_order_relaxed);
+    }
+    double elapsed = now() - t0;
+    sink = found;
+
+    fprintf(out, "{\"index\": \"open-addressing\", \"sessions\": %zu, \"lookups\": %zu, "
+                 "\"ns_per_lookup\": %.1f, \"session_size\": %zu}\n",
+            n, lookups, elapsed * 1e9 / lookups, sizeof(session_t));
+    fflush(out);
+
+    session_index_finalize(&index);
+    slab_finalize(&slab);
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -c <n>,...        numbers of live sessions (default: 10000,100000,1000000)\n"
+        "  -n <lookups>      lookups per case (default: 10000000)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    size_t counts[16];
+    int num_counts = 0;
+    size_t lookups = 10000000;
+    FILE* out = stdout;
+
+    int opt;
+    while((opt = getopt(argc, argv, "c:n:o:")) != -1) {
+        switch(opt) {
+        case 'c':
+            for(char* n = strtok(optarg, ","); n && num_counts < 16; n = strtok(NULL, ","))
+                counts[num_counts++] = strtoul(n, NULL, 10);
+            break;
+        case 'n':
+            lookups = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(lookups == 0) usage(argv[0]);
+    if(num_counts == 0) {
+        counts[num_counts++] = 10000;
+        counts[num_counts++] = 100000;
+        counts[num_counts++] = 1000000;
+    }
+
+    ABT_init(0, NULL);
+    for(int c = 0; c < num_counts; ++c) {
+        if(counts[c] == 0) continue;
+        session_id_t* ids   = random_ids(counts[c]);
+        size_t*       order = random_order(counts[c], lookups);
+        run_uthash(out, ids, counts[c], order, lookups);
+        run_index(out, ids, counts[c], order, lookups);
+        free(ids);
+        free(order);
+    }
+    ABT_finalize();
+
+    if(out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <margo.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_sessions.h"
+#include "margo_auth_complete_connection.h"
+
+/* Measures the latency and throughput of hello RPCs on one session as a
+ * function of the number of RPCs the client keeps in flight, and of the
+ * number of tokens the client prepares ahead of time (see
+ * margo_auth_complete_token_ring.h). The server runs in the same
+ * process: it registers a hello handler that checks the token against
+ * the session the way margo_auth_complete_server does (replay window,
+ * MAC, then claim of the sequence number), and the client sends its RPCs
+ * to its own address with the asynchronous API of
+ * margo_auth_complete_connection.h, issuing a new RPC each time
+ * request_wait_any returns one. One JSON object is printed per depth and
+ * number of prepared tokens:
+ *
+ *   {"depth": ..., "precompute": ..., "window": ..., "rpc_xstreams": ...,
+ *    "rpcs": ..., "failed": ..., "rpcs_per_sec": ..., "latency_us": {"mean": ...,
+ *    "p50": ..., "p99": ...}, "issue_us": {"p50": ..., "p99": ...}}
+ *
+ * where latency is measured from the issue of an RPC to the return of
+ * the wait that completed it, and issue_us is the time spent in
+ * client_hello_issue (signing the token and serializing the RPC), the
+ * part of the send path the prepared tokens shorten. */
+
+typedef struct {
+    session_t* session;
+    int        replay_words;
+} bench_server_t;
+
+static void hello(hg_handle_t handle);
+DECLARE_MARGO_RPC_HANDLER(hello)
+
+void hello(hg_handle_t handle)
+{
+    hello_in_t  in   = {0};
+    hello_out_t out  = {0};
+    hg_return_t hret = HG_SUCCESS;
+    int         ret  = -1;
+
+    margo_instance_id     mid    = margo_hg_handle_get_instance(handle);
+    const struct hg_info* info   = margo_get_info(handle);
+    bench_server_t*       server = margo_registered_data(mid, info->id);
+    session_t*            s      = server->session;
+
+    hret = margo_get_input(handle, &in);
+    if(hret == HG_SUCCESS && in.token.session_id == s->session_id
+    && replay_window_check(&s->replay, server->replay_words, &s->seq_no, in.token.seq_no) == 0
+    && check_token(&in.token, in.token.session_id, in.token.seq_no, &s->mac) == 0
+    && replay_window_claim(&s->replay, server->replay_words, &s->seq_no, in.token.seq_no) == 0)
+        ret = 0;
+
+    out.ret = ret;
+    margo_respond(handle, &out);
+    margo_free_input(handle, &in);
+    margo_destroy(handle);
+}
+DEFINE_MARGO_RPC_HANDLER(hello)
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Issues a hello RPC, recording the time spent doing so. */
+static int issue(connection_t* connection, request_t* request, double* issued_at, double* issue_time)
+{
+    *issued_at = ABT_get_wtime();
+    int ret = client_hello_issue(connection, "bench", request);
+    *issue_time = ABT_get_wtime() - *issued_at;
+    return ret;
+}
+
+static int run_case(FILE* out, client_t* client, connection_t* connection, bench_server_t* server,
+                    size_t depth, size_t precompute, uint64_t rpcs, int rpc_xstreams)
+{
+    request_t* requests  = (request_t*)calloc(depth, sizeof(*requests));
+    double*    issued_at = (double*)calloc(depth, sizeof(*issued_at));
+    double*    latencies = (double*)calloc(rpcs, sizeof(*latencies));
+    double*    issue_times = (double*)calloc(rpcs, sizeof(*issue_times));
+    uint64_t   issued = 0, completed = 0, failed = 0;
+    size_t     index;
+    double     sum = 0;
+
+    // both sides start from a fresh sequence number
+    atomic_store(&connection->seq_no, 0);
+    atomic_store(&server->session->seq_no, 0);
+    replay_window_restore(&server->session->replay, server->replay_words, 0);
+
+    // prepare the tokens of the next sequence numbers, and give the ring's
+    // ULT some time to fill it, as it would while the client authenticates
+    if(precompute) {
+        connection->ring = (token_ring_t*)calloc(1, sizeof(*connection->ring));
+        if(!connection->ring
+        || token_ring_start(connection->ring, client->mid, &connection->mac,
+                            connection->session_id, 0, precompute) != 0) {
+            fprintf(stderr, "Could not start preparing tokens\n");
+            free(connection->ring);
+            connection->ring = NULL;
+            goto error;
+        }
+        margo_thread_sleep(client->mid, 10);
+    }
+
+    double t0 = ABT_get_wtime();
+    for(size_t i = 0; i < depth && issued < rpcs; ++i, ++issued)
+        if(issue(connection, &requests[i], &issued_at[i], &issue_times[issued]) != 0) goto error;
+    while(completed < rpcs) {
+        int ret = request_wait_any(requests, depth, &index);
+        if(index == depth) break;
+        double t = ABT_get_wtime();
+        if(ret != 0) ++failed;
+        latencies[completed] = t - issued_at[index];
+        sum += latencies[completed++];
+        if(issued < rpcs) {
+            if(issue(connection, &requests[index], &issued_at[index], &issue_times[issued]) != 0)
+                goto error;
+            ++issued;
+        }
+    }
+    double elapsed = ABT_get_wtime() - t0;
+
+    qsort(latencies, completed, sizeof(*latencies), compare_doubles);
+    qsort(issue_times, issued, sizeof(*issue_times), compare_doubles);
+    fprintf(out, "{\"depth\": %zu, \"precompute\": %zu, \"window\": %lu, \"rpc_xstreams\": %d, "
+                 "\"rpcs\": %lu, \"failed\": %lu, \"rpcs_per_sec\": %.0f, \"latency_us\": {\"mean\": %.1f, "
+                 "\"p50\": %.1f, \"p99\": %.1f}, \"issue_us\": {\"p50\": %.2f, \"p99\": %.2f}}\n",
+            depth, precompute, (unsigned long)replay_window_width(server->replay_words), rpc_xstreams,
+            (unsigned long)completed, (unsigned long)failed, completed / elapsed,
+            sum / completed * 1e6, latencies[completed / 2] * 1e6,
+            latencies[completed * 99 / 100] * 1e6,
+            issue_times[issued / 2] * 1e6, issue_times[issued * 99 / 100] * 1e6);
+    fflush(out);
+    if(connection->ring) token_ring_stop(connection->ring);
+    free(connection->ring);
+    connection->ring = NULL;
+    free(requests);
+    free(issued_at);
+    free(latencies);
+    free(issue_times);
+    return 0;
+
+error:
+    fprintf(stderr, "Could not issue hello RPC\n");
+    request_wait_all(requests, depth);
+    if(connection->ring) token_ring_stop(connection->ring);
+    free(connection->ring);
+    connection->ring = NULL;
+    free(requests);
+    free(issued_at);
+    free(latencies);
+    free(issue_times);
+    return -1;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -p <protocol>     Mercury protocol (default: na+sm)\n"
+        "  -n <rpcs>         RPCs per depth (default: 20000)\n"
+        "  -d <n>,...        numbers of RPCs in flight (default: 1,2,4,8,16,32,64)\n"
+        "  -k <n>,...        numbers of tokens prepared ahead, 0 for none (default: 0,64)\n"
+        "  -w <n>            replay window of the server (default: %d)\n"
+        "  -x <n>            number of execution streams running the handlers (default: 4)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program, REPLAY_DEFAULT_WINDOW);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    const char*       protocol = "na+sm";
+    uint64_t          rpcs = 20000;
+    size_t            depths[16] = { 1, 2, 4, 8, 16, 32, 64 };
+    int               num_depths = 0;
+    size_t            precomputes[16] = { 0, 64 };
+    int               num_precomputes = 0;
+    size_t            window = REPLAY_DEFAULT_WINDOW;
+    int               rpc_xstreams = 4;
+    FILE*             out = stdout;
+    int               ret = 0;
+    client_t          client = {0};
+    connection_t      connection = {0};
+    bench_server_t    server = {0};
+    session_table_t   table;
+    unsigned char     key[32];
+
+    int opt;
+    while((opt = getopt(argc, argv, "p:n:d:k:w:x:o:")) != -1) {
+        switch(opt) {
+        case 'p':
+            protocol = optarg;
+            break;
+        case 'n':
+            rpcs = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            for(char* n = strtok(optarg, ","); n && num_depths < 16; n = strtok(NULL, ","))
+                depths[num_depths++] = strtoul(n, NULL, 10);
+            break;
+        case 'k':
+            for(char* n = strtok(optarg, ","); n && num_precomputes < 16; n = strtok(NULL, ","))
+                precomputes[num_precomputes++] = strtoul(n, NULL, 10);
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            rpc_xstreams = atoi(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(rpcs == 0 || rpc_xstreams < 0) usage(argv[0]);
+    if(num_depths == 0) num_depths = 7;
+    if(num_precomputes == 0) num_precomputes = 2;
+    server.replay_words = replay_window_words(window);
+    if(server.replay_words < 0) {
+        fprintf(stderr, "Replay window %zu is too large\n", window);
+        exit(-1);
+    }
+
+    client.mid = margo_init(protocol, MARGO_SERVER_MODE, 1, rpc_xstreams);
+    if(client.mid == MARGO_INSTANCE_NULL) {
+        fprintf(stderr, "Could not initialize margo with protocol %s\n", protocol);
+        exit(-1);
+    }
+    client.hello_id = MARGO_REGISTER(client.mid, "hello", hello_in_t, hello_out_t, hello);
+    margo_register_data(client.mid, client.hello_id, &server, NULL);
+
+    // the session, as authenticate would have set it up on both sides
+    RAND_bytes(key, sizeof(key));
+    session_table_init(&table, SESSION_TABLE_DEFAULT_SHARDS, 0);
+    server.session = session_alloc(&table);
+    server.session->session_id = 2;
+    mac_init(&server.session->mac, MAC_HMAC_SHA256, TOKEN_DEFAULT_TAG_LEN, key, sizeof(key));
+    session_table_insert(&table, server.session);
+
+    connection.client     = &client;
+    connection.session_id = server.session->session_id;
+    memcpy(connection.key, key, sizeof(key));
+    mac_init(&connection.mac, MAC_HMAC_SHA256, TOKEN_DEFAULT_TAG_LEN, key, sizeof(key));
+    margo_addr_self(client.mid, &connection.server_addr);
+
+    for(int k = 0; k < num_precomputes; ++k) {
+        for(int d = 0; d < num_depths; ++d) {
+            if(depths[d] == 0) continue;
+            ret |= run_case(out, &client, &connection, &server, depths[d], precomputes[k],
+                            rpcs, rpc_xstreams);
+        }
+    }
+
+    connection_destroy(&connection);
+    session_table_finalize(&table);
+    OPENSSL_cleanse(key, sizeof(key));
+    margo_finalize(client.mid);
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
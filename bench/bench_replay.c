@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <abt.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_sessions.h"
+#include "bench_common.h"
+
+/* Compares the throughput of sessions with a given number of RPCs in
+ * flight, with the strict sequence number check (one RPC in flight per
+ * session) and with a replay window. Each session has `depth` ULTs
+ * standing for its outstanding RPCs, spread over the execution streams.
+ * A ULT takes the next sequence number of its session, as a pipelining
+ * client would, waits for a simulated network latency (jittered, so
+ * RPCs arrive out of order), and has its token verified the way the
+ * hello handler does it: check the sequence number, check the MAC, and
+ * claim the sequence number. A token rejected because the ones before it
+ * have not arrived yet (strict check) is sent again after another
+ * latency; a token rejected for being too old, which the server will
+ * never accept, is reissued with a fresh sequence number, as a client
+ * would have to. One JSON object is printed per case:
+ *
+ *   {"window": ..., "depth": ..., "sessions": ..., "xstreams": ...,
+ *    "latency_us": ..., "rpcs": ..., "resent": ..., "reissued": ...,
+ *    "rpcs_per_sec": ...}
+ *
+ * where window is the number of sequence numbers of the window (0 for
+ * the strict check), rpcs the number of RPCs accepted, resent the number
+ * of tokens sent again as they were, and reissued the number of tokens
+ * rejected as too old. */
+
+typedef struct {
+    session_t*       session;
+    const uint8_t*   tags;      /* tag of each of the first rpcs sequence numbers */
+    _Atomic uint64_t client_seq; /* next sequence number handed out */
+    _Atomic uint64_t issued;     /* RPCs started by the ULTs */
+    _Atomic uint64_t resent;
+    _Atomic uint64_t reissued;
+} bench_session_t;
+
+typedef struct {
+    bench_session_t* session;
+    int              words;
+    uint64_t         rpcs;      /* per session */
+    double           latency;
+    uint64_t         seed;
+    _Atomic int*     ready;
+    _Atomic int*     go;
+} ult_arg_t;
+
+static uint64_t next_random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/* Stands for the time an RPC spends on the network, between 0.5 and 1.5
+ * times the latency. */
+static void in_flight(double latency, uint64_t* state)
+{
+    if(latency <= 0) return;
+    double deadline = now() + latency * (0.5 + (next_random(state) % 1024) / 1024.0);
+    while(now() < deadline) ABT_thread_yield();
+}
+
+/* Fills the token's tag for this sequence number. Only reissued tokens
+ * go beyond the tags computed in advance. */
+static void set_tag(bench_session_t* bs, token_t* token, uint64_t seq_no, uint64_t rpcs)
+{
+    session_t* s = bs->session;
+    if(seq_no < rpcs) {
+        memcpy(token->tag, bs->tags + seq_no * token->tag_len, token->tag_len);
+        return;
+    }
+    token_t fresh;
+    create_token(&fresh, s->session_id, seq_no, &s->mac);
+    memset(fresh.args_digest, 0, sizeof(fresh.args_digest));
+    sign_token(&fresh);
+    memcpy(token->tag, fresh.tag, token->tag_len);
+}
+
+static void run_ult(void* a)
+{
+    ult_arg_t*       arg   = (ult_arg_t*)a;
+    bench_session_t* bs    = arg->session;
+    session_t*       s     = bs->session;
+    uint64_t         state = arg->seed;
+    token_t          token;
+    memset(&token, 0, sizeof(token));
+    token.tag_len = s->mac.tag_len;
+
+    atomic_fetch_add(arg->ready, 1);
+    while(!atomic_load(arg->go)) ABT_thread_yield();
+
+    while(atomic_fetch_add(&bs->issued, 1) < arg->rpcs) {
+        uint64_t seq_no = atomic_fetch_add(&bs->client_seq, 1);
+        set_tag(bs, &token, seq_no, arg->rpcs);
+        for(;;) {
+            in_flight(arg->latency, &state);
+            if(replay_window_check(&s->replay, arg->words, &s->seq_no, seq_no) == 0
+            && check_token(&token, s->session_id, seq_no, &s->mac) == 0
+            && replay_window_claim(&s->replay, arg->words, &s->seq_no, seq_no) == 0)
+                break;
+            // with the strict check, a token ahead of the session's next
+            // sequence number is accepted once the ones before it are;
+            // any other rejected token is too old to ever be accepted
+            if(arg->words == 0 && seq_no > atomic_load(&s->seq_no)) {
+                atomic_fetch_add(&bs->resent, 1);
+                continue;
+            }
+            atomic_fetch_add(&bs->reissued, 1);
+            seq_no = atomic_fetch_add(&bs->client_seq, 1);
+            set_tag(bs, &token, seq_no, arg->rpcs);
+        }
+    }
+}
+
+static int run_case(FILE* out, size_t window, int depth, size_t num_sessions,
+                    int num_xstreams, double latency, uint64_t rpcs)
+{
+    session_table_t  table;
+    bench_session_t* sessions = (bench_session_t*)calloc(num_sessions, sizeof(*sessions));
+    size_t           num_ults = num_sessions * depth;
+    ABT_xstream      xstreams[num_xstreams];
+    ABT_pool         pools[num_xstreams];
+    ABT_thread*      ults     = (ABT_thread*)calloc(num_ults, sizeof(*ults));
+    ult_arg_t*       args     = (ult_arg_t*)calloc(num_ults, sizeof(*args));
+    _Atomic int      ready = 0, go = 0;
+    int              words = replay_window_words(window);
+    unsigned char    key[32];
+
+    if(session_table_init(&table, SESSION_TABLE_DEFAULT_SHARDS, 0) != 0) return -1;
+    for(size_t i = 0; i < num_sessions; ++i) {
+        session_t* session = session_alloc(&table);
+        RAND_bytes(key, sizeof(key));
+        session->session_id = i + 2;
+        mac_init(&session->mac, MAC_HMAC_SHA256, TOKEN_DEFAULT_TAG_LEN, key, sizeof(key));
+        session_table_insert(&table, session);
+        sessions[i].session = session;
+
+        // the client's tokens, computed ahead so that only the server's
+        // side is measured
+        uint8_t* tags = (uint8_t*)malloc(rpcs * TOKEN_DEFAULT_TAG_LEN);
+        for(uint64_t seq_no = 0; seq_no < rpcs; ++seq_no) {
+            token_t token;
+            create_token(&token, session->session_id, seq_no, &session->mac);
+            memset(token.args_digest, 0, sizeof(token.args_digest));
+            sign_token(&token);
+            memcpy(tags + seq_no * TOKEN_DEFAULT_TAG_LEN, token.tag, TOKEN_DEFAULT_TAG_LEN);
+        }
+        sessions[i].tags = tags;
+    }
+
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_create(ABT_SCHED_NULL, &xstreams[x]);
+        ABT_xstream_get_main_pools(xstreams[x], 1, &pools[x]);
+    }
+    for(size_t u = 0; u < num_ults; ++u) {
+        args[u] = (ult_arg_t){ &sessions[u % num_sessions], words, rpcs, latency,
+                               0x9E3779B97F4A7C15ULL * (u + 1), &ready, &go };
+        ABT_thread_create(pools[u % num_xstreams], run_ult, &args[u], ABT_THREAD_ATTR_NULL, &ults[u]);
+    }
+    while(atomic_load(&ready) != (int)num_ults) ;
+    double t0 = now();
+    atomic_store(&go, 1);
+    for(size_t u = 0; u < num_ults; ++u) {
+        ABT_thread_join(ults[u]);
+        ABT_thread_free(&ults[u]);
+    }
+    double elapsed = now() - t0;
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_join(xstreams[x]);
+        ABT_xstream_free(&xstreams[x]);
+    }
+
+    uint64_t resent = 0, reissued = 0;
+    for(size_t i = 0; i < num_sessions; ++i) {
+        resent   += atomic_load(&sessions[i].resent);
+        reissued += atomic_load(&sessions[i].reissued);
+        free((void*)sessions[i].tags);
+    }
+    fprintf(out, "{\"window\": %lu, \"depth\": %d, \"sessions\": %zu, \"xstreams\": %d, "
+                 "\"latency_us\": %.1f, \"rpcs\": %lu, \"resent\": %lu, \"reissued\": %lu, "
+                 "\"rpcs_per_sec\": %.0f}\n",
+            (unsigned long)replay_window_width(words), depth, num_sessions, num_xstreams,
+            latency * 1e6, (unsigned long)(rpcs * num_sessions), (unsigned long)resent,
+            (unsigned long)reissued, rpcs * num_sessions / elapsed);
+    fflush(out);
+
+    session_table_finalize(&table);
+    free(sessions);
+    free(ults);
+    free(args);
+    return 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -n <rpcs>         RPCs per session and per case (default: 20000)\n"
+        "  -d <n>,...        numbers of RPCs in flight per session (default: 1,8,64)\n"
+        "  -w <n>,...        replay windows, 0 for the strict check (default: 0,%d)\n"
+        "  -c <sessions>     number of sessions (default: 1)\n"
+        "  -x <n>            number of execution streams (default: 4)\n"
+        "  -l <us>           simulated network latency of an RPC (default: 20)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program, REPLAY_DEFAULT_WINDOW);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t rpcs = 20000;
+    int depths[16] = { 1, 8, 64 };
+    int num_depths = 0;
+    size_t windows[16] = { 0, REPLAY_DEFAULT_WINDOW };
+    int num_windows = 0;
+    size_t num_sessions = 1;
+    int num_xstreams = 4;
+    double latency = 20e-6;
+    FILE* out = stdout;
+    int ret = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:d:w:c:x:l:o:")) != -1) {
+        switch(opt) {
+        case 'n':
+            rpcs = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            for(char* n = strtok(optarg, ","); n && num_depths < 16; n = strtok(NULL, ","))
+                depths[num_depths++] = atoi(n);
+            break;
+        case 'w':
+            for(char* n = strtok(optarg, ","); n && num_windows < 16; n = strtok(NULL, ","))
+                windows[num_windows++] = strtoul(n, NULL, 10);
+            break;
+        case 'c':
+            num_sessions = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            num_xstreams = atoi(optarg);
+            break;
+        case 'l':
+            latency = atof(optarg) * 1e-6;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(rpcs == 0 || num_sessions == 0 || num_xstreams <= 0) usage(argv[0]);
+    if(num_depths == 0) num_depths = 3;
+    if(num_windows == 0) num_windows = 2;
+
+    ABT_init(0, NULL);
+    for(int w = 0; w < num_windows; ++w) {
+        if(replay_window_words(windows[w]) < 0) {
+            fprintf(stderr, "Replay window %zu is too large\n", windows[w]);
+            continue;
+        }
+        for(int d = 0; d < num_depths; ++d) {
+            if(depths[d] <= 0) continue;
+            ret |= run_case(out, windows[w], depths[d], num_sessions,
+                            num_xstreams, latency, rpcs);
+        }
+    }
+    ABT_finalize();
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
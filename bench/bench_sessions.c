@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <abt.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_sessions.h"
+#include "bench_common.h"
+
+/* Measures the contention on the server's session table. Each execution
+ * stream runs one ULT that repeatedly looks up random sessions the way
+ * the hello handler does (find the session, lock it, unlock and release
+ * it), and, once every `churn` lookups, closes a session and authenticates
+ * a new one. A table with a single shard behaves like the former global
+ * sessions_mtx. One JSON object is printed per case:
+ *
+ *   {"shards": ..., "xstreams": ..., "sessions": ..., "churn": ...,
+ *    "iterations": ..., "ns_per_op": ..., "ops_per_sec": ...}
+ *
+ * iterations is the number of lookups per execution stream, ns_per_op
+ * the average latency of a lookup in an execution stream, and
+ * ops_per_sec the aggregated throughput of all the execution streams. */
+
+typedef struct {
+    session_table_t*       table;
+    _Atomic(session_id_t)* ids;
+    size_t                 num_ids;
+    uint64_t               iterations;
+    uint64_t               churn;
+    uint64_t               seed;
+    _Atomic int*           ready;
+    _Atomic int*           go;
+} ult_arg_t;
+
+static uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*, cheap enough not to show up in the measurement
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static session_t* new_session(session_table_t* table)
+{
+    session_t* session = session_alloc(table);
+    do {
+        RAND_bytes((unsigned char*)&session->session_id, sizeof(session->session_id));
+    } while(session->session_id == 0);
+    return session;
+}
+
+static void run_ult(void* a)
+{
+    ult_arg_t* arg = (ult_arg_t*)a;
+    uint64_t state = arg->seed;
+
+    atomic_fetch_add(arg->ready, 1);
+    while(!atomic_load(arg->go)) ;
+
+    for(uint64_t i = 0; i < arg->iterations; ++i) {
+        size_t index = next_random(&state) % arg->num_ids;
+        session_id_t id = atomic_load(&arg->ids[index]);
+        session_t* session = session_table_find(arg->table, id);
+        if(!session) continue; // being replaced by another execution stream
+        atomic_fetch_add(&session->seq_no, 1);
+        int close = arg->churn && (i % arg->churn) == 0 && session_mark_closed(session);
+        if(close) {
+            session_t* replacement = new_session(arg->table);
+            session_table_insert(arg->table, replacement);
+            atomic_store(&arg->ids[index], replacement->session_id);
+            session_table_remove(arg->table, session);
+        }
+        session_release(session);
+    }
+}
+
+static int run_case(FILE* out, size_t num_shards, int num_xstreams,
+                    size_t num_sessions, uint64_t churn, uint64_t iterations)
+{
+    session_table_t table;
+    ABT_xstream     xstreams[num_xstreams];
+    ABT_thread      ults[num_xstreams];
+    ult_arg_t       args[num_xstreams];
+    _Atomic int     ready = 0, go = 0;
+
+    if(session_table_init(&table, num_shards, 0) != 0) return -1;
+    _Atomic(session_id_t)* ids = (_Atomic(session_id_t)*)calloc(num_sessions, sizeof(*ids));
+    for(size_t i = 0; i < num_sessions; ++i) {
+        session_t* session = new_session(&table);
+        atomic_init(&ids[i], session->session_id);
+        session_table_insert(&table, session);
+    }
+
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_pool pool = ABT_POOL_NULL;
+        args[x] = (ult_arg_t){ &table, ids, num_sessions, iterations, churn,
+                               0x9E3779B97F4A7C15ULL * (x + 1), &ready, &go };
+        ABT_xstream_create(ABT_SCHED_NULL, &xstreams[x]);
+        ABT_xstream_get_main_pools(xstreams[x], 1, &pool);
+        ABT_thread_create(pool, run_ult, &args[x], ABT_THREAD_ATTR_NULL, &ults[x]);
+    }
+    while(atomic_load(&ready) != num_xstreams) ;
+    double t0 = now();
+    atomic_store(&go, 1);
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_thread_join(ults[x]);
+        ABT_thread_free(&ults[x]);
+    }
+    double elapsed = now() - t0;
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_join(xstreams[x]);
+        ABT_xstream_free(&xstreams[x]);
+    }
+
+    fprintf(out, "{\"shards\": %zu, \"xstreams\": %d, \"sessions\": %zu, \"churn\": %lu, "
+                 "\"iterations\": %lu, \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f}\n",
+            table.num_shards, num_xstreams, num_sessions, (unsigned long)churn,
+            (unsigned long)iterations, elapsed * 1e9 / iterations,
+            num_xstreams * iterations / elapsed);
+    fflush(out);
+
+    session_table_finalize(&table);
+    free(ids);
+    return 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -n <iterations>   lookups per execution stream and per case (default: 1000000)\n"
+        "  -x <n>,...        numbers of execution streams (default: 1,2,4,... up to the number of cores)\n"
+        "  -s <n>,...        numbers of shards (default: 1,%d)\n"
+        "  -c <sessions>     number of live sessions (default: 10000)\n"
+        "  -r <n>            close and reopen a session every n lookups, 0 to disable (default: 100)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program, SESSION_TABLE_DEFAULT_SHARDS);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t iterations = 1000000;
+    int xstream_counts[16];
+    int num_xstream_counts = 0;
+    size_t shard_counts[16];
+    int num_shard_counts = 0;
+    size_t num_sessions = 10000;
+    uint64_t churn = 100;
+    FILE* out = stdout;
+    int ret = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:x:s:c:r:o:")) != -1) {
+        switch(opt) {
+        case 'n':
+            iterations = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            for(char* n = strtok(optarg, ","); n && num_xstream_counts < 16; n = strtok(NULL, ","))
+                xstream_counts[num_xstream_counts++] = atoi(n);
+            break;
+        case 's':
+            for(char* n = strtok(optarg, ","); n && num_shard_counts < 16; n = strtok(NULL, ","))
+                shard_counts[num_shard_counts++] = strtoul(n, NULL, 10);
+            break;
+        case 'c':
+            num_sessions = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            churn = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(iterations == 0 || num_sessions == 0) usage(argv[0]);
+    if(num_xstream_counts == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        for(int x = 1; x < cores && num_xstream_counts < 15; x *= 2)
+            xstream_counts[num_xstream_counts++] = x;
+        xstream_counts[num_xstream_counts++] = cores > 1 ? (int)cores : 1;
+    }
+    if(num_shard_counts == 0) {
+        shard_counts[num_shard_counts++] = 1;
+        shard_counts[num_shard_counts++] = SESSION_TABLE_DEFAULT_SHARDS;
+    }
+
+    ABT_init(0, NULL);
+    for(int s = 0; s < num_shard_counts; ++s) {
+        for(int x = 0; x < num_xstream_counts; ++x) {
+            if(shard_counts[s] == 0 || xstream_counts[x] <= 0) continue;
+            ret |= run_case(out, shard_counts[s], xstream_counts[x],
+                            num_sessions, churn, iterations);
+        }
+    }
+    ABT_finalize();
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <abt.h>
+#include "margo_auth_complete_sessions.h"
+#include "bench_common.h"
+
+/* Compares the allocation of sessions from the session table's slab with
+ * calloc/free, as authenticate and the destruction of sessions used to
+ * do. Each execution stream runs one ULT that repeatedly allocates a
+ * batch of sessions and then frees them, the way sessions churn when a
+ * job starts and ends, zeroing their key as session_destroy does. One
+ * JSON object is printed per case:
+ *
+ *   {"allocator": ..., "xstreams": ..., "batch": ..., "iterations": ...,
+ *    "ns_per_op": ..., "ops_per_sec": ..., "chunks": ...}
+ *
+ * where an operation is an allocation followed, later, by a free,
+ * ns_per_op is the average latency of an operation in an execution
+ * stream, ops_per_sec the aggregated throughput of all the execution
+ * streams, and chunks the number of 2 MiB chunks mapped by the slab. */
+
+typedef struct {
+    session_table_t* table; /* NULL to use calloc/free */
+    size_t           batch;
+    uint64_t         iterations;
+    _Atomic int*     ready;
+    _Atomic int*     go;
+} ult_arg_t;
+
+static void run_ult(void* a)
+{
+    ult_arg_t*  arg      = (ult_arg_t*)a;
+    session_t** sessions = (session_t**)calloc(arg->batch, sizeof(*sessions));
+
+    atomic_fetch_add(arg->ready, 1);
+    while(!atomic_load(arg->go)) ;
+
+    for(uint64_t i = 0; i < arg->iterations; i += arg->batch) {
+        for(size_t j = 0; j < arg->batch; ++j) {
+            if(arg->table) {
+                sessions[j] = session_alloc(arg->table);
+            } else {
+                sessions[j] = (session_t*)calloc(1, sizeof(session_t));
+            }
+            sessions[j]->seq_no = i + j;
+        }
+        for(size_t j = 0; j < arg->batch; ++j) {
+            if(arg->table) {
+                slab_free(sessions[j]);
+            } else {
+                OPENSSL_cleanse(sessions[j]->key, sizeof(sessions[j]->key));
+                free(sessions[j]);
+            }
+        }
+    }
+    free(sessions);
+}
+
+static int run_case(FILE* out, int use_slab, int huge_pages, int num_xstreams,
+                    size_t batch, uint64_t iterations)
+{
+    session_table_t table;
+    ABT_xstream     xstreams[num_xstreams];
+    ABT_thread      ults[num_xstreams];
+    ult_arg_t       args[num_xstreams];
+    _Atomic int     ready = 0, go = 0;
+
+    if(session_table_init(&table, 1, huge_pages) != 0) return -1;
+
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_pool pool = ABT_POOL_NULL;
+        args[x] = (ult_arg_t){ use_slab ? &table : NULL, batch, iterations, &ready, &go };
+        ABT_xstream_create(ABT_SCHED_NULL, &xstreams[x]);
+        ABT_xstream_get_main_pools(xstreams[x], 1, &pool);
+        ABT_thread_create(pool, run_ult, &args[x], ABT_THREAD_ATTR_NULL, &ults[x]);
+    }
+    while(atomic_load(&ready) != num_xstreams) ;
+    double t0 = now();
+    atomic_store(&go, 1);
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_thread_join(ults[x]);
+        ABT_thread_free(&ults[x]);
+    }
+    double elapsed = now() - t0;
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_join(xstreams[x]);
+        ABT_xstream_free(&xstreams[x]);
+    }
+
+    fprintf(out, "{\"allocator\": \"%s\", \"xstreams\": %d, \"batch\": %zu, \"iterations\": %lu, "
+                 "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, \"chunks\": %zu}\n",
+            use_slab ? (huge_pages ? "slab-huge" : "slab") : "calloc",
+            num_xstreams, batch, (unsigned long)iterations, elapsed * 1e9 / iterations,
+            num_xstreams * iterations / elapsed, table.slab.num_chunks);
+    fflush(out);
+
+    session_table_finalize(&table);
+    return 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -n <iterations>   allocations per execution stream and per case (default: 10000000)\n"
+        "  -x <n>,...        numbers of execution streams (default: 1,2,4,... up to the number of cores)\n"
+        "  -b <n>            sessions allocated before being freed (default: 1000)\n"
+        "  -H                also run the slab with huge pages\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t iterations = 10000000;
+    int xstream_counts[16];
+    int num_xstream_counts = 0;
+    size_t batch = 1000;
+    int huge_pages = 0;
+    FILE* out = stdout;
+    int ret = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:x:b:Ho:")) != -1) {
+        switch(opt) {
+        case 'n':
+            iterations = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            for(char* n = strtok(optarg, ","); n && num_xstream_counts < 16; n = strtok(NULL, ","))
+                xstream_counts[num_xstream_counts++] = atoi(n);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            huge_pages = 1;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(iterations == 0 || batch == 0) usage(argv[0]);
+    if(num_xstream_counts == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        for(int x = 1; x < cores && num_xstream_counts < 15; x *= 2)
+            xstream_counts[num_xstream_counts++] = x;
+        xstream_counts[num_xstream_counts++] = cores > 1 ? (int)cores : 1;
+    }
+
+    ABT_init(0, NULL);
+    for(int x = 0; x < num_xstream_counts; ++x) {
+        if(xstream_counts[x] <= 0) continue;
+        ret |= run_case(out, 0, 0, xstream_counts[x], batch, iterations);
+        ret |= run_case(out, 1, 0, xstream_counts[x], batch, iterations);
+        if(huge_pages) ret |= run_case(out, 1, 1, xstream_counts[x], batch, iterations);
+    }
+    ABT_finalize();
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "bench_tokens.h"
+#include "bench_common.h"
+
+/* Measures create_token and check_token for each token variant, key
+ * size and MAC algorithm, with one or more threads, and prints one JSON
+ * object per line:
+ *
+ *   {"variant": ..., "algorithm": ..., "key_len": ..., "op": "create"|"check",
+ *    "threads": ..., "iterations": ..., "ns_per_op": ..., "ops_per_sec": ...}
+ *
+ * iterations is the number of operations per thread, ns_per_op is the
+ * average latency of an operation in a thread, and ops_per_sec is the
+ * aggregated throughput of all the threads. */
+
+typedef struct {
+    const bench_case_t* c;
+    int                 check;
+    uint64_t            iterations;
+    pthread_barrier_t*  barrier;
+    int                 errors;
+} thread_arg_t;
+
+static void* run_thread(void* a)
+{
+    thread_arg_t* arg = (thread_arg_t*)a;
+    const bench_case_t* c = arg->c;
+    unsigned char key[64];
+    for(size_t i = 0; i < sizeof(key); ++i) key[i] = (unsigned char)(i * 7 + 1);
+
+    void* state = c->setup(key, c->key_len, c->algorithm_id);
+    pthread_barrier_wait(arg->barrier);
+    if(!state) {
+        arg->errors = 1;
+        return NULL;
+    }
+    int (*op)(void*, uint64_t) = arg->check ? c->check : c->create;
+    for(uint64_t i = 0; i < arg->iterations; ++i)
+        arg->errors += op(state, i) != 0;
+    c->teardown(state);
+    return NULL;
+}
+
+static int run_case(FILE* out, const bench_case_t* c, int check,
+                    int num_threads, uint64_t iterations)
+{
+    pthread_t threads[num_threads];
+    thread_arg_t args[num_threads];
+    pthread_barrier_t barrier;
+    int errors = 0;
+
+    // the barrier includes the main thread, which starts the clock
+    // once all the threads have set up their state
+    pthread_barrier_init(&barrier, NULL, num_threads + 1);
+    for(int t = 0; t < num_threads; ++t) {
+        args[t] = (thread_arg_t){ c, check, iterations, &barrier, 0 };
+        pthread_create(&threads[t], NULL, run_thread, &args[t]);
+    }
+    pthread_barrier_wait(&barrier);
+    double t0 = now();
+    for(int t = 0; t < num_threads; ++t) {
+        pthread_join(threads[t], NULL);
+        errors += args[t].errors;
+    }
+    double elapsed = now() - t0;
+    pthread_barrier_destroy(&barrier);
+
+    fprintf(out, "{\"variant\": \"%s\", \"algorithm\": \"%s\", \"key_len\": %zu, "
+                 "\"op\": \"%s\", \"threads\": %d, \"iterations\": %lu, "
+                 "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f}\n",
+            c->variant, c->algorithm, c->key_len, check ? "check" : "create",
+            num_threads, (unsigned long)iterations,
+            elapsed * 1e9 / iterations,
+            num_threads * iterations / elapsed);
+    fflush(out);
+
+    if(errors) fprintf(stderr, "%s/%s: %d operations failed\n", c->variant, c->algorithm, errors);
+    return errors ? -1 : 0;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -n <iterations>   operations per thread and per case (default: 100000)\n"
+        "  -t <n>,...        thread counts to run with (default: 1,<number of cores>)\n"
+        "  -f <filter>       only run variants or algorithms containing this string\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t iterations = 100000;
+    int thread_counts[16];
+    int num_thread_counts = 0;
+    const char* filter = NULL;
+    FILE* out = stdout;
+    int ret = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:t:f:o:")) != -1) {
+        switch(opt) {
+        case 'n':
+            iterations = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            for(char* n = strtok(optarg, ","); n && num_thread_counts < 16; n = strtok(NULL, ","))
+                thread_counts[num_thread_counts++] = atoi(n);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(iterations == 0) usage(argv[0]);
+    if(num_thread_counts == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_counts[num_thread_counts++] = 1;
+        if(cores > 1) thread_counts[num_thread_counts++] = (int)cores;
+    }
+
+    bench_case_t cases[BENCH_MAX_CASES];
+    size_t num_cases = 0;
+    num_cases += bench_mac_cases(cases + num_cases, BENCH_MAX_CASES - num_cases);
+    num_cases += bench_mac_session_cases(cases + num_cases, BENCH_MAX_CASES - num_cases);
+    num_cases += bench_complete_cases(cases + num_cases, BENCH_MAX_CASES - num_cases);
+
+    for(size_t i = 0; i < num_cases; ++i) {
+        if(filter && !strstr(cases[i].variant, filter) && !strstr(cases[i].algorithm, filter))
+            continue;
+        for(int t = 0; t < num_thread_counts; ++t) {
+            if(thread_counts[t] <= 0) continue;
+            for(int check = 0; check <= 1; ++check)
+                ret |= run_case(out, &cases[i], check, thread_counts[t], iterations);
+        }
+    }
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
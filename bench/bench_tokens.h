@@ -0,0 +1,28 @@
+#ifndef BENCH_TOKENS_H
+#define BENCH_TOKENS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Each token variant (one per *_types.h header) lives in its own
+ * translation unit, since the headers define the same names, and
+ * describes the cases it can run with a bench_case_t. The state
+ * returned by setup is private to the thread running the case. */
+typedef struct {
+    const char* variant;   // name of the types header benchmarked
+    const char* algorithm; // MAC algorithm used by the tokens
+    size_t      key_len;   // size of the key, in bytes
+    void* (*setup)(const unsigned char* key, size_t key_len, int algorithm);
+    void  (*teardown)(void* state);
+    int   (*create)(void* state, uint64_t seq_no);
+    int   (*check)(void* state, uint64_t seq_no);
+    int   algorithm_id;    // passed to setup
+} bench_case_t;
+
+#define BENCH_MAX_CASES 64
+
+size_t bench_mac_cases(bench_case_t* cases, size_t max);
+size_t bench_mac_session_cases(bench_case_t* cases, size_t max);
+size_t bench_complete_cases(bench_case_t* cases, size_t max);
+
+#endif
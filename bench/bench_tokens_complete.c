@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <string.h>
+#include "margo_auth_complete_types.h"
+#include "bench_tokens.h"
+
+typedef struct {
+    mac_t   mac;
+    token_t token;
+    token_t valid; // token for seq_no 0
+} state_t;
+
+static void* setup(const unsigned char* key, size_t key_len, int algorithm)
+{
+    state_t* state = calloc(1, sizeof(*state));
+    if(mac_init(&state->mac, (mac_alg_t)algorithm, TOKEN_DEFAULT_TAG_LEN, key, key_len) != 0) {
+        free(state);
+        return NULL;
+    }
+    create_token(&state->valid, 1000, 0, &state->mac);
+    sign_token(&state->valid);
+    return state;
+}
+
+static void teardown(void* s)
+{
+    state_t* state = (state_t*)s;
+    mac_destroy(&state->mac);
+    free(state);
+}
+
+static int create(void* s, uint64_t seq_no)
+{
+    state_t* state = (state_t*)s;
+    // the tag is computed when the token is serialized, which sign_token stands for
+    create_token(&state->token, 1000, seq_no, &state->mac);
+    return sign_token(&state->token);
+}
+
+static int check(void* s, uint64_t seq_no)
+{
+    (void)seq_no;
+    state_t* state = (state_t*)s;
+    return check_token(&state->valid, 1000, 0, &state->mac);
+}
+
+size_t bench_complete_cases(bench_case_t* cases, size_t max)
+{
+    static const size_t key_lens[] = { 16, 32 };
+    size_t n = 0;
+    for(int alg = 0; alg < MAC_ALG_COUNT; ++alg) {
+        for(size_t i = 0; i < sizeof(key_lens)/sizeof(key_lens[0]) && n < max; ++i) {
+            if(key_lens[i] > mac_algs[alg].key_len) continue;
+            cases[n++] = (bench_case_t){
+                "margo_auth_complete_types.h", mac_algs[alg].name, key_lens[i],
+                setup, teardown, create, check, alg
+            };
+        }
+    }
+    return n;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+#include "margo_auth_mac_types.h"
+#include "bench_tokens.h"
+
+typedef struct {
+    unsigned char key[64];
+    size_t        key_len;
+    token_t       token;
+    token_t       valid; // token for seq_no 0
+} state_t;
+
+static void* setup(const unsigned char* key, size_t key_len, int algorithm)
+{
+    (void)algorithm;
+    state_t* state = calloc(1, sizeof(*state));
+    memcpy(state->key, key, key_len);
+    state->key_len = key_len;
+    create_token(&state->valid, 1000, 0, (const char*)state->key, state->key_len);
+    return state;
+}
+
+static void teardown(void* state)
+{
+    free(state);
+}
+
+static int create(void* s, uint64_t seq_no)
+{
+    state_t* state = (state_t*)s;
+    create_token(&state->token, 1000, seq_no, (const char*)state->key, state->key_len);
+    return 0;
+}
+
+static int check(void* s, uint64_t seq_no)
+{
+    (void)seq_no;
+    state_t* state = (state_t*)s;
+    return check_token(&state->valid, 1000, 0, (const char*)state->key, state->key_len);
+}
+
+size_t bench_mac_cases(bench_case_t* cases, size_t max)
+{
+    static const size_t key_lens[] = { 16, 32, 64 };
+    size_t n = 0;
+    for(size_t i = 0; i < sizeof(key_lens)/sizeof(key_lens[0]) && n < max; ++i) {
+        cases[n++] = (bench_case_t){
+            "margo_auth_mac_types.h", "hmac-sha512", key_lens[i],
+            setup, teardown, create, check, 0
+        };
+    }
+    return n;
+}
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <abt.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_verifier.h"
+
+/* Measures the throughput and the latency of token verification through
+ * the batching verifier, as a function of the batch size. ULTs spread
+ * over several execution streams stand for the handlers of hello RPCs:
+ * each one has a session of its own, and verifies its tokens one after
+ * the other with verifier_check, the tokens being signed in advance so
+ * that only the server's side is measured. A batch size of 0 is the
+ * handler calling check_token itself. One JSON object is printed per
+ * case:
+ *
+ *   {"batch": ..., "window_us": ..., "kernel": "hmac_x8"|"check_token",
+ *    "xstreams": ..., "ults": ..., "checks": ..., "rejected": ...,
+ *    "checks_per_sec": ..., "latency_us": {"p50": ..., "p99": ..., "p999": ...}}
+ *
+ * where ults is the number of ULTs per execution stream, kernel how the
+ * HMAC-SHA-256 tags of a batch were computed, and latency_us the time
+ * spent in verifier_check by each token. */
+
+#define BENCH_TOKENS_PER_ULT 1024
+
+typedef struct {
+    verifier_t       verifier;
+    mac_t*           macs;     /* one per ULT */
+    unsigned char*   digests;  /* args_digest of each token of a ULT */
+    unsigned char*   tags;     /* tag of each token of each ULT */
+    uint64_t         checks_per_ult;
+    double*          latencies;
+    _Atomic uint64_t rejected;
+    _Atomic int      ready;
+    _Atomic int      go;
+} bench_t;
+
+typedef struct {
+    bench_t* bench;
+    size_t   index;
+} ult_arg_t;
+
+static void run_ult(void* a)
+{
+    ult_arg_t*     arg   = (ult_arg_t*)a;
+    bench_t*       bench = arg->bench;
+    const mac_t*   mac   = &bench->macs[arg->index];
+    double*        lat   = bench->latencies + arg->index * bench->checks_per_ult;
+    const uint8_t* tags  = bench->tags + arg->index * BENCH_TOKENS_PER_ULT * TOKEN_DEFAULT_TAG_LEN;
+    token_t        token;
+    memset(&token, 0, sizeof(token));
+    token.tag_len = TOKEN_DEFAULT_TAG_LEN;
+
+    atomic_fetch_add(&bench->ready, 1);
+    while(!atomic_load(&bench->go)) ABT_thread_yield();
+
+    for(uint64_t i = 0; i < bench->checks_per_ult; ++i) {
+        uint64_t seq_no = i % BENCH_TOKENS_PER_ULT;
+        memcpy(token.tag, tags + seq_no * TOKEN_DEFAULT_TAG_LEN, TOKEN_DEFAULT_TAG_LEN);
+        memcpy(token.args_digest, bench->digests + seq_no * ARGS_DIGEST_SIZE, ARGS_DIGEST_SIZE);
+        double t0 = ABT_get_wtime();
+        if(verifier_check(&bench->verifier, &token, arg->index + 1, seq_no, mac) != 0)
+            atomic_fetch_add(&bench->rejected, 1);
+        lat[i] = ABT_get_wtime() - t0;
+    }
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int run_case(FILE* out, bench_t* bench, size_t batch, double window,
+                    int num_xstreams, int ults_per_xstream)
+{
+    ABT_xstream xstreams[num_xstreams];
+    ABT_pool    pools[num_xstreams];
+    size_t      num_ults = (size_t)num_xstreams * ults_per_xstream;
+    uint64_t    checks   = num_ults * bench->checks_per_ult;
+    ABT_thread* ults     = (ABT_thread*)calloc(num_ults, sizeof(*ults));
+    ult_arg_t*  args     = (ult_arg_t*)calloc(num_ults, sizeof(*args));
+
+    memset(&bench->verifier, 0, sizeof(bench->verifier));
+    verifier_start(&bench->verifier, batch, window);
+    atomic_store(&bench->rejected, 0);
+    atomic_store(&bench->ready, 0);
+    atomic_store(&bench->go, 0);
+
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_create(ABT_SCHED_NULL, &xstreams[x]);
+        ABT_xstream_get_main_pools(xstreams[x], 1, &pools[x]);
+    }
+    for(size_t u = 0; u < num_ults; ++u) {
+        args[u] = (ult_arg_t){ bench, u };
+        ABT_thread_create(pools[u % num_xstreams], run_ult, &args[u], ABT_THREAD_ATTR_NULL, &ults[u]);
+    }
+    while(atomic_load(&bench->ready) != (int)num_ults) ;
+    double t0 = ABT_get_wtime();
+    atomic_store(&bench->go, 1);
+    for(size_t u = 0; u < num_ults; ++u) {
+        ABT_thread_join(ults[u]);
+        ABT_thread_free(&ults[u]);
+    }
+    double elapsed = ABT_get_wtime() - t0;
+    for(int x = 0; x < num_xstreams; ++x) {
+        ABT_xstream_join(xstreams[x]);
+        ABT_xstream_free(&xstreams[x]);
+    }
+    verifier_stop(&bench->verifier);
+
+    qsort(bench->latencies, checks, sizeof(double), compare_doubles);
+    fprintf(out, "{\"batch\": %zu, \"window_us\": %.1f, \"kernel\": \"%s\", \"xstreams\": %d, "
+                 "\"ults\": %d, \"checks\": %lu, \"rejected\": %lu, \"checks_per_sec\": %.0f, "
+                 "\"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f}}\n",
+            batch, window * 1e6, batch && bench->verifier.use_x8 ? "hmac_x8" : "check_token",
+            num_xstreams, ults_per_xstream, (unsigned long)checks,
+            (unsigned long)atomic_load(&bench->rejected), checks / elapsed,
+            bench->latencies[checks / 2] * 1e6, bench->latencies[checks * 99 / 100] * 1e6,
+            bench->latencies[checks * 999 / 1000] * 1e6);
+    fflush(out);
+    free(args);
+    free(ults);
+    return atomic_load(&bench->rejected) == 0 ? 0 : -1;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Options:\n"
+        "  -n <checks>       checks per ULT and case (default: 20000)\n"
+        "  -b <n>,...        batch sizes, 0 for no batching (default: 0,1,8,16,32)\n"
+        "  -w <us>           maximum time a token waits for its batch (default: 50)\n"
+        "  -x <n>,...        numbers of execution streams (default: 1,4)\n"
+        "  -u <n>            ULTs per execution stream (default: 16)\n"
+        "  -o <file>         write the results to this file (default: stdout)\n",
+        program);
+    exit(-1);
+}
+
+int main(int argc, char** argv)
+{
+    bench_t bench        = {0};
+    size_t  batches[16]  = { 0, 1, 8, 16, 32 };
+    int     num_batches  = 0;
+    int     xstreams[16] = { 1, 4 };
+    int     num_xstreams = 0;
+    int     ults_per_xstream = 16;
+    double  window       = 50e-6;
+    FILE*   out          = stdout;
+    int     ret          = 0;
+
+    bench.checks_per_ult = 20000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:b:w:x:u:o:")) != -1) {
+        switch(opt) {
+        case 'n':
+            bench.checks_per_ult = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            for(char* n = strtok(optarg, ","); n && num_batches < 16; n = strtok(NULL, ","))
+                batches[num_batches++] = strtoul(n, NULL, 10);
+            break;
+        case 'w':
+            window = atof(optarg) * 1e-6;
+            break;
+        case 'x':
+            for(char* n = strtok(optarg, ","); n && num_xstreams < 16; n = strtok(NULL, ","))
+                xstreams[num_xstreams++] = atoi(n);
+            break;
+        case 'u':
+            ults_per_xstream = atoi(optarg);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if(!out) {
+                perror(optarg);
+                exit(-1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(bench.checks_per_ult == 0 || ults_per_xstream <= 0) usage(argv[0]);
+    if(num_batches == 0) num_batches = 5;
+    if(num_xstreams == 0) num_xstreams = 2;
+
+    ABT_init(0, NULL);
+
+    // a session per ULT, and the tokens of each session signed in advance
+    int max_xstreams = 0;
+    for(int x = 0; x < num_xstreams; ++x)
+        if(xstreams[x] > max_xstreams) max_xstreams = xstreams[x];
+    size_t max_ults = (size_t)max_xstreams * ults_per_xstream;
+    bench.macs      = (mac_t*)calloc(max_ults, sizeof(*bench.macs));
+    bench.digests   = (unsigned char*)malloc(BENCH_TOKENS_PER_ULT * ARGS_DIGEST_SIZE);
+    bench.tags      = (unsigned char*)malloc(max_ults * BENCH_TOKENS_PER_ULT * TOKEN_DEFAULT_TAG_LEN);
+    bench.latencies = (double*)malloc(max_ults * bench.checks_per_ult * sizeof(double));
+    if(!bench.macs || !bench.digests || !bench.tags || !bench.latencies) return 1;
+    RAND_bytes(bench.digests, BENCH_TOKENS_PER_ULT * ARGS_DIGEST_SIZE);
+    for(size_t u = 0; u < max_ults; ++u) {
+        unsigned char key[32];
+        RAND_bytes(key, sizeof(key));
+        if(mac_init(&bench.macs[u], MAC_HMAC_SHA256, TOKEN_DEFAULT_TAG_LEN, key, sizeof(key)) != 0)
+            return 1;
+        for(uint64_t seq_no = 0; seq_no < BENCH_TOKENS_PER_ULT; ++seq_no) {
+            unsigned char* tag = bench.tags + (u * BENCH_TOKENS_PER_ULT + seq_no) * TOKEN_DEFAULT_TAG_LEN;
+            unsigned char  full[EVP_MAX_MD_SIZE];
+            compute_tag(&bench.macs[u], u + 1, seq_no, bench.digests + seq_no * ARGS_DIGEST_SIZE, full);
+            memcpy(tag, full, TOKEN_DEFAULT_TAG_LEN);
+        }
+    }
+
+    for(int x = 0; x < num_xstreams; ++x) {
+        if(xstreams[x] <= 0) continue;
+        for(int b = 0; b < num_batches; ++b)
+            ret |= run_case(out, &bench, batches[b], window, xstreams[x], ults_per_xstream);
+    }
+
+    for(size_t u = 0; u < max_ults; ++u) mac_destroy(&bench.macs[u]);
+    free(bench.macs);
+    free(bench.digests);
+    free(bench.tags);
+    free(bench.latencies);
+    ABT_finalize();
+
+    if(out != stdout) fclose(out);
+    return ret ? 1 : 0;
+}
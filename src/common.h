@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <pwd.h>
+#include <sys/types.h>
 
 #define ASSERT(cond, ...) do {        \
     if(!(cond)) {                     \
@@ -8,3 +10,10 @@
         goto finish;                  \
     }                                 \
 } while(0)
+
+/* Returns the name of a user, or "?" if the uid has no passwd entry. */
+static inline const char* user_name(uid_t uid)
+{
+    struct passwd* pws = getpwuid(uid);
+    return pws ? pws->pw_name : "?";
+}
@@ -0,0 +1,181 @@
+#ifndef MARGO_AUTH_COMPLETE_AUTH_POOL_H
+#define MARGO_AUTH_COMPLETE_AUTH_POOL_H
+
+#include <margo.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "margo_auth_complete_types.h"
+
+/* munge_decode makes a blocking round-trip to munged over a UNIX socket,
+ * which blocks the execution stream of the ULT calling it, and with it
+ * every ULT queued on that execution stream: the hello and close RPCs of
+ * sessions already open, and, when margo runs its handlers in the
+ * progress pool, Mercury's progress loop itself. Authentications
+ * therefore run in a pool of their own, served by dedicated execution
+ * streams, so that a storm of authentications only ever delays other
+ * authentications, while the RPCs of open sessions keep running on
+ * margo's handler pool.
+ *
+ * The authenticate handler itself runs in margo's handler pool, and only
+ * admits the authentication into the pool (auth_pool_handle, which calls
+ * auth_pool_admit, then auth_pool_run): the number of authentications
+ * queued or running is bounded, and beyond it the handler answers right
+ * away, without decoding the credential, that the client should retry
+ * after a delay, rather than letting the queue, and the load on munged,
+ * grow until the clients time out. The delay is the time the pool would take to drain
+ * a full queue, estimated from a moving average of the time taken by
+ * the last authentications.
+ *
+ * The pool and its schedulers are the "wait" variants, so idle
+ * authentication execution streams sleep instead of spinning. With 0
+ * execution streams, authentications run in the handler, in margo's
+ * handler pool, as the other RPCs do. */
+
+#define AUTH_POOL_DEFAULT_XSTREAMS 1
+#define AUTH_POOL_DEFAULT_QUEUE    64    /* authentications queued or running */
+#define AUTH_RETRY_MIN_MS          1
+#define AUTH_RETRY_MAX_MS          1000
+#define AUTH_DEFAULT_SERVICE_US    1000  /* until authentications have been timed */
+
+typedef struct {
+    ABT_pool         pool;          /* ABT_POOL_NULL for margo's handler pool */
+    ABT_xstream*     xstreams;
+    int              num_xstreams;
+    size_t           capacity;      /* of the queue, 0 for no limit */
+    _Atomic size_t   admitted;      /* authentications queued or running */
+    _Atomic uint64_t service_us;    /* moving average of the time taken by one */
+} auth_pool_t;
+
+static inline int auth_pool_start(auth_pool_t* auth_pool, int num_xstreams, size_t capacity)
+{
+    auth_pool->pool         = ABT_POOL_NULL;
+    auth_pool->xstreams     = NULL;
+    auth_pool->num_xstreams = 0;
+    auth_pool->capacity     = capacity;
+    atomic_init(&auth_pool->admitted, 0);
+    atomic_init(&auth_pool->service_us, AUTH_DEFAULT_SERVICE_US);
+    if(num_xstreams <= 0) return 0;
+
+    if(ABT_pool_create_basic(ABT_POOL_FIFO_WAIT, ABT_POOL_ACCESS_MPMC, ABT_TRUE,
+                             &auth_pool->pool) != ABT_SUCCESS)
+        return -1;
+    auth_pool->xstreams = (ABT_xstream*)calloc(num_xstreams, sizeof(*auth_pool->xstreams));
+    if(!auth_pool->xstreams) goto error;
+    for(int i = 0; i < num_xstreams; ++i) {
+        if(ABT_xstream_create_basic(ABT_SCHED_BASIC_WAIT, 1, &auth_pool->pool,
+                                    ABT_SCHED_CONFIG_NULL, &auth_pool->xstreams[i]) != ABT_SUCCESS)
+            goto error;
+        auth_pool->num_xstreams = i + 1;
+    }
+    return 0;
+
+error:
+    if(auth_pool->num_xstreams == 0) {
+        // no scheduler owns the pool yet
+        ABT_pool_free(&auth_pool->pool);
+        free(auth_pool->xstreams);
+        auth_pool->xstreams = NULL;
+        return -1;
+    }
+    for(int i = 0; i < auth_pool->num_xstreams; ++i) {
+        ABT_xstream_join(auth_pool->xstreams[i]);
+        ABT_xstream_free(&auth_pool->xstreams[i]);
+    }
+    free(auth_pool->xstreams);
+    auth_pool->xstreams     = NULL;
+    auth_pool->num_xstreams = 0;
+    auth_pool->pool         = ABT_POOL_NULL;
+    return -1;
+}
+
+/* Admits an authentication, which must then be run with auth_pool_run
+ * and end with auth_pool_release, or with auth_pool_cancel if it could
+ * not be run. Returns -1 if the queue is full, in
+ * which case retry_after_ms is set to the delay the client should wait
+ * before trying again. */
+static inline int auth_pool_admit(auth_pool_t* auth_pool, uint32_t* retry_after_ms)
+{
+    size_t admitted = atomic_fetch_add_explicit(&auth_pool->admitted, 1, memory_order_relaxed);
+    if(auth_pool->capacity == 0 || admitted < auth_pool->capacity) return 0;
+    atomic_fetch_sub_explicit(&auth_pool->admitted, 1, memory_order_relaxed);
+
+    uint64_t streams = auth_pool->num_xstreams ? (uint64_t)auth_pool->num_xstreams : 1;
+    uint64_t drain   = (auth_pool->capacity
+                        * atomic_load_explicit(&auth_pool->service_us, memory_order_relaxed)
+                        / streams + 999) / 1000; // in ms, rounded up
+    *retry_after_ms = drain < AUTH_RETRY_MIN_MS ? AUTH_RETRY_MIN_MS
+                    : drain > AUTH_RETRY_MAX_MS ? AUTH_RETRY_MAX_MS
+                    : (uint32_t)drain;
+    return -1;
+}
+
+/* Runs an admitted authentication in the pool, or right away in the
+ * calling ULT if authentications have no execution streams of their
+ * own. */
+static inline int auth_pool_run(auth_pool_t* auth_pool, void (*fn)(void*), void* arg)
+{
+    if(auth_pool->pool == ABT_POOL_NULL) {
+        fn(arg);
+        return 0;
+    }
+    return ABT_thread_create(auth_pool->pool, fn, arg, ABT_THREAD_ATTR_NULL, NULL)
+        == ABT_SUCCESS ? 0 : -1;
+}
+
+/* Ends an admitted authentication, which started running at `started`
+ * (ABT_get_wtime), accounting for its time in the moving average. */
+static inline void auth_pool_release(auth_pool_t* auth_pool, double started)
+{
+    uint64_t sample  = (uint64_t)((ABT_get_wtime() - started) * 1e6);
+    uint64_t average = atomic_load_explicit(&auth_pool->service_us, memory_order_relaxed);
+    // concurrent updates may lose a sample, which is fine for an estimate
+    atomic_store_explicit(&auth_pool->service_us, average - average / 8 + sample / 8,
+                          memory_order_relaxed);
+    atomic_fetch_sub_explicit(&auth_pool->admitted, 1, memory_order_relaxed);
+}
+
+/* Ends an admitted authentication that could not be run, leaving the
+ * moving average alone. */
+static inline void auth_pool_cancel(auth_pool_t* auth_pool)
+{
+    atomic_fetch_sub_explicit(&auth_pool->admitted, 1, memory_order_relaxed);
+}
+
+/* Handles an authenticate RPC: admits it and runs fn(handle) in the pool,
+ * which must respond and end with auth_pool_release, or, if it can't be
+ * admitted or run, answers it right away without decoding its credential,
+ * with RPC_ERR_RETRY_AFTER if the queue is full. */
+static inline void auth_pool_handle(auth_pool_t* auth_pool, hg_handle_t handle, void (*fn)(void*))
+{
+    auth_out_t out = {0};
+
+    if(auth_pool_admit(auth_pool, &out.retry_after) != 0) {
+        out.ret = RPC_ERR_RETRY_AFTER;
+    } else if(auth_pool_run(auth_pool, fn, handle) != 0) {
+        auth_pool_cancel(auth_pool);
+        fprintf(stderr, "Could not queue authentication\n");
+        out.ret = -1;
+    } else {
+        return; // fn responds
+    }
+    margo_respond(handle, &out);
+    margo_destroy(handle);
+}
+
+/* Waits for the pending authentications and stops the execution
+ * streams, which frees the pool. */
+static inline void auth_pool_stop(auth_pool_t* auth_pool)
+{
+    for(int i = 0; i < auth_pool->num_xstreams; ++i) {
+        ABT_xstream_join(auth_pool->xstreams[i]);
+        ABT_xstream_free(&auth_pool->xstreams[i]);
+    }
+    free(auth_pool->xstreams);
+    auth_pool->xstreams     = NULL;
+    auth_pool->num_xstreams = 0;
+    auth_pool->pool         = ABT_POOL_NULL;
+}
+
+#endif
@@ -2,42 +2,140 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <munge.h>
+#include <getopt.h>
 #include <openssl/rand.h>
 #include "common.h"
 #include "margo_auth_complete_types.h"
+#include "margo_auth_complete_connection.h"
+#include "margo_auth_complete_destinations.h"
+#include "margo_auth_complete_credentials.h"
 
 typedef struct {
-    margo_instance_id mid;
-    hg_id_t           auth_id;
-    hg_id_t           hello_id;
-    hg_id_t           close_id;
-} client_t;
-
-typedef struct {
-    const client_t* client;
-    hg_addr_t       server_addr;
-    session_id_t    session_id;
-    uint64_t        seq_no;
-    unsigned char   key[32];
-} connection_t;
-
-static int client_authenticate(const client_t* client, const char* address, connection_t* connection);
+    mac_alg_t  mac_alg;    /* MAC algorithm proposed to the server */
+    uint8_t    tag_len;    /* number of MAC bytes sent in tokens */
+    size_t     precompute; /* number of tokens to prepare ahead, 0 to disable */
+    aead_alg_t aead_alg;   /* AEAD algorithm sealing the RPCs, AEAD_NONE to disable */
+    credential_backend_t* backend; /* encodes the credentials */
+} connection_options_t;
+
+static int client_authenticate(const client_t* client, const char* address,
+                               const connection_options_t* options, connection_t* connection);
+static int client_authenticate_multi(const client_t* client, const char* const* addresses,
+                                     size_t num_addresses, const connection_options_t* options,
+                                     connection_t** connections);
+static int client_share_session(const connection_t* from, const char* address,
+                                connection_t* connection);
 static int client_hello(connection_t* connection, const char* name);
 static int client_close_session(connection_t* connection);
 
-int main(int argc, char** argv)
+static void usage(const char* program)
 {
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s <server-address>\n", argv[0]);
-        exit(-1);
-    }
+    fprintf(stderr,
+        "Usage: %s <server-address> [options]\n"
+        "Options:\n"
+        "  --credentials=<spec>  credential backend, munge or local:<key file>[:<latency in us>]\n"
+        "                        (default: munge)\n"
+        "  --mac=<alg>           MAC algorithm to propose to the server (default: hmac-sha512)\n"
+        "  --tag-len=<bytes>     number of MAC bytes sent in tokens (default: %d)\n"
+        "  --precompute=<n>      prepare the tokens of the next n RPCs ahead of time (default: 0)\n"
+        "  --aead=<alg>          encrypt the RPCs with aes-256-gcm or chacha20-poly1305 (default: none)\n"
+        "  --also=<address>      also say hello to this server, which must share its sessions with\n"
+        "                        the first one (--shared-sessions) or be in its group (--group-keys)\n"
+        "  --pipeline=<n>        then say hello n more times with all the RPCs in flight at once\n"
+        "                        (default: 0)\n"
+        "  --multi=<address>,... authenticate with these servers too, with the same munge\n"
+        "                        credential, and say hello to each of them\n",
+        program, TOKEN_DEFAULT_TAG_LEN);
+    exit(-1);
+}
 
+int main(int argc, char** argv)
+{
     int          ret        = 0;
     client_t     client     = {0};
     connection_t connection = {0};
-    const char* server      = argv[1];
+    connection_t other      = {0};
+    const char* server      = NULL;
+    const char* also        = NULL;
+    char* multi             = NULL;
+    const char** addresses  = NULL;
+    connection_t** targets  = NULL;
+    size_t num_targets      = 1;
     char protocol[16]       = {0};
+    int tag_len             = TOKEN_DEFAULT_TAG_LEN;
+    size_t pipeline         = 0;
+    request_t* requests     = NULL;
+    const char* credentials = "munge";
+    credential_backend_t backend = {0};
+
+    connection_options_t options = {
+        .mac_alg    = MAC_HMAC_SHA512,
+        .tag_len    = TOKEN_DEFAULT_TAG_LEN,
+        .precompute = 0,
+        .aead_alg   = AEAD_NONE,
+        .backend    = &backend
+    };
+
+    static const struct option long_options[] = {
+        { "credentials", required_argument, NULL, 'B' },
+        { "mac",        required_argument, NULL, 'm' },
+        { "tag-len",    required_argument, NULL, 't' },
+        { "precompute", required_argument, NULL, 'p' },
+        { "aead",       required_argument, NULL, 'a' },
+        { "also",       required_argument, NULL, 'A' },
+        { "pipeline",   required_argument, NULL, 'P' },
+        { "multi",      required_argument, NULL, 'M' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch(opt) {
+        case 'B':
+            credentials = optarg;
+            break;
+        case 'm':
+            if(mac_alg_from_name(optarg, &options.mac_alg) != 0) {
+                fprintf(stderr, "Unknown MAC algorithm %s, valid algorithms are:", optarg);
+                for(int i = 0; i < MAC_ALG_COUNT; ++i) fprintf(stderr, " %s", mac_algs[i].name);
+                fprintf(stderr, "\n");
+                exit(-1);
+            }
+            break;
+        case 't':
+            tag_len = atoi(optarg);
+            if(tag_len < TOKEN_MIN_TAG_LEN || tag_len > EVP_MAX_MD_SIZE) {
+                fprintf(stderr, "Tag length should be between %d and %d bytes\n",
+                        TOKEN_MIN_TAG_LEN, EVP_MAX_MD_SIZE);
+                exit(-1);
+            }
+            options.tag_len = (uint8_t)tag_len;
+            break;
+        case 'p':
+            options.precompute = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            if(aead_alg_from_name(optarg, &options.aead_alg) != 0) {
+                fprintf(stderr, "Unknown AEAD algorithm %s, valid algorithms are:", optarg);
+                for(int i = 0; i < AEAD_ALG_COUNT; ++i) fprintf(stderr, " %s", aead_alg_names[i]);
+                fprintf(stderr, "\n");
+                exit(-1);
+            }
+            break;
+        case 'A':
+            also = optarg;
+            break;
+        case 'P':
+            pipeline = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            multi = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1) usage(argv[0]);
+    server = argv[optind];
 
     for(int i=0; i < 16 && server[i] && server[i] != ':'; ++i) protocol[i] = server[i];
     protocol[15] = '\0';
@@ -47,13 +145,35 @@ int main(int argc, char** argv)
     ASSERT(client.mid != MARGO_INSTANCE_NULL,
            "Could not initialize margo with protocol %s\n", protocol);
 
+    // set up the backend encoding the credentials
+    ret = credential_backend_init(&backend, credentials);
+    ASSERT(ret == 0, "Could not set up credential backend %s\n", credentials);
+
     // register RPCs
     client.auth_id  = MARGO_REGISTER(client.mid, "authenticate", auth_in_t, auth_out_t, NULL);
     client.hello_id = MARGO_REGISTER(client.mid, "hello", hello_in_t, hello_out_t, NULL);
     client.close_id = MARGO_REGISTER(client.mid, "close", close_in_t, close_out_t, NULL);
 
-    // authenticate, initializing a connection_t instance
-    ret = client_authenticate(&client, server, &connection);
+    // authenticate, initializing a connection_t instance, and with the
+    // other servers, if any, with the same credential
+    if(multi) {
+        for(const char* c = multi; *c; ++c) num_targets += *c == ',';
+        num_targets += 1;
+        addresses = (const char**)calloc(num_targets, sizeof(*addresses));
+        targets   = (connection_t**)calloc(num_targets, sizeof(*targets));
+        ASSERT(addresses && targets, "Could not allocate connections\n");
+        addresses[0] = server;
+        targets[0]   = &connection;
+        num_targets  = 1;
+        for(char* address = strtok(multi, ","); address; address = strtok(NULL, ",")) {
+            targets[num_targets] = (connection_t*)calloc(1, sizeof(connection_t));
+            ASSERT(targets[num_targets], "Could not allocate connections\n");
+            addresses[num_targets++] = address;
+        }
+        ret = client_authenticate_multi(&client, addresses, num_targets, &options, targets);
+    } else {
+        ret = client_authenticate(&client, server, &options, &connection);
+    }
     ASSERT(ret == 0, "Could not authenticate\n");
 
     // say hello multiple times using the connection_t instance
@@ -66,42 +186,145 @@ int main(int argc, char** argv)
     ret = client_hello(&connection, "Rob");
     ASSERT(ret == 0, "client_hello(\"Rob\") failed\n");
 
+    // say hello without waiting for each response, the server accepting
+    // the sequence numbers in any order within its replay window
+    if(pipeline) {
+        size_t issued = 0;
+        requests = (request_t*)calloc(pipeline, sizeof(*requests));
+        for(; issued < pipeline; ++issued)
+            if(client_hello_issue(&connection, "Matthieu", &requests[issued]) != 0) break;
+        ret = request_wait_all(requests, issued);
+        ASSERT(ret == 0 && issued == pipeline, "Pipelined client_hello failed\n");
+    }
+
+    // use the same session with another server of the node, without
+    // authenticating again
+    if(also) {
+        ret = client_share_session(&connection, also, &other);
+        ASSERT(ret == 0, "Could not share session with %s\n", also);
+        ret = client_hello(&other, "Matthieu");
+        ASSERT(ret == 0, "client_hello(\"Matthieu\") failed on %s\n", also);
+    }
+
+    // say hello to the other destinations of the credential
+    for(size_t i = 1; i < num_targets; ++i) {
+        ret = client_hello(targets[i], "Matthieu");
+        ASSERT(ret == 0, "client_hello(\"Matthieu\") failed on %s\n", addresses[i]);
+        ret = client_close_session(targets[i]);
+        ASSERT(ret == 0, "client_close_session failed on %s\n", addresses[i]);
+    }
+
     ret = client_close_session(&connection);
     ASSERT(ret == 0, "client_close_session failed\n");
 
 finish:
-    // cleanup
+    // cleanup, stopping the token rings of the connections left open by
+    // an error before margo_finalize waits for its ULTs
+    connection_destroy(&connection);
+    connection_destroy(&other);
+    for(size_t i = 1; targets && i < num_targets; ++i) {
+        if(targets[i]) connection_destroy(targets[i]);
+        free(targets[i]);
+    }
+    free(targets);
+    free(addresses);
+    free(requests);
+    credential_backend_finalize(&backend);
     margo_finalize(client.mid);
     return ret;
 }
 
-int client_authenticate(const client_t* client, const char* address, connection_t* connection)
+/* Has the credential backend encode the credential of an authenticate
+ * RPC, whose payload is a new random key, the session parameters and the
+ * destinations. */
+static int encode_credential(const connection_options_t* options,
+                             const char* destinations, size_t destinations_len,
+                             unsigned char key[32], char** credential)
+{
+    int         ret        = 0;
+    char*       payload    = NULL;
+    uint8_t     params[3]  = { (uint8_t)options->mac_alg, options->tag_len,
+                               (uint8_t)options->aead_alg };
+    size_t      payload_len = 32 + sizeof(params) + destinations_len;
+
+    // create a random key for this connection
+    ret = RAND_bytes(key, 32);
+    ASSERT(ret == 1, "Error generating random key for new connection\n");
+    ret = 0;
+
+    // make the payload (client key + MAC algorithm + tag length + AEAD algorithm
+    // + server address, or list of server addresses)
+    // for the backend to encode
+    payload = (char*)calloc(payload_len, 1);
+    ASSERT(payload != NULL, "Could not allocate credential payload\n");
+    memcpy(payload, key, 32);
+    memcpy(payload + 32, params, sizeof(params));
+    memcpy(payload + 32 + sizeof(params), destinations, destinations_len);
+
+    // have the backend encode the payload
+    ret = options->backend->encode(options->backend, payload, payload_len, credential);
+    ASSERT(ret == 0, "Could not encode credential with %s\n", options->backend->name);
+
+finish:
+    if(payload) OPENSSL_cleanse(payload, payload_len);
+    free(payload);
+    return ret;
+}
+
+/* Sets the fields of a connection from the response to its
+ * authenticate RPC. */
+static int connection_setup(const client_t* client, const connection_options_t* options,
+                            const unsigned char key[32], const auth_out_t* out,
+                            hg_addr_t server_addr, connection_t* connection)
+{
+    int ret = 0;
+    connection->client     = client;
+    connection->session_id = out->session_id;
+    connection->seq_no     = 0;
+    memcpy(connection->key, key, sizeof(connection->key));
+    if(out->group)
+        connection->group_ticket = out->ticket;
+    else
+        connection->ticket = out->ticket;
+    ret = mac_init(&connection->mac, options->mac_alg, options->tag_len, key, 32);
+    ASSERT(ret == 0, "Could not initialize MAC state for connection\n");
+    ret = aead_init(&connection->aead, options->aead_alg, key, 32);
+    ASSERT(ret == 0, "Could not derive AEAD key for connection\n");
+    connection->aead_counter = 0;
+    if(options->precompute) {
+        connection->ring = (token_ring_t*)calloc(1, sizeof(*connection->ring));
+        ASSERT(connection->ring != NULL, "Could not allocate token ring for connection\n");
+        ret = token_ring_start(connection->ring, client->mid, &connection->mac,
+                               connection->session_id, 0, options->precompute);
+        if(ret != 0) {
+            free(connection->ring);
+            connection->ring = NULL;
+        }
+        ASSERT(ret == 0, "Could not start preparing tokens for connection\n");
+    }
+    margo_addr_dup(client->mid, server_addr, &connection->server_addr);
+
+finish:
+    // a connection that could not be set up is left zeroed
+    if(ret != 0) connection_destroy(connection);
+    return ret;
+}
+
+int client_authenticate(const client_t* client, const char* address,
+                        const connection_options_t* options, connection_t* connection)
 {
     int         ret       = 0;
     hg_return_t hret      = HG_SUCCESS;
     hg_handle_t handle    = HG_HANDLE_NULL;
     hg_addr_t server_addr = HG_ADDR_NULL;
-    munge_err_t err       = EMUNGE_SUCCESS;
     unsigned char key[32] = {0};
-    char* payload         = NULL;
-    size_t addr_len       = strlen(address);
-    size_t payload_len    = sizeof(key) + addr_len;
     auth_in_t   in        = {0};
     auth_out_t  out       = {0};
+    auth_backoff_t backoff = {0};
 
-    // create a random key for this connection
-    ret = RAND_bytes(key, sizeof(key));
-    ASSERT(ret == 1, "Error generating random key for new connection\n");
-
-    // make the payload (client key + server address) for munge to encode
-    payload = (char*)calloc(payload_len, 1);
-    memcpy(payload, key, sizeof(key));
-    mempcpy(payload + sizeof(key), address, addr_len);
-
-    // have munge encode the payload
-    err = munge_encode(&in.credential, NULL, payload, payload_len);
-    ASSERT(err == EMUNGE_SUCCESS,
-           "munge_encode failed: %s\n", munge_strerror(err));
+    // encode a credential for this server
+    ret = encode_credential(options, address, strlen(address), key, &in.credential);
+    ASSERT(ret == 0, "Could not encode credential for %s\n", address);
 
     // lookup the server's address
     hret = margo_addr_lookup(client->mid, address, &server_addr);
@@ -115,32 +338,36 @@ int client_authenticate(const client_t* client, const char* address, connection_
             "margo_create failed with error: %s\n",
             HG_Error_to_string(hret));
 
-    // send the RPC
-    hret = margo_forward(handle, &in);
-    ASSERT(hret == HG_SUCCESS,
-           "margo_forward failed with error: %s\n",
-           HG_Error_to_string(hret));
-
-    // get output from the RPC
-    hret = margo_get_output(handle, &out);
-    ASSERT(hret == HG_SUCCESS,
-           "margo_get_output failed with error: %s\n",
-           HG_Error_to_string(hret));
+    for(;;) {
+        // send the RPC
+        hret = margo_forward(handle, &in);
+        ASSERT(hret == HG_SUCCESS,
+               "margo_forward failed with error: %s\n",
+               HG_Error_to_string(hret));
+
+        // get output from the RPC
+        hret = margo_get_output(handle, &out);
+        ASSERT(hret == HG_SUCCESS,
+               "margo_get_output failed with error: %s\n",
+               HG_Error_to_string(hret));
+        if(out.ret != RPC_ERR_RETRY_AFTER) break;
+
+        // the server is busy, try again later
+        double delay = auth_backoff_next(&backoff, out.retry_after);
+        margo_free_output(handle, &out);
+        memset(&out, 0, sizeof(out));
+        ASSERT(delay >= 0, "%s still busy after %u attempts\n", address, backoff.attempts);
+        margo_thread_sleep(client->mid, delay);
+    }
 
     ret = out.ret;
 
     // set the fields of the connection_t argument
-    if(ret == 0) {
-        connection->client     = client;
-        connection->session_id = out.session_id;
-        connection->seq_no     = 0;
-        memcpy(connection->key, key, sizeof(key));
-        margo_addr_dup(client->mid, server_addr, &connection->server_addr);
-    }
+    if(ret == 0) ret = connection_setup(client, options, key, &out, server_addr, connection);
 
 finish:
     // cleanup
-    free(payload);
+    OPENSSL_cleanse(key, sizeof(key));
     free(in.credential);
     margo_free_output(handle, &out);
     margo_destroy(handle);
@@ -148,99 +375,167 @@ finish:
     return ret;
 }
 
-int client_hello(connection_t* connection, const char* name)
+/* Authenticates with several servers at once with a single munge
+ * credential listing all of them, sending the authenticate RPCs to all
+ * the servers before waiting for the responses. Each connection uses the
+ * key derived for its server from the key of the credential. On error,
+ * the connections already set up are destroyed. */
+int client_authenticate_multi(const client_t* client, const char* const* addresses,
+                              size_t num_addresses, const connection_options_t* options,
+                              connection_t** connections)
 {
-    int         ret    = 0;
-    hg_handle_t handle = HG_HANDLE_NULL;
-    hg_return_t hret   = HG_SUCCESS;
-    hello_in_t   in    = {0};
-    hello_out_t  out   = {0};
-
-    // create the token for the RPC
-    create_token(&in.token,
-                 connection->session_id,
-                 connection->seq_no,
-                 (const char*)connection->key,
-                 sizeof(connection->key));
-    in.name = (char*)name;
-
-    // create the RPC handle
-    hret = margo_create(connection->client->mid,
-                        connection->server_addr,
-                        connection->client->hello_id,
-                        &handle);
-    ASSERT(hret == HG_SUCCESS,
-            "margo_create failed with error: %s\n",
-            HG_Error_to_string(hret));
-
-    // send the RPC
-    hret = margo_forward(handle, &in);
-    ASSERT(hret == HG_SUCCESS,
-           "margo_forward failed with error: %s\n",
-           HG_Error_to_string(hret));
-
-    // get the output of the RPC
-    hret = margo_get_output(handle, &out);
-    ASSERT(hret == HG_SUCCESS,
-           "margo_get_output failed with error: %s\n",
-           HG_Error_to_string(hret));
-
-    ret = out.ret;
+    int            ret          = 0;
+    hg_return_t    hret         = HG_SUCCESS;
+    unsigned char  key[32]      = {0};
+    unsigned char  server_key[32];
+    char*          destinations = NULL;
+    size_t         destinations_len;
+    size_t         i, num_set_up = 0;
+    auth_in_t      in           = {0};
+    hg_addr_t*     server_addrs = (hg_addr_t*)calloc(num_addresses, sizeof(*server_addrs));
+    hg_handle_t*   handles      = (hg_handle_t*)calloc(num_addresses, sizeof(*handles));
+    margo_request* reqs         = (margo_request*)calloc(num_addresses, sizeof(*reqs));
+    ASSERT(server_addrs && handles && reqs, "Could not allocate authenticate RPCs\n");
+
+    // encode a single credential for all the servers
+    destinations = destinations_encode(addresses, num_addresses, &destinations_len);
+    ASSERT(destinations != NULL, "Could not allocate the list of destinations\n");
+    ret = encode_credential(options, destinations, destinations_len, key, &in.credential);
+    ASSERT(ret == 0, "Could not encode credential\n");
+
+    // send it to all the servers
+    for(i = 0; i < num_addresses; ++i) {
+        hret = margo_addr_lookup(client->mid, addresses[i], &server_addrs[i]);
+        ASSERT(hret == HG_SUCCESS,
+               "margo_addr_lookup(\"%s\") failed with error: %s\n",
+               addresses[i], HG_Error_to_string(hret));
+        hret = margo_create(client->mid, server_addrs[i], client->auth_id, &handles[i]);
+        ASSERT(hret == HG_SUCCESS,
+               "margo_create failed with error: %s\n",
+               HG_Error_to_string(hret));
+        hret = margo_iforward(handles[i], &in, &reqs[i]);
+        ASSERT(hret == HG_SUCCESS,
+               "margo_iforward failed with error: %s\n",
+               HG_Error_to_string(hret));
+    }
 
-    // increment the sequence number
-    if(ret == 0) connection->seq_no++;
+    // set up a connection for each server as its response arrives
+    for(i = 0; i < num_addresses; ++i) {
+        auth_out_t     out     = {0};
+        auth_backoff_t backoff = {0};
+        hret = margo_wait(reqs[i]);
+        reqs[i] = MARGO_REQUEST_NULL;
+        ASSERT(hret == HG_SUCCESS,
+               "margo_wait failed with error: %s\n",
+               HG_Error_to_string(hret));
+        hret = margo_get_output(handles[i], &out);
+        ASSERT(hret == HG_SUCCESS,
+               "margo_get_output failed with error: %s\n",
+               HG_Error_to_string(hret));
+        // send the credential again to the servers that were busy
+        while(out.ret == RPC_ERR_RETRY_AFTER) {
+            double delay = auth_backoff_next(&backoff, out.retry_after);
+            margo_free_output(handles[i], &out);
+            ASSERT(delay >= 0, "%s still busy after %u attempts\n", addresses[i], backoff.attempts);
+            margo_thread_sleep(client->mid, delay);
+            hret = margo_forward(handles[i], &in);
+            ASSERT(hret == HG_SUCCESS,
+                   "margo_forward failed with error: %s\n",
+                   HG_Error_to_string(hret));
+            hret = margo_get_output(handles[i], &out);
+            ASSERT(hret == HG_SUCCESS,
+                   "margo_get_output failed with error: %s\n",
+                   HG_Error_to_string(hret));
+        }
+        ret = out.ret;
+        if(ret == 0) ret = session_key_for_server(key, addresses[i], server_key);
+        if(ret == 0) {
+            memset(connections[i], 0, sizeof(*connections[i]));
+            ret = connection_setup(client, options, server_key, &out, server_addrs[i],
+                                   connections[i]);
+            num_set_up += 1;
+        }
+        margo_free_output(handles[i], &out);
+        ASSERT(ret == 0, "Could not authenticate with %s\n", addresses[i]);
+    }
 
 finish:
-    // cleanup
-    margo_free_output(handle, &out);
-    margo_destroy(handle);
+    // cleanup, waiting for the RPCs still in flight after an error
+    for(i = 0; reqs && i < num_addresses; ++i)
+        if(reqs[i] != MARGO_REQUEST_NULL) margo_wait(reqs[i]);
+    for(i = 0; handles && i < num_addresses; ++i)
+        if(handles[i] != HG_HANDLE_NULL) margo_destroy(handles[i]);
+    for(i = 0; server_addrs && i < num_addresses; ++i)
+        if(server_addrs[i] != HG_ADDR_NULL) margo_addr_free(client->mid, server_addrs[i]);
+    if(ret != 0)
+        for(i = 0; i < num_set_up; ++i) connection_destroy(connections[i]);
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(server_key, sizeof(server_key));
+    free(in.credential);
+    free(destinations);
+    free(reqs);
+    free(handles);
+    free(server_addrs);
     return ret;
 }
 
-int client_close_session(connection_t* connection)
+/* Sets up a connection to another server for the session of an existing
+ * connection, the servers sharing their sessions on the node or being
+ * in the same group. Each server gets its own key, derived from the
+ * session key and its address, and its own sequence numbers. In group
+ * mode, the group ticket is sent until the server has imported the
+ * session. */
+int client_share_session(const connection_t* from, const char* address,
+                         connection_t* connection)
 {
-    int         ret    = 0;
-    hg_handle_t handle = HG_HANDLE_NULL;
-    hg_return_t hret   = HG_SUCCESS;
-    close_in_t   in    = {0};
-    close_out_t  out   = {0};
-
-    // create the token for the RPC
-    create_token(&in.token,
-                 connection->session_id,
-                 connection->seq_no,
-                 (const char*)connection->key,
-                 sizeof(connection->key));
+    int           ret         = 0;
+    hg_return_t   hret        = HG_SUCCESS;
+    hg_addr_t     server_addr = HG_ADDR_NULL;
+    unsigned char key[32]     = {0};
 
-    // create the RPC handle
-    hret = margo_create(connection->client->mid,
-                        connection->server_addr,
-                        connection->client->close_id,
-                        &handle);
-    ASSERT(hret == HG_SUCCESS,
-            "margo_create failed with error: %s\n",
-            HG_Error_to_string(hret));
+    memset(connection, 0, sizeof(*connection));
+    ASSERT(from->ticket.len == 0, "Sessions carried by tickets can't be shared\n");
 
-    // send the RPC
-    hret = margo_forward(handle, &in);
+    hret = margo_addr_lookup(from->client->mid, address, &server_addr);
     ASSERT(hret == HG_SUCCESS,
-           "margo_forward failed with error: %s\n",
-           HG_Error_to_string(hret));
+           "margo_addr_lookup(\"%s\") failed with error: %s\n",
+           address, HG_Error_to_string(hret));
 
-    // get the output of the RPC
-    hret = margo_get_output(handle, &out);
-    ASSERT(hret == HG_SUCCESS,
-           "margo_get_output failed with error: %s\n",
-           HG_Error_to_string(hret));
+    ret = session_key_for_server(from->key, address, key);
+    ASSERT(ret == 0, "Could not derive key for %s\n", address);
+
+    connection->client     = from->client;
+    connection->session_id = from->session_id;
+    connection->seq_no     = 0;
+    memcpy(connection->key, key, sizeof(key));
+    connection->group_ticket      = from->group_ticket;
+    connection->send_group_ticket = from->group_ticket.len != 0;
+    ret = mac_init(&connection->mac, from->mac.alg, from->mac.tag_len, key, sizeof(key));
+    ASSERT(ret == 0, "Could not initialize MAC state for connection\n");
+    ret = aead_init(&connection->aead, from->aead.alg, key, sizeof(key));
+    ASSERT(ret == 0, "Could not derive AEAD key for connection\n");
+    connection->server_addr = server_addr;
+    server_addr = HG_ADDR_NULL;
 
-    ret = out.ret;
+finish:
+    OPENSSL_cleanse(key, sizeof(key));
+    if(server_addr != HG_ADDR_NULL) margo_addr_free(from->client->mid, server_addr);
+    if(ret != 0) connection_destroy(connection);
+    return ret;
+}
 
-    margo_addr_free(connection->client->mid, connection->server_addr);
-    memset(connection, 0, sizeof(*connection));
+int client_hello(connection_t* connection, const char* name)
+{
+    request_t request;
+    if(client_hello_issue(connection, name, &request) != 0) return -1;
+    return request_wait(&request);
+}
 
-finish:
-    // cleanup
-    margo_free_output(handle, &out);
-    margo_destroy(handle);
+int client_close_session(connection_t* connection)
+{
+    request_t request;
+    int ret = client_close_session_issue(connection, &request);
+    if(ret == 0) ret = request_wait(&request);
+    connection_destroy(connection);
     return ret;
 }
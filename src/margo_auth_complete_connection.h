@@ -0,0 +1,292 @@
+#ifndef MARGO_AUTH_COMPLETE_CONNECTION_H
+#define MARGO_AUTH_COMPLETE_CONNECTION_H
+
+#include <margo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_types.h"
+#include "margo_auth_complete_token_ring.h"
+
+/* Client side of a session, and asynchronous RPCs on it.
+ *
+ * An RPC is issued with margo_iforward and tracked by a request_t, so
+ * that a client can keep several authenticated RPCs in flight on the
+ * same connection and wait for them with request_wait, request_wait_any
+ * or request_wait_all. The sequence number of an RPC is handed out with
+ * an atomic increment when it is issued, and its arguments are
+ * serialized, and its token signed, before margo_iforward returns, so
+ * requests can be issued from several ULTs at once. The server accepts
+ * them in any order within its replay window (see
+ * margo_auth_complete_replay.h). A request that fails gives its sequence
+ * number back if no later one was handed out in the meantime, so that a
+ * client issuing one RPC at a time still works with a server that only
+ * accepts the next sequence number (--replay-window=0). */
+
+typedef struct {
+    margo_instance_id mid;
+    hg_id_t           auth_id;
+    hg_id_t           hello_id;
+    hg_id_t           close_id;
+} client_t;
+
+typedef struct {
+    const client_t*  client;
+    hg_addr_t        server_addr;
+    session_id_t     session_id;
+    _Atomic uint64_t seq_no;  /* next sequence number to hand out */
+    unsigned char    key[32];
+    mac_t            mac;  /* MAC state pre-keyed with key */
+    token_ring_t*    ring; /* tokens prepared ahead of time, if enabled */
+    ticket_t         ticket; /* ticket issued by the server, if any */
+    ticket_t         group_ticket;      /* group ticket issued by the server, if any */
+    _Atomic uint8_t  send_group_ticket; /* until the server has imported the session */
+    aead_t           aead;   /* AEAD state if RPCs are sealed */
+    _Atomic uint64_t aead_counter; /* nonce counter of the next sealed request */
+} connection_t;
+
+typedef enum {
+    REQUEST_HELLO,
+    REQUEST_CLOSE
+} request_kind_t;
+
+typedef struct {
+    connection_t*  connection;
+    request_kind_t kind;
+    uint64_t       seq_no; /* sequence number of the RPC's token */
+    hg_handle_t    handle;
+    margo_request  req;    /* MARGO_REQUEST_NULL once the request has completed */
+    union {
+        hello_out_t hello;
+        close_out_t close;
+    } out;
+    int            ret;    /* result of the RPC, once the request has completed */
+} request_t;
+
+/* Fills the token of an RPC with the next sequence number of the
+ * connection. */
+static inline int connection_prepare_token(connection_t* connection, token_t* token)
+{
+    uint64_t seq_no = atomic_fetch_add(&connection->seq_no, 1);
+    if(create_token(token, connection->session_id, seq_no, &connection->mac) != 0) return -1;
+    if(connection->ring)
+        token->prepared = token_ring_take(connection->ring, seq_no);
+    token->ticket = connection->ticket;
+    if(atomic_load(&connection->send_group_ticket)) token->ticket = connection->group_ticket;
+    // a failed RPC may give its sequence number back, so the counter is
+    // what keeps the nonces of two requests from ever being equal
+    if(connection->aead.alg != AEAD_NONE) {
+        token->sealed       = 1;
+        token->aead         = connection->aead;
+        token->aead_counter = atomic_fetch_add(&connection->aead_counter, 1);
+    }
+    return 0;
+}
+
+/* Gives back the sequence number of a failed RPC, unless a later one has
+ * been handed out since. */
+static inline void connection_return_seq_no(connection_t* connection, uint64_t seq_no)
+{
+    uint64_t expected = seq_no + 1;
+    atomic_compare_exchange_strong(&connection->seq_no, &expected, seq_no);
+}
+
+/* Sends an RPC whose token has been prepared. The input is serialized,
+ * and the token signed, before margo_iforward returns, so the caller can
+ * release it right away. */
+static inline int request_forward(connection_t* connection, request_t* request,
+                                  request_kind_t kind, hg_id_t rpc_id,
+                                  void* in, const token_t* token)
+{
+    hg_return_t hret = HG_SUCCESS;
+
+    request->connection = connection;
+    request->kind       = kind;
+    request->seq_no     = token->seq_no;
+    request->handle     = HG_HANDLE_NULL;
+    request->req        = MARGO_REQUEST_NULL;
+    request->ret        = -1;
+
+    hret = margo_create(connection->client->mid, connection->server_addr, rpc_id, &request->handle);
+    if(hret != HG_SUCCESS) {
+        fprintf(stderr, "margo_create failed with error: %s\n", HG_Error_to_string(hret));
+        goto error;
+    }
+    hret = margo_iforward(request->handle, in, &request->req);
+    if(hret != HG_SUCCESS) {
+        fprintf(stderr, "margo_iforward failed with error: %s\n", HG_Error_to_string(hret));
+        goto error;
+    }
+    return 0;
+
+error:
+    margo_destroy(request->handle);
+    request->handle = HG_HANDLE_NULL;
+    request->req    = MARGO_REQUEST_NULL;
+    connection_return_seq_no(connection, request->seq_no);
+    return -1;
+}
+
+/* Issues a hello RPC without waiting for its response. */
+static inline int client_hello_issue(connection_t* connection, const char* name, request_t* request)
+{
+    int        ret = 0;
+    hello_in_t in  = {0};
+
+    memset(request, 0, sizeof(*request));
+    request->ret = -1;
+    if(connection_prepare_token(connection, &in.token) != 0) return -1;
+    in.name = (char*)name;
+
+    // expect a sealed response, if the session is sealed
+    if(connection->aead.alg != AEAD_NONE) {
+        request->out.hello.sealing = (sealing_t){
+            .aead       = &connection->aead,
+            .direction  = AEAD_DIRECTION_RESPONSE,
+            .session_id = connection->session_id,
+            .seq_no     = in.token.seq_no
+        };
+    }
+
+    ret = request_forward(connection, request, REQUEST_HELLO, connection->client->hello_id,
+                          &in, &in.token);
+    release_token(&in.token);
+    return ret;
+}
+
+/* Issues a close RPC without waiting for its response. The session
+ * should not be used for other RPCs once it has been issued. */
+static inline int client_close_session_issue(connection_t* connection, request_t* request)
+{
+    int        ret = 0;
+    close_in_t in  = {0};
+
+    memset(request, 0, sizeof(*request));
+    request->ret = -1;
+    if(connection_prepare_token(connection, &in.token) != 0) return -1;
+
+    ret = request_forward(connection, request, REQUEST_CLOSE, connection->client->close_id,
+                          &in, &in.token);
+    release_token(&in.token);
+    return ret;
+}
+
+/* Gets the result of a request whose margo request has completed with
+ * hret, and releases its handle. */
+static inline int request_complete(request_t* request, hg_return_t hret)
+{
+    connection_t* connection = request->connection;
+    void*         out        = request->kind == REQUEST_HELLO ? (void*)&request->out.hello
+                                                              : (void*)&request->out.close;
+
+    request->req = MARGO_REQUEST_NULL;
+    request->ret = -1;
+    if(hret != HG_SUCCESS) {
+        fprintf(stderr, "margo_iforward failed with error: %s\n", HG_Error_to_string(hret));
+    } else {
+        hret = margo_get_output(request->handle, out);
+        if(hret != HG_SUCCESS) {
+            fprintf(stderr, "margo_get_output failed with error: %s\n", HG_Error_to_string(hret));
+        } else {
+            request->ret = request->kind == REQUEST_HELLO ? request->out.hello.ret
+                                                          : request->out.close.ret;
+            margo_free_output(request->handle, out);
+        }
+    }
+    margo_destroy(request->handle);
+    request->handle = HG_HANDLE_NULL;
+
+    if(request->ret == RPC_ERR_SESSION_EVICTED)
+        fprintf(stderr, "Session was evicted by the server, authenticate again\n");
+    if(request->ret == 0)
+        atomic_store(&connection->send_group_ticket, 0);
+    else
+        connection_return_seq_no(connection, request->seq_no);
+    return request->ret;
+}
+
+/* Waits for a request and returns the result of its RPC. */
+static inline int request_wait(request_t* request)
+{
+    if(request->req == MARGO_REQUEST_NULL) return request->ret;
+    return request_complete(request, margo_wait(request->req));
+}
+
+/* Waits for one of the requests that have not completed yet, and returns
+ * the result of its RPC. Its index is set to count if all the requests
+ * had already completed. */
+static inline int request_wait_any(request_t* requests, size_t count, size_t* index)
+{
+    margo_request reqs[count ? count : 1];
+    for(size_t i = 0; i < count; ++i) reqs[i] = requests[i].req;
+
+    *index = count;
+    hg_return_t hret = margo_wait_any(count, reqs, index);
+    if(*index >= count) {
+        *index = count;
+        return 0;
+    }
+    return request_complete(&requests[*index], hret);
+}
+
+/* Waits for all the requests. Returns 0 if all their RPCs succeeded, or
+ * the first error. */
+static inline int request_wait_all(request_t* requests, size_t count)
+{
+    int ret = 0;
+    for(size_t i = 0; i < count; ++i) {
+        int r = request_wait(&requests[i]);
+        if(ret == 0) ret = r;
+    }
+    return ret;
+}
+
+/* Frees the resources of a connection, without closing its session, and
+ * stops the ULT preparing its tokens. No request should be in flight on
+ * it. The connection may be zeroed or partially set up, and it is zeroed
+ * afterwards, so it can be destroyed again. */
+static inline void connection_destroy(connection_t* connection)
+{
+    if(connection->client && connection->server_addr != HG_ADDR_NULL)
+        margo_addr_free(connection->client->mid, connection->server_addr);
+    if(connection->ring) token_ring_stop(connection->ring);
+    free(connection->ring);
+    mac_destroy(&connection->mac);
+    aead_destroy(&connection->aead);
+    OPENSSL_cleanse(connection->key, sizeof(connection->key));
+    memset(connection, 0, sizeof(*connection));
+}
+
+/* A server busy with other authentications answers authenticate with
+ * RPC_ERR_RETRY_AFTER and the delay after which the client should try
+ * again (see margo_auth_complete_auth_pool.h). The client then waits for
+ * a random time between this delay and twice this delay, so that the
+ * clients turned away at the same time don't all come back at once, the
+ * delay doubling with each attempt if the server doesn't ask for more,
+ * and gives up after AUTH_RETRY_MAX_ATTEMPTS attempts. Its credential
+ * wasn't decoded, so it is sent again as is. */
+
+#define AUTH_RETRY_MAX_ATTEMPTS 16
+#define AUTH_BACKOFF_MAX_MS     10000
+
+typedef struct {
+    unsigned attempts;
+    double   delay_ms;
+} auth_backoff_t;
+
+/* Returns the time to wait, in ms, before sending authenticate again to
+ * a server that asked to retry after retry_after_ms, or -1 if the client
+ * should give up. */
+static inline double auth_backoff_next(auth_backoff_t* backoff, uint32_t retry_after_ms)
+{
+    uint32_t r;
+    if(++backoff->attempts >= AUTH_RETRY_MAX_ATTEMPTS) return -1;
+    backoff->delay_ms *= 2;
+    if(backoff->delay_ms < retry_after_ms) backoff->delay_ms = retry_after_ms;
+    if(backoff->delay_ms > AUTH_BACKOFF_MAX_MS) backoff->delay_ms = AUTH_BACKOFF_MAX_MS;
+    if(RAND_bytes((unsigned char*)&r, sizeof(r)) != 1) r = (uint32_t)rand();
+    return backoff->delay_ms * (1.0 + r / 4294967296.0);
+}
+
+#endif
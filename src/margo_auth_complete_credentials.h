@@ -0,0 +1,282 @@
+#ifndef MARGO_AUTH_COMPLETE_CREDENTIALS_H
+#define MARGO_AUTH_COMPLETE_CREDENTIALS_H
+
+#ifdef HAVE_MUNGE
+#include <munge.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "margo_auth_complete_types.h"
+#include "margo_auth_complete_tickets.h"
+#include "margo_auth_complete_store.h"
+#include "margo_auth_complete_destinations.h"
+
+/* Backends encoding and decoding the credentials of authenticate RPCs: a
+ * credential is a string carrying the uid and gid of the process that
+ * encoded it and a payload, that only the backend can produce and
+ * decode. The client and the server pick theirs with a specification:
+ *
+ *   munge                              the munge daemon, the default
+ *   local:<key file>[:<latency in us>] a stand-in for munge, for tests
+ *                                      and benchmarks
+ *
+ * The local backend seals the uid, gid, encoding time and payload with
+ * AES-256-GCM under a key read from a file shared by the clients and the
+ * server (created with mode 0600 if it doesn't exist), so no munged is
+ * needed. Like munge, it refuses the credentials encoded more than 5
+ * minutes ago, and reports the credentials it has already decoded as
+ * replayed, although only within the process. Encoding and decoding can
+ * be slowed down by a given latency, which blocks the execution stream
+ * as a round-trip to munged does. Anyone who can read the key file can
+ * claim any uid, so it is not a replacement for munge.
+ *
+ * The munge backend is only compiled in with HAVE_MUNGE, which the build
+ * defines when it finds munge, so that the programs can be built and
+ * benchmarked with the local backend on machines without munge.
+ *
+ * Other backends implement credential_backend_t and are added to
+ * credential_backend_init. */
+
+#define CREDENTIAL_SUCCESS   0
+#define CREDENTIAL_REPLAYED  1 /* decoded before, the payload is still returned */
+#define CREDENTIAL_ERROR    -1
+
+#define LOCAL_CREDENTIAL_TTL     300  /* seconds, as munge's default */
+#define LOCAL_CREDENTIAL_HISTORY 65536
+
+typedef struct credential_backend credential_backend_t;
+
+struct credential_backend {
+    const char* name;
+    /* Encodes a credential for the calling process with this payload,
+     * returning it in a string allocated with malloc. */
+    int  (*encode)(credential_backend_t* backend, const void* payload, size_t len,
+                   char** credential);
+    /* Decodes a credential, returning CREDENTIAL_SUCCESS, CREDENTIAL_REPLAYED
+     * or CREDENTIAL_ERROR. Unless it fails, the payload is allocated with
+     * malloc, and the uid, gid and encoding time of the credential are set. */
+    int  (*decode)(credential_backend_t* backend, const char* credential,
+                   void** payload, size_t* len, uid_t* uid, gid_t* gid, time_t* encoded);
+    void (*finalize)(credential_backend_t* backend);
+    void* data;
+};
+
+#ifdef HAVE_MUNGE
+static inline int munge_backend_encode(credential_backend_t* backend, const void* payload,
+                                       size_t len, char** credential)
+{
+    (void)backend;
+    munge_err_t err = munge_encode(credential, NULL, payload, (int)len);
+    if(err != EMUNGE_SUCCESS) {
+        fprintf(stderr, "munge_encode failed: %s\n", munge_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+static inline int munge_backend_decode(credential_backend_t* backend, const char* credential,
+                                       void** payload, size_t* len, uid_t* uid, gid_t* gid,
+                                       time_t* encoded)
+{
+    (void)backend;
+    int         payload_len = 0;
+    munge_ctx_t ctx         = munge_ctx_create();
+    if(!ctx) return CREDENTIAL_ERROR;
+
+    *payload = NULL;
+    munge_err_t err = munge_decode(credential, ctx, payload, &payload_len, uid, gid);
+    int ret = err == EMUNGE_SUCCESS      ? CREDENTIAL_SUCCESS
+            : err == EMUNGE_CRED_REPLAYED ? CREDENTIAL_REPLAYED
+            : CREDENTIAL_ERROR;
+    if(ret != CREDENTIAL_ERROR && munge_ctx_get(ctx, MUNGE_OPT_ENCODE_TIME, encoded) != EMUNGE_SUCCESS)
+        ret = CREDENTIAL_ERROR;
+    munge_ctx_destroy(ctx);
+    if(ret == CREDENTIAL_ERROR) {
+        free(*payload);
+        *payload = NULL;
+        return ret;
+    }
+    *len = (size_t)payload_len;
+    return ret;
+}
+#endif
+
+typedef struct {
+    unsigned char        key[32];
+    double               latency; /* in seconds */
+    credential_history_t decoded; /* credentials decoded by this process */
+} local_backend_t;
+
+#define LOCAL_CREDENTIAL_HEADER (4 + 4 + 8) /* uid, gid, encoding time */
+
+static inline void local_backend_delay(const local_backend_t* local)
+{
+    if(local->latency <= 0) return;
+    struct timespec ts = {
+        .tv_sec  = (time_t)local->latency,
+        .tv_nsec = (long)((local->latency - (time_t)local->latency) * 1e9)
+    };
+    while(nanosleep(&ts, &ts) != 0) ;
+}
+
+/* credential: hex of uid | gid | encoding time | iv | sealed payload | tag,
+ * the header being authenticated as associated data. */
+static inline int local_backend_encode(credential_backend_t* backend, const void* payload,
+                                       size_t len, char** credential)
+{
+    local_backend_t* local  = (local_backend_t*)backend->data;
+    size_t           size   = LOCAL_CREDENTIAL_HEADER + TICKET_IV_SIZE + len + TICKET_GCM_TAG_SIZE;
+    unsigned char*   buf    = (unsigned char*)malloc(size);
+    uint32_t         uid    = (uint32_t)getuid(), gid = (uint32_t)getgid();
+    uint64_t         now    = (uint64_t)time(NULL);
+    int              ret    = -1;
+
+    *credential = (char*)malloc(2 * size + 1);
+    if(!buf || !*credential) goto finish;
+    memcpy(buf, &uid, 4);
+    memcpy(buf + 4, &gid, 4);
+    memcpy(buf + 8, &now, 8);
+    if(ticket_seal(local->key, buf, LOCAL_CREDENTIAL_HEADER, (const unsigned char*)payload, len,
+                   buf + LOCAL_CREDENTIAL_HEADER) != 0) goto finish;
+    for(size_t i = 0; i < size; ++i) sprintf(*credential + 2 * i, "%02x", buf[i]);
+    local_backend_delay(local);
+    ret = 0;
+
+finish:
+    if(buf) OPENSSL_cleanse(buf, size);
+    free(buf);
+    if(ret != 0) {
+        fprintf(stderr, "Could not encode local credential\n");
+        free(*credential);
+        *credential = NULL;
+    }
+    return ret;
+}
+
+static inline int local_backend_decode(credential_backend_t* backend, const char* credential,
+                                       void** payload, size_t* len, uid_t* uid, gid_t* gid,
+                                       time_t* encoded)
+{
+    local_backend_t* local = (local_backend_t*)backend->data;
+    size_t           hex   = strlen(credential);
+    size_t           size  = hex / 2;
+    unsigned char*   buf   = NULL;
+    unsigned char    id[32] = {0};
+    uint32_t         u, g;
+    uint64_t         t, now = (uint64_t)time(NULL);
+    int              ret   = CREDENTIAL_ERROR;
+
+    local_backend_delay(local);
+    *payload = NULL;
+    if(hex % 2 || size < LOCAL_CREDENTIAL_HEADER + TICKET_IV_SIZE + TICKET_GCM_TAG_SIZE)
+        return CREDENTIAL_ERROR;
+    buf = (unsigned char*)malloc(size);
+    if(!buf) return CREDENTIAL_ERROR;
+    for(size_t i = 0; i < size; ++i)
+        if(sscanf(credential + 2 * i, "%2hhx", &buf[i]) != 1) goto finish;
+
+    *len     = size - LOCAL_CREDENTIAL_HEADER - TICKET_IV_SIZE - TICKET_GCM_TAG_SIZE;
+    *payload = malloc(*len ? *len : 1);
+    if(!*payload) goto finish;
+    if(ticket_unseal(local->key, buf, LOCAL_CREDENTIAL_HEADER, buf + LOCAL_CREDENTIAL_HEADER,
+                     *len, (unsigned char*)*payload) != 0) goto finish;
+    memcpy(&u, buf, 4);
+    memcpy(&g, buf + 4, 4);
+    memcpy(&t, buf + 8, 8);
+    if(t + LOCAL_CREDENTIAL_TTL <= now || t > now + LOCAL_CREDENTIAL_TTL) goto finish; // expired
+    *uid     = (uid_t)u;
+    *gid     = (gid_t)g;
+    *encoded = (time_t)t;
+
+    // a credential is identified by its random IV and its tag
+    memcpy(id, buf + LOCAL_CREDENTIAL_HEADER, TICKET_IV_SIZE);
+    memcpy(id + TICKET_IV_SIZE, buf + size - TICKET_GCM_TAG_SIZE, TICKET_GCM_TAG_SIZE);
+    switch(credential_history_claim(&local->decoded, id, (time_t)t)) {
+    case 0:
+        ret = CREDENTIAL_SUCCESS;
+        break;
+    case 1:
+        ret = CREDENTIAL_REPLAYED;
+        break;
+    default:
+        fprintf(stderr, "Too many local credentials decoded recently to detect replays\n");
+        goto finish;
+    }
+
+finish:
+    OPENSSL_cleanse(buf, size);
+    free(buf);
+    if(ret == CREDENTIAL_ERROR && *payload) {
+        OPENSSL_cleanse(*payload, *len);
+        free(*payload);
+        *payload = NULL;
+    }
+    return ret;
+}
+
+static inline void local_backend_finalize(credential_backend_t* backend)
+{
+    local_backend_t* local = (local_backend_t*)backend->data;
+    OPENSSL_cleanse(local->key, sizeof(local->key));
+    credential_history_finalize(&local->decoded);
+    free(local);
+}
+
+/* Sets up a backend from its specification. */
+static inline int credential_backend_init(credential_backend_t* backend, const char* spec)
+{
+    memset(backend, 0, sizeof(*backend));
+    if(strcmp(spec, "munge") == 0) {
+#ifdef HAVE_MUNGE
+        backend->name   = "munge";
+        backend->encode = munge_backend_encode;
+        backend->decode = munge_backend_decode;
+        return 0;
+#else
+        fprintf(stderr, "Built without munge, use a local:<key file> backend\n");
+        return -1;
+#endif
+    }
+    if(strncmp(spec, "local:", 6) == 0) {
+        char*            path    = strdup(spec + 6);
+        char*            latency = path ? strchr(path, ':') : NULL;
+        local_backend_t* local   = (local_backend_t*)calloc(1, sizeof(*local));
+        if(latency) *latency++ = '\0';
+        if(!path || !local || !*path
+        || credential_history_init(&local->decoded, LOCAL_CREDENTIAL_TTL,
+                                   LOCAL_CREDENTIAL_HISTORY) != 0) {
+            free(path);
+            free(local);
+            return -1;
+        }
+        if(session_store_host_key(path, local->key) != 0) {
+            fprintf(stderr, "Could not read key file %s, which must only be accessible by its owner\n",
+                    path);
+            credential_history_finalize(&local->decoded);
+            free(path);
+            free(local);
+            return -1;
+        }
+        local->latency    = latency ? atof(latency) * 1e-6 : 0;
+        backend->name     = "local";
+        backend->encode   = local_backend_encode;
+        backend->decode   = local_backend_decode;
+        backend->finalize = local_backend_finalize;
+        backend->data     = local;
+        free(path);
+        return 0;
+    }
+    fprintf(stderr, "Unknown credential backend %s\n", spec);
+    return -1;
+}
+
+static inline void credential_backend_finalize(credential_backend_t* backend)
+{
+    if(backend->finalize) backend->finalize(backend);
+    memset(backend, 0, sizeof(*backend));
+}
+
+#endif
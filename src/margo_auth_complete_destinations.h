@@ -0,0 +1,159 @@
+#ifndef MARGO_AUTH_COMPLETE_DESTINATIONS_H
+#define MARGO_AUTH_COMPLETE_DESTINATIONS_H
+
+#include <abt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+#include "margo_auth_complete_session_index.h"
+
+/* Multi-destination credentials, so that a client authenticating with
+ * many servers encodes a single munge credential instead of one per
+ * server. The payload of an authenticate credential ends with the
+ * address of its destination; a multi-destination credential has
+ * instead an empty address followed by the list of its destinations,
+ * each terminated by a null byte:
+ *
+ *   key | params | '\0' | address 1 | '\0' | address 2 | '\0' | ...
+ *
+ * A server only accepts such a credential if its address is in the
+ * list, and, as with shared sessions, uses for the session its own key,
+ * derived from the key of the payload and its address with HKDF
+ * (session_key_for_server), so a token sent to one destination can't
+ * be replayed on another.
+ *
+ * munged refuses to decode a credential twice on a node, which is what
+ * makes a single-destination credential usable once, but the servers of
+ * a node that are all destinations of a credential each need to decode
+ * it. munge_decode still returns the payload of a credential it has
+ * already decoded, with EMUNGE_CRED_REPLAYED, which servers accept for
+ * multi-destination credentials only, and each server remembers the
+ * credentials it accepted instead: a credential is identified by a hash
+ * of its key, which the client draws at random for each credential, and
+ * is remembered for the window of time in which the server accepts it,
+ * a credential being refused once it was encoded more than that window
+ * ago. If the history is full of credentials still within the window,
+ * multi-destination credentials are refused rather than one forgotten. */
+
+#define DESTINATIONS_DEFAULT_WINDOW  300   /* seconds, munge's default credential lifetime */
+#define DESTINATIONS_DEFAULT_HISTORY 65536
+
+/* Returns the destinations part of the payload of a credential for these
+ * addresses, and its length, or NULL if out of memory. */
+static inline char* destinations_encode(const char* const* addresses, size_t num_addresses,
+                                        size_t* len)
+{
+    size_t total = 1;
+    for(size_t i = 0; i < num_addresses; ++i) total += strlen(addresses[i]) + 1;
+    char* list = (char*)malloc(total);
+    if(!list) return NULL;
+    char* p = list;
+    *p++ = '\0';
+    for(size_t i = 0; i < num_addresses; ++i) p = stpcpy(p, addresses[i]) + 1;
+    *len = total;
+    return list;
+}
+
+/* Returns 1 if the destinations part of a payload lists several
+ * destinations, 0 if it is the address of a single destination. */
+static inline int destinations_multiple(const char* list, size_t len)
+{
+    return len > 0 && list[0] == '\0';
+}
+
+/* Returns 1 if an address is in the list of a multi-destination
+ * credential. */
+static inline int destinations_contain(const char* list, size_t len, const char* address)
+{
+    size_t addr_len = strlen(address);
+    if(len == 0 || list[len - 1] != '\0') return 0; // truncated list
+    for(size_t i = 1; i < len; ) {
+        size_t n = strlen(list + i);
+        if(n == addr_len && memcmp(list + i, address, n) == 0) return 1;
+        i += n + 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    uint64_t id;     /* hash of the credential's key */
+    uint64_t expiry; /* seconds since the epoch */
+} credential_use_t;
+
+typedef struct {
+    uint64_t          window;  /* in seconds */
+    ABT_mutex_memory  mtx;
+    session_index_t   used;    /* IDs of the credentials accepted */
+    credential_use_t* history; /* same IDs, in order of acceptance */
+    size_t            history_size;
+    size_t            head;    /* oldest entry of history */
+    size_t            count;
+} credential_history_t;
+
+static inline int credential_history_init(credential_history_t* history, uint64_t window,
+                                          size_t history_size)
+{
+    memset(history, 0, sizeof(*history));
+    history->window       = window;
+    history->history_size = history_size;
+    history->history      = (credential_use_t*)calloc(history_size, sizeof(*history->history));
+    if(!history->history || session_index_init(&history->used) != 0) {
+        free(history->history);
+        memset(history, 0, sizeof(*history));
+        return -1;
+    }
+    return 0;
+}
+
+static inline void credential_history_finalize(credential_history_t* history)
+{
+    if(!history->history) return;
+    session_index_finalize(&history->used);
+    free(history->history);
+    memset(history, 0, sizeof(*history));
+}
+
+/* Records that the credential with this key, encoded at this time, has
+ * been accepted. Returns 0 if it had not been, 1 if it was accepted
+ * before or is too old to tell, and -1 if it could not be recorded
+ * because the history is full, in which case the credential must be
+ * refused but is not a replay. */
+static inline int credential_history_claim(credential_history_t* history,
+                                           const unsigned char key[32], time_t encoded)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint64_t      id;
+    uint64_t      now = (uint64_t)time(NULL);
+    int           ret = -1;
+
+    if(encoded < 0 || (uint64_t)encoded + history->window <= now) return 1;
+    SHA256(key, 32, digest);
+    memcpy(&id, digest, sizeof(id));
+    if(id == 0) id = 1; // 0 marks empty slots of the index
+
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&history->mtx));
+    // forget the credentials that are now refused for being too old,
+    // roughly in order since they all stay in the history for the same time
+    while(history->count && history->history[history->head].expiry <= now) {
+        session_index_remove(&history->used, history->history[history->head].id);
+        history->head   = (history->head + 1) % history->history_size;
+        history->count -= 1;
+    }
+    if(session_index_find(&history->used, id)) {
+        ret = 1;
+    } else if(history->count < history->history_size) {
+        credential_use_t* entry =
+            &history->history[(history->head + history->count) % history->history_size];
+        if(session_index_insert(&history->used, id, entry) == 0) {
+            entry->id      = id;
+            entry->expiry  = ((uint64_t)encoded > now ? (uint64_t)encoded : now) + history->window;
+            history->count += 1;
+            ret = 0;
+        }
+    }
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&history->mtx));
+    return ret;
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef MARGO_AUTH_COMPLETE_EXPIRY_H
+#define MARGO_AUTH_COMPLETE_EXPIRY_H
+
+#include <margo.h>
+#include <float.h>
+#include <time.h>
+#include "margo_auth_complete_sessions.h"
+#include "margo_auth_complete_timer_wheel.h"
+
+/* Sessions expire after idle_timeout seconds without an RPC, or
+ * lifetime seconds after they were opened, whichever comes first (either
+ * limit can be disabled by setting it to 0). Every session has a timer
+ * in a timer wheel that ticks every `tick` seconds, and a ULT advances
+ * the wheel, so that expiring sessions never requires scanning the
+ * session table.
+ *
+ * RPCs don't touch the wheel: they only update the session's last_used
+ * field, and the timer is armed for the deadline computed when it was
+ * last (re)armed. When it fires, the actual deadline is computed from
+ * last_used and the timer is re-armed if the session has been used in
+ * the meantime, so an active session costs one re-arm per idle_timeout.
+ *
+ * The wheel has its own mutex. A due session is marked as closed with
+ * session_mark_closed, after which the session table's shard lock is only
+ * taken to unlink it (see session_table_remove), so expiry never holds a
+ * table lock for more than a hash deletion. The wheel does not hold a
+ * reference to the sessions: a session is only removed from the table,
+ * dropping the table's reference, after its timer has been cancelled or
+ * has fired. A close RPC racing with the expiry of the same session sees
+ * the closed flag and fails, and a session that a close RPC has already
+ * marked as closed is left to it. */
+
+#define SESSION_DEFAULT_IDLE_TIMEOUT 600.0   /* seconds */
+#define SESSION_DEFAULT_LIFETIME     86400.0 /* seconds */
+#define SESSION_EXPIRY_TICK          1.0     /* seconds */
+
+typedef struct {
+    session_table_t* table;
+    double           idle_timeout; /* 0 to disable */
+    double           lifetime;     /* 0 to disable */
+    double           tick;         /* duration of a tick, in seconds */
+    double           start;        /* time of tick 0 */
+    timer_wheel_t    wheel;
+    ABT_mutex_memory mtx;          /* protects the wheel */
+    ABT_mutex_memory ult_mtx;
+    ABT_cond_memory  ult_cond;     /* signaled to stop the ULT */
+    int              stop;
+    ABT_thread       ult;
+} session_expiry_t;
+
+static inline int session_expiry_enabled(const session_expiry_t* expiry)
+{
+    return expiry->idle_timeout > 0 || expiry->lifetime > 0;
+}
+
+static inline double session_deadline(const session_expiry_t* expiry, const session_t* session)
+{
+    double deadline = DBL_MAX;
+    if(expiry->idle_timeout > 0)
+        deadline = session->last_used + expiry->idle_timeout;
+    if(expiry->lifetime > 0 && session->created + expiry->lifetime < deadline)
+        deadline = session->created + expiry->lifetime;
+    return deadline;
+}
+
+/* Tick at which the wheel has passed the given time. */
+static inline uint64_t session_expiry_tick_of(const session_expiry_t* expiry, double t)
+{
+    double ticks = (t - expiry->start) / expiry->tick;
+    if(ticks < 0) return 0;
+    if(ticks >= (double)(UINT64_MAX / 2)) return UINT64_MAX / 2;
+    return (uint64_t)ticks + 1;
+}
+
+/* Initializes the wheel, with now as the time of tick 0. The ULT is only
+ * started by session_expiry_start, so that the wheel can also be driven
+ * by calling session_expiry_advance directly. */
+static inline void session_expiry_init(session_expiry_t* expiry, session_table_t* table,
+                                       double idle_timeout, double lifetime,
+                                       double tick, double now)
+{
+    memset(expiry, 0, sizeof(*expiry));
+    expiry->table        = table;
+    expiry->idle_timeout = idle_timeout;
+    expiry->lifetime     = lifetime;
+    expiry->tick         = tick;
+    expiry->start        = now;
+    timer_wheel_init(&expiry->wheel, 0);
+}
+
+/* Arms the timer of a new session. Must be called before the session ID
+ * is handed to the client, so that no close RPC can race with it. */
+static inline void session_expiry_add(session_expiry_t* expiry, session_t* session)
+{
+    if(!session_expiry_enabled(expiry)) return;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->mtx));
+    timer_wheel_add(&expiry->wheel, &session->timer,
+                    session_expiry_tick_of(expiry, session_deadline(expiry, session)));
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->mtx));
+}
+
+/* Disarms the timer of a session that a close RPC is about to remove. */
+static inline void session_expiry_cancel(session_expiry_t* expiry, session_t* session)
+{
+    if(!session_expiry_enabled(expiry)) return;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->mtx));
+    timer_node_unlink(&session->timer);
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->mtx));
+}
+
+/* Advances the wheel up to the given time and removes the sessions that
+ * have expired. Returns the number of sessions removed. */
+static inline size_t session_expiry_advance(session_expiry_t* expiry, double now)
+{
+    uint64_t   target  = session_expiry_tick_of(expiry, now) - 1;
+    session_t* expired = NULL; /* chained through timer.next */
+    size_t     count   = 0;
+
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->mtx));
+    while(expiry->wheel.now < target) {
+        timer_node_t due;
+        timer_list_init(&due);
+        timer_wheel_advance(&expiry->wheel, &due);
+        while(!timer_list_empty(&due)) {
+            timer_node_t* node = due.next;
+            timer_node_unlink(node);
+            session_t* session = (session_t*)((char*)node - offsetof(session_t, timer));
+
+            if(atomic_load(&session->closed)) {
+                // being closed by an RPC, which will remove it
+                continue;
+            }
+            uint64_t deadline = session_expiry_tick_of(expiry, session_deadline(expiry, session));
+            if(deadline > expiry->wheel.now) {
+                // used since the timer was armed
+                timer_wheel_add(&expiry->wheel, node, deadline);
+                continue;
+            }
+            if(!session_mark_closed(session)) continue; // closed in the meantime
+            node->next = expired ? &expired->timer : NULL;
+            expired    = session;
+        }
+    }
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->mtx));
+
+    // unlink and destroy the expired sessions without holding the wheel
+    while(expired) {
+        session_t* session = expired;
+        timer_node_t* next = session->timer.next;
+        expired = next ? (session_t*)((char*)next - offsetof(session_t, timer)) : NULL;
+        session->timer.next = NULL;
+        session_table_remove(expiry->table, session);
+        ++count;
+    }
+    return count;
+}
+
+static inline void session_expiry_ult(void* arg)
+{
+    session_expiry_t* expiry = (session_expiry_t*)arg;
+    ABT_mutex mtx = ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->ult_mtx);
+    ABT_cond cond = ABT_COND_MEMORY_GET_HANDLE(&expiry->ult_cond);
+
+    ABT_mutex_lock(mtx);
+    while(!expiry->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long nsec = deadline.tv_nsec + (long)(expiry->tick * 1e9);
+        deadline.tv_sec  += nsec / 1000000000L;
+        deadline.tv_nsec  = nsec % 1000000000L;
+        ABT_cond_timedwait(cond, mtx, &deadline);
+        if(expiry->stop) break;
+        ABT_mutex_unlock(mtx);
+
+        size_t count = session_expiry_advance(expiry, ABT_get_wtime());
+        if(count) printf("Expired %zu session(s)\n", count);
+
+        ABT_mutex_lock(mtx);
+    }
+    ABT_mutex_unlock(mtx);
+}
+
+static inline int session_expiry_start(session_expiry_t* expiry, margo_instance_id mid)
+{
+    if(!session_expiry_enabled(expiry)) return 0;
+    ABT_pool pool = ABT_POOL_NULL;
+    margo_get_handler_pool(mid, &pool);
+    return ABT_thread_create(pool, session_expiry_ult, expiry,
+                             ABT_THREAD_ATTR_NULL, &expiry->ult) == ABT_SUCCESS ? 0 : -1;
+}
+
+static inline void session_expiry_stop(session_expiry_t* expiry)
+{
+    if(!session_expiry_enabled(expiry) || expiry->ult == ABT_THREAD_NULL) return;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->ult_mtx));
+    expiry->stop = 1;
+    ABT_cond_signal(ABT_COND_MEMORY_GET_HANDLE(&expiry->ult_cond));
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&expiry->ult_mtx));
+    ABT_thread_join(expiry->ult);
+    ABT_thread_free(&expiry->ult);
+}
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef MARGO_AUTH_COMPLETE_GROUP_H
+#define MARGO_AUTH_COMPLETE_GROUP_H
+
+#include <abt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_types.h"
+#include "margo_auth_complete_tickets.h"
+#include "margo_auth_complete_session_index.h"
+
+/* In group mode, the servers of a group share a set of ticket keys, and
+ * authenticating with any of them returns, along with the session ID, a
+ * group ticket that the other members accept: the session's uid, key and
+ * parameters, encrypted and authenticated with AES-256-GCM under the
+ * group's current key. A client sends the ticket with the first RPC of
+ * the session to another member, which opens it and imports the session
+ * in its session table, so a client talking to many servers only goes
+ * through munge once.
+ *
+ * As with sessions shared through shared memory, each member uses its
+ * own key for the session, derived from the session key and its address
+ * (session_key_for_server), and its own sequence numbers starting at 0,
+ * so a token sent to one member can't be replayed on another. A member
+ * imports a given session only once: the IDs of the sessions it imported
+ * are remembered until their ticket expires, and a ticket presented again
+ * after the session was removed (expired, evicted or closed) is refused
+ * with RPC_ERR_SESSION_EVICTED, since accepting it would restart the
+ * sequence numbers at 0. If the history is full of unexpired IDs, tickets
+ * are refused rather than an ID forgotten.
+ *
+ * The keys are read from a file shared by the members (mode 0600), one
+ * key per line as "<key id> <64 hex digits>", the current key first. It
+ * is created with a random key if it doesn't exist. Keys are rotated by
+ * adding a new line at the top of the file: members reload it when it
+ * changes, issue new tickets under the new key, and keep accepting the
+ * tickets of the older keys until they are removed from the file, which
+ * should be done a ticket lifetime after the rotation. Rotation doesn't
+ * affect sessions already imported, which live in the session tables. */
+
+#define GROUP_MAX_KEYS             8
+#define GROUP_TICKET_CONTENT_SIZE  (8 + 4 + 8 + 1 + 1 + 1 + 32)
+#define GROUP_TICKET_SIZE          (4 + TICKET_IV_SIZE + GROUP_TICKET_CONTENT_SIZE + TICKET_GCM_TAG_SIZE)
+#define GROUP_DEFAULT_IMPORT_HISTORY 65536
+
+_Static_assert(GROUP_TICKET_SIZE <= TICKET_MAX_SIZE,
+               "TICKET_MAX_SIZE too small for group tickets");
+
+typedef struct {
+    session_id_t  session_id;
+    uint32_t      uid;
+    uint64_t      expiry; /* seconds since the epoch */
+    uint8_t       mac_alg;
+    uint8_t       tag_len;
+    uint8_t       aead_alg;
+    unsigned char key[32];
+} group_ticket_content_t;
+
+typedef struct {
+    session_id_t session_id; /* 0 if the entry is free */
+    uint64_t     expiry;
+} group_import_t;
+
+typedef struct {
+    char*            key_path;   /* NULL if group mode is disabled */
+    struct timespec  key_mtime;  /* of the key file when it was last read */
+    uint32_t         num_keys;
+    uint32_t         key_ids[GROUP_MAX_KEYS];
+    unsigned char    keys[GROUP_MAX_KEYS][32]; /* keys[0] is the current key */
+    uint64_t         lifetime;   /* of the tickets, in seconds */
+    ABT_mutex_memory mtx;        /* protects everything but the key path and lifetime */
+    session_index_t  imported;   /* IDs of the sessions imported, or issued */
+    group_import_t*  history;    /* same IDs, in import order */
+    size_t           history_size;
+    size_t           head;       /* oldest entry of history */
+    size_t           count;
+} server_group_t;
+
+static inline int server_group_enabled(const server_group_t* group)
+{
+    return group->key_path != NULL;
+}
+
+/* Writes a key file with a single random key, unless it exists. */
+static inline int server_group_create_keys(const char* path)
+{
+    unsigned char key[32];
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) return errno == EEXIST ? 0 : -1;
+    int ok = RAND_bytes(key, sizeof(key)) == 1;
+    FILE* f = fdopen(fd, "w");
+    if(!f) {
+        close(fd);
+        return -1;
+    }
+    if(ok) {
+        fprintf(f, "1 ");
+        for(size_t i = 0; i < sizeof(key); ++i) fprintf(f, "%02x", key[i]);
+        fprintf(f, "\n");
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    ok = ok && fflush(f) == 0 && fsync(fd) == 0;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+/* (Re)reads the keys if the key file changed since they were last read.
+ * Must be called with the group's mutex held. On error, the keys read
+ * previously are kept. */
+static inline int server_group_reload(server_group_t* group)
+{
+    struct stat st;
+    if(stat(group->key_path, &st) != 0) return -1;
+    if(group->num_keys
+    && st.st_mtim.tv_sec == group->key_mtime.tv_sec
+    && st.st_mtim.tv_nsec == group->key_mtime.tv_nsec)
+        return 0;
+    if(st.st_mode & 077) {
+        fprintf(stderr, "Group key file %s must only be accessible by its owner\n", group->key_path);
+        return -1;
+    }
+
+    FILE* f = fopen(group->key_path, "r");
+    if(!f) return -1;
+    uint32_t      ids[GROUP_MAX_KEYS];
+    unsigned char keys[GROUP_MAX_KEYS][32];
+    uint32_t      n = 0;
+    char          line[128], hex[65];
+    int           ok = 1;
+    while(ok && n < GROUP_MAX_KEYS && fgets(line, sizeof(line), f)) {
+        if(line[0] == '#' || line[0] == '\n') continue;
+        ok = sscanf(line, "%u %64[0-9a-fA-F]", &ids[n], hex) == 2 && strlen(hex) == 64;
+        for(size_t i = 0; ok && i < 32; ++i)
+            ok = sscanf(hex + 2 * i, "%2hhx", &keys[n][i]) == 1;
+        ++n;
+    }
+    fclose(f);
+    OPENSSL_cleanse(line, sizeof(line));
+    OPENSSL_cleanse(hex, sizeof(hex));
+    if(ok && n) {
+        group->num_keys = n;
+        OPENSSL_cleanse(group->keys, sizeof(group->keys));
+        memcpy(group->key_ids, ids, n * sizeof(ids[0]));
+        memcpy(group->keys, keys, n * sizeof(keys[0]));
+        group->key_mtime = st.st_mtim;
+    } else {
+        fprintf(stderr, "Invalid group key file %s\n", group->key_path);
+    }
+    OPENSSL_cleanse(keys, sizeof(keys));
+    return ok && n ? 0 : -1;
+}
+
+static inline int server_group_init(server_group_t* group, const char* key_path,
+                                    uint64_t lifetime, size_t history_size)
+{
+    memset(group, 0, sizeof(*group));
+    if(server_group_create_keys(key_path) != 0) return -1;
+    group->key_path     = strdup(key_path);
+    group->lifetime     = lifetime;
+    group->history_size = history_size;
+    group->history      = (group_import_t*)calloc(history_size, sizeof(*group->history));
+    if(!group->key_path || !group->history
+    || session_index_init(&group->imported) != 0
+    || server_group_reload(group) != 0) {
+        session_index_finalize(&group->imported);
+        free(group->key_path);
+        free(group->history);
+        memset(group, 0, sizeof(*group));
+        return -1;
+    }
+    return 0;
+}
+
+static inline void server_group_finalize(server_group_t* group)
+{
+    if(!server_group_enabled(group)) return;
+    OPENSSL_cleanse(group->keys, sizeof(group->keys));
+    session_index_finalize(&group->imported);
+    free(group->history);
+    free(group->key_path);
+    memset(group, 0, sizeof(*group));
+}
+
+/* Returns 1 if this server has had the session with this ID. */
+static inline int server_group_claimed(server_group_t* group, session_id_t session_id)
+{
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+    int claimed = session_index_find(&group->imported, session_id) != NULL;
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+    return claimed;
+}
+
+/* Records that this server has (or had) the session, so that its ticket
+ * is not imported again. Returns -1 if it was already recorded, or if
+ * the history is full. */
+static inline int server_group_claim(server_group_t* group, session_id_t session_id, uint64_t expiry)
+{
+    uint64_t now = (uint64_t)time(NULL);
+    int      ret = -1;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+    // forget the sessions whose tickets have expired, roughly in order
+    // since all the tickets of the group have the same lifetime
+    while(group->count && group->history[group->head].expiry <= now) {
+        session_index_remove(&group->imported, group->history[group->head].session_id);
+        group->head   = (group->head + 1) % group->history_size;
+        group->count -= 1;
+    }
+    if(group->count < group->history_size
+    && !session_index_find(&group->imported, session_id)) {
+        group_import_t* entry = &group->history[(group->head + group->count) % group->history_size];
+        if(session_index_insert(&group->imported, session_id, entry) == 0) {
+            entry->session_id = session_id;
+            entry->expiry     = expiry;
+            group->count     += 1;
+            ret = 0;
+        }
+    }
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+    return ret;
+}
+
+/* Issues a group ticket for a session opened with this server, under
+ * the current key. Sets the content's expiry. */
+static inline int server_group_issue(server_group_t* group, group_ticket_content_t* content,
+                                     ticket_t* ticket)
+{
+    unsigned char plain[GROUP_TICKET_CONTENT_SIZE], *p = plain;
+    unsigned char key[32];
+    uint32_t      key_id;
+    int           ret;
+
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+    server_group_reload(group); // picks up rotated keys
+    key_id = group->key_ids[0];
+    memcpy(key, group->keys[0], sizeof(key));
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+
+    content->expiry = (uint64_t)time(NULL) + group->lifetime;
+    memcpy(p, &content->session_id, 8); p += 8;
+    memcpy(p, &content->uid, 4);        p += 4;
+    memcpy(p, &content->expiry, 8);     p += 8;
+    *p++ = content->mac_alg;
+    *p++ = content->tag_len;
+    *p++ = content->aead_alg;
+    memcpy(p, content->key, sizeof(content->key));
+
+    // key_id | iv | ciphertext | gcm tag, the key ID being authenticated
+    memcpy(ticket->data, &key_id, 4);
+    ret = ticket_seal(key, ticket->data, 4, plain, sizeof(plain), ticket->data + 4);
+    ticket->len = ret == 0 ? GROUP_TICKET_SIZE : 0;
+    OPENSSL_cleanse(plain, sizeof(plain));
+    OPENSSL_cleanse(key, sizeof(key));
+    return ret;
+}
+
+/* Decrypts and authenticates a group ticket, and checks that it has not
+ * expired. */
+static inline int server_group_open(server_group_t* group, const ticket_t* ticket,
+                                    group_ticket_content_t* content)
+{
+    unsigned char plain[GROUP_TICKET_CONTENT_SIZE], *p = plain;
+    unsigned char key[32];
+    uint32_t      key_id;
+    int           found = 0, ret = -1;
+
+    if(ticket->len != GROUP_TICKET_SIZE) return -1;
+    memcpy(&key_id, ticket->data, 4);
+
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+    server_group_reload(group);
+    for(uint32_t i = 0; i < group->num_keys && !found; ++i) {
+        if(group->key_ids[i] != key_id) continue;
+        memcpy(key, group->keys[i], sizeof(key));
+        found = 1;
+    }
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&group->mtx));
+    if(!found) return -1; // unknown or retired key
+
+    if(ticket_unseal(key, ticket->data, 4, ticket->data + 4, sizeof(plain), plain) != 0)
+        goto finish;
+    memcpy(&content->session_id, p, 8); p += 8;
+    memcpy(&content->uid, p, 4);        p += 4;
+    memcpy(&content->expiry, p, 8);     p += 8;
+    content->mac_alg  = *p++;
+    content->tag_len  = *p++;
+    content->aead_alg = *p++;
+    memcpy(content->key, p, sizeof(content->key));
+    if(content->expiry <= (uint64_t)time(NULL)) goto finish;
+    ret = 0;
+
+finish:
+    OPENSSL_cleanse(plain, sizeof(plain));
+    OPENSSL_cleanse(key, sizeof(key));
+    return ret;
+}
+
+#endif
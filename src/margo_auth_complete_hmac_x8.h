@@ -0,0 +1,244 @@
+#ifndef MARGO_AUTH_COMPLETE_HMAC_X8_H
+#define MARGO_AUTH_COMPLETE_HMAC_X8_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HMAC_X8_HAVE_AVX2 1
+#endif
+
+/* Multi-buffer HMAC-SHA-256 of token tags, eight tokens at a time.
+ *
+ * The tag of a token is the HMAC of a 48-byte message: its session ID
+ * and sequence number (16 bytes) followed by the digest of its arguments
+ * (32 bytes). The first block of the inner and outer hashes of HMAC only
+ * depends on the key, so the SHA-256 states after these blocks (the
+ * midstates) are computed once per key by hmac_x8_key_init. A tag then
+ * costs two SHA-256 compressions: one of the message and its padding,
+ * starting from the inner midstate, and one of the inner hash and its
+ * padding, starting from the outer midstate.
+ *
+ * hmac_x8_tags runs these compressions for up to eight tokens at once,
+ * one per 32-bit lane of AVX2 registers, the tokens being possibly keyed
+ * differently. The tags are the same as those computed by OpenSSL. The
+ * kernel is compiled for AVX2 regardless of the compiler flags, and only
+ * called if the CPU supports it (hmac_x8_available); the scalar
+ * compression is only used to compute the midstates. */
+
+#define HMAC_X8_LANES        8
+#define HMAC_X8_MESSAGE_SIZE 48
+#define HMAC_X8_TAG_SIZE     32
+
+typedef struct {
+    uint32_t inner[8]; /* state after absorbing key ^ ipad */
+    uint32_t outer[8]; /* state after absorbing key ^ opad */
+} hmac_x8_key_t;
+
+typedef struct {
+    const hmac_x8_key_t* key;
+    const unsigned char* message; /* HMAC_X8_MESSAGE_SIZE bytes */
+    unsigned char*       tag;     /* HMAC_X8_TAG_SIZE bytes */
+} hmac_x8_job_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t hmac_x8_load_be32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void hmac_x8_store_be32(unsigned char* p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* One SHA-256 compression of a block given as 16 big-endian words. */
+static inline void sha256_compress(uint32_t state[8], const uint32_t block[16])
+{
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    memcpy(w, block, 16 * sizeof(uint32_t));
+    for(int t = 16; t < 64; ++t) {
+        uint32_t s0 = SHA256_ROR(w[t - 15], 7) ^ SHA256_ROR(w[t - 15], 18) ^ (w[t - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[t - 2], 17) ^ SHA256_ROR(w[t - 2], 19) ^ (w[t - 2] >> 10);
+        w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    for(int t = 0; t < 64; ++t) {
+        uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25))
+                    + ((e & f) ^ (~e & g)) + sha256_k[t] + w[t];
+        uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22))
+                    + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    OPENSSL_cleanse(w, sizeof(w));
+}
+
+/* Computes the midstates of a key of at most 64 bytes. */
+static inline int hmac_x8_key_init(hmac_x8_key_t* hkey, const unsigned char* key, size_t key_len)
+{
+    unsigned char pad[64];
+    uint32_t      block[16];
+
+    if(key_len > sizeof(pad)) return -1;
+    for(int round = 0; round < 2; ++round) {
+        uint32_t* state = round == 0 ? hkey->inner : hkey->outer;
+        memset(pad, round == 0 ? 0x36 : 0x5c, sizeof(pad));
+        for(size_t i = 0; i < key_len; ++i) pad[i] ^= key[i];
+        for(int i = 0; i < 16; ++i) block[i] = hmac_x8_load_be32(pad + 4 * i);
+        memcpy(state, sha256_iv, sizeof(sha256_iv));
+        sha256_compress(state, block);
+    }
+    OPENSSL_cleanse(pad, sizeof(pad));
+    OPENSSL_cleanse(block, sizeof(block));
+    return 0;
+}
+
+/* Padded block of the inner hash: the key block is followed by the
+ * 48 bytes of message. */
+static inline void hmac_x8_inner_block(uint32_t block[16], const unsigned char* message)
+{
+    for(int i = 0; i < 12; ++i) block[i] = hmac_x8_load_be32(message + 4 * i);
+    block[12] = 0x80000000;
+    block[13] = block[14] = 0;
+    block[15] = (64 + HMAC_X8_MESSAGE_SIZE) * 8;
+}
+
+#ifdef HMAC_X8_HAVE_AVX2
+
+#define SHA256_X8_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+/* SHA-256 compression of eight blocks, word i of each block being in
+ * block[i], lane j holding block j. */
+__attribute__((target("avx2")))
+static inline void sha256_compress_x8(__m256i state[8], __m256i block[16])
+{
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(int t = 0; t < 64; ++t) {
+        __m256i w;
+        if(t < 16) {
+            w = block[t];
+        } else {
+            // the message schedule is kept in block, as a ring of 16 words
+            __m256i w15 = block[(t - 15) & 15], w2 = block[(t - 2) & 15];
+            __m256i s0  = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(w15, 7), SHA256_X8_ROR(w15, 18)),
+                                           _mm256_srli_epi32(w15, 3));
+            __m256i s1  = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(w2, 17), SHA256_X8_ROR(w2, 19)),
+                                           _mm256_srli_epi32(w2, 10));
+            w = _mm256_add_epi32(_mm256_add_epi32(block[t & 15], s0),
+                                 _mm256_add_epi32(block[(t - 7) & 15], s1));
+            block[t & 15] = w;
+        }
+        __m256i sum1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(e, 6), SHA256_X8_ROR(e, 11)),
+                                        SHA256_X8_ROR(e, 25));
+        __m256i ch   = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1   = _mm256_add_epi32(_mm256_add_epi32(h, sum1),
+                                        _mm256_add_epi32(_mm256_add_epi32(ch, w),
+                                                         _mm256_set1_epi32((int)sha256_k[t])));
+        __m256i sum0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_X8_ROR(a, 2), SHA256_X8_ROR(a, 13)),
+                                        SHA256_X8_ROR(a, 22));
+        __m256i maj  = _mm256_xor_si256(_mm256_and_si256(a, b),
+                                        _mm256_and_si256(c, _mm256_xor_si256(a, b)));
+        __m256i t2   = _mm256_add_epi32(sum0, maj);
+        h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+        d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+    }
+    state[0] = _mm256_add_epi32(state[0], a); state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c); state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e); state[5] = _mm256_add_epi32(state[5], f);
+    state[6] = _mm256_add_epi32(state[6], g); state[7] = _mm256_add_epi32(state[7], h);
+}
+
+/* Computes the tags of 1 to 8 jobs, the unused lanes repeating job 0. */
+__attribute__((target("avx2")))
+static inline void hmac_x8_tags_avx2(const hmac_x8_job_t* jobs, size_t n)
+{
+    uint32_t lanes[HMAC_X8_LANES][16];
+    uint32_t out[8][HMAC_X8_LANES];
+    __m256i  state[8], block[16];
+
+    // transpose the inner blocks and midstates into the lanes
+    for(size_t j = 0; j < HMAC_X8_LANES; ++j)
+        hmac_x8_inner_block(lanes[j], jobs[j < n ? j : 0].message);
+    for(int i = 0; i < 16; ++i)
+        block[i] = _mm256_setr_epi32((int)lanes[0][i], (int)lanes[1][i], (int)lanes[2][i], (int)lanes[3][i],
+                                     (int)lanes[4][i], (int)lanes[5][i], (int)lanes[6][i], (int)lanes[7][i]);
+    for(int i = 0; i < 8; ++i) {
+        for(size_t j = 0; j < HMAC_X8_LANES; ++j) out[i][j] = jobs[j < n ? j : 0].key->inner[i];
+        state[i] = _mm256_loadu_si256((const __m256i*)out[i]);
+    }
+    sha256_compress_x8(state, block);
+
+    // the outer block of a lane holds its inner hash, and the padding of
+    // a key block followed by 32 bytes
+    for(int i = 0; i < 8; ++i) block[i] = state[i];
+    block[8] = _mm256_set1_epi32((int)0x80000000);
+    for(int i = 9; i < 15; ++i) block[i] = _mm256_setzero_si256();
+    block[15] = _mm256_set1_epi32((64 + HMAC_X8_TAG_SIZE) * 8);
+    for(int i = 0; i < 8; ++i) {
+        for(size_t j = 0; j < HMAC_X8_LANES; ++j) out[i][j] = jobs[j < n ? j : 0].key->outer[i];
+        state[i] = _mm256_loadu_si256((const __m256i*)out[i]);
+    }
+    sha256_compress_x8(state, block);
+
+    for(int i = 0; i < 8; ++i) _mm256_storeu_si256((__m256i*)out[i], state[i]);
+    for(size_t j = 0; j < n; ++j)
+        for(int i = 0; i < 8; ++i) hmac_x8_store_be32(jobs[j].tag + 4 * i, out[i][j]);
+
+    OPENSSL_cleanse(lanes, sizeof(lanes));
+    OPENSSL_cleanse(out, sizeof(out));
+}
+
+#endif
+
+/* Whether hmac_x8_tags can be used on this CPU. */
+static inline int hmac_x8_available(void)
+{
+#ifdef HMAC_X8_HAVE_AVX2
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+/* Computes the tags of n jobs, eight at a time. Only call it if
+ * hmac_x8_available returns 1. */
+static inline void hmac_x8_tags(const hmac_x8_job_t* jobs, size_t n)
+{
+#ifdef HMAC_X8_HAVE_AVX2
+    for(size_t i = 0; i < n; i += HMAC_X8_LANES)
+        hmac_x8_tags_avx2(jobs + i, n - i < HMAC_X8_LANES ? n - i : HMAC_X8_LANES);
+#else
+    (void)jobs;
+    (void)n;
+#endif
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef MARGO_AUTH_COMPLETE_QUOTA_H
+#define MARGO_AUTH_COMPLETE_QUOTA_H
+
+#include <abt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "uthash.h"
+#include "margo_auth_complete_types.h"
+#include "margo_auth_complete_session_index.h"
+
+/* Bookkeeping for the limits on the number of sessions: a global limit,
+ * and a limit per uid so that a single user (e.g. a client looping on
+ * authenticate) can't fill the table on its own. Sessions are kept in a
+ * global LRU list and in the LRU list of their uid, and opening a session
+ * over a limit evicts the least recently used session of that list (see
+ * session_table_admit in margo_auth_complete_sessions.h).
+ *
+ * RPCs don't reorder the lists, which would serialize them on the
+ * quota's mutex. A session is stamped with its last_used time when it
+ * moves to the front of a list, and a session found at the back of a
+ * list with a more recent last_used is given a second chance and moved
+ * back to the front instead of being evicted, so the lists are only
+ * approximately in LRU order between evictions but eviction still costs
+ * amortized O(1).
+ *
+ * The IDs of the last evicted sessions are remembered, so that an RPC on
+ * an evicted session can be answered with RPC_ERR_SESSION_EVICTED rather
+ * than a generic error, telling the client to authenticate again. */
+
+#define SESSION_QUOTA_EVICTED_HISTORY 65536
+
+typedef struct session_link_t {
+    struct session_link_t* prev; /* NULL if not in a list */
+    struct session_link_t* next;
+} session_link_t;
+
+static inline void session_list_init(session_link_t* head)
+{
+    head->prev = head->next = head;
+}
+
+static inline void session_list_push_front(session_link_t* head, session_link_t* link)
+{
+    link->prev       = head;
+    link->next       = head->next;
+    head->next->prev = link;
+    head->next       = link;
+}
+
+static inline void session_list_unlink(session_link_t* link)
+{
+    if(!link->prev) return;
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link->next = NULL;
+}
+
+typedef struct session_user_t {
+    uid_t          uid;
+    size_t         count; /* number of sessions in lru */
+    session_link_t lru;   /* sessions of this uid, most recently used first */
+    UT_hash_handle hh;
+} session_user_t;
+
+typedef struct {
+    size_t           max_sessions;  /* 0 for no limit */
+    size_t           max_per_uid;   /* 0 for no limit */
+    ABT_mutex_memory mtx;           /* protects the fields below */
+    size_t           count;         /* number of sessions in lru */
+    session_link_t   lru;           /* all the sessions, most recently used first */
+    session_user_t*  users;         /* hash by uid */
+    session_index_t  evicted;       /* IDs of the last evicted sessions */
+    session_id_t*    evicted_ring;  /* same IDs, in eviction order */
+    size_t           evicted_next;  /* next position in evicted_ring */
+} session_quota_t;
+
+static inline int session_quota_enabled(const session_quota_t* quota)
+{
+    return quota->max_sessions || quota->max_per_uid;
+}
+
+static inline int session_quota_init(session_quota_t* quota, size_t max_sessions, size_t max_per_uid)
+{
+    memset(quota, 0, sizeof(*quota));
+    quota->max_sessions = max_sessions;
+    quota->max_per_uid  = max_per_uid;
+    session_list_init(&quota->lru);
+    if(!session_quota_enabled(quota)) return 0;
+    quota->evicted_ring = (session_id_t*)calloc(SESSION_QUOTA_EVICTED_HISTORY, sizeof(session_id_t));
+    if(!quota->evicted_ring || session_index_init(&quota->evicted) != 0) {
+        free(quota->evicted_ring);
+        quota->evicted_ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void session_quota_finalize(session_quota_t* quota)
+{
+    session_user_t *user, *tmp;
+    HASH_ITER(hh, quota->users, user, tmp) {
+        HASH_DELETE(hh, quota->users, user);
+        free(user);
+    }
+    if(quota->evicted_ring) session_index_finalize(&quota->evicted);
+    free(quota->evicted_ring);
+    memset(quota, 0, sizeof(*quota));
+}
+
+/* Returns the record of a uid, creating it if needed. Must be called with
+ * the quota's mutex held. */
+static inline session_user_t* session_quota_user(session_quota_t* quota, uid_t uid)
+{
+    session_user_t* user = NULL;
+    HASH_FIND(hh, quota->users, &uid, sizeof(uid), user);
+    if(user) return user;
+    user = (session_user_t*)calloc(1, sizeof(*user));
+    if(!user) return NULL;
+    user->uid = uid;
+    session_list_init(&user->lru);
+    HASH_ADD(hh, quota->users, uid, sizeof(user->uid), user);
+    return user;
+}
+
+/* Frees the record of a uid that has no session left. Must be called
+ * with the quota's mutex held. */
+static inline void session_quota_put_user(session_quota_t* quota, session_user_t* user)
+{
+    if(user->count) return;
+    HASH_DELETE(hh, quota->users, user);
+    free(user);
+}
+
+/* Remembers the ID of an evicted session, forgetting the oldest one if
+ * the history is full. Must be called with the quota's mutex held. */
+static inline void session_quota_remember_evicted(session_quota_t* quota, session_id_t session_id)
+{
+    session_id_t* slot = &quota->evicted_ring[quota->evicted_next];
+    if(*slot) session_index_remove(&quota->evicted, *slot);
+    *slot = 0;
+    if(session_index_insert(&quota->evicted, session_id, slot) == 0) *slot = session_id;
+    quota->evicted_next = (quota->evicted_next + 1) % SESSION_QUOTA_EVICTED_HISTORY;
+}
+
+/* Returns 1 if the session with this ID was recently evicted. */
+static inline int session_quota_was_evicted(session_quota_t* quota, session_id_t session_id)
+{
+    if(!session_quota_enabled(quota)) return 0;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+    int evicted = session_index_find(&quota->evicted, session_id) != NULL;
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+    return evicted;
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef MARGO_AUTH_COMPLETE_REPLAY_H
+#define MARGO_AUTH_COMPLETE_REPLAY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* Anti-replay window of a session, so that a client can have several
+ * RPCs in flight and the server can accept their tokens in any order,
+ * as IPsec does for ESP packets (RFC 4303, with the bitmap of RFC 6479).
+ *
+ * The session's seq_no is one more than the highest sequence number
+ * accepted so far. A sequence number at or above it is always accepted,
+ * sliding the window; one below it is accepted if it is within the
+ * window and has not been used yet. The bitmap is kept in a ring of
+ * blocks of 32 sequence numbers, so sliding the window only touches the
+ * blocks it enters instead of shifting the whole bitmap, and one block
+ * of the ring is kept as slack so that the window never shares a block
+ * with the sequence numbers it has just left.
+ *
+ * Sequence numbers are claimed without a lock, once the token carrying
+ * them has been verified. Each entry of the ring packs the number of the
+ * block it currently holds (its low 32 bits) with the bitmap of this
+ * block in a single 64-bit word, so claiming a sequence number is one
+ * compare-and-swap on its entry, which either sets its bit or, if the
+ * entry still holds an older block, replaces it with the new block. An
+ * entry only ever moves to newer blocks, so a bit, once set, can't be
+ * cleared while its block is still in the ring: a sequence number is
+ * accepted at most once whatever the interleaving of the handlers. The
+ * session's seq_no is then raised with a compare-and-swap loop, and is
+ * only used to reject the sequence numbers that are too old.
+ *
+ * A window of 0 words is the strict mode, where the only sequence number
+ * accepted is seq_no itself, i.e. one RPC in flight per session, claimed
+ * with a compare-and-swap on seq_no. */
+
+#define REPLAY_WINDOW_MAX_WORDS 16  /* up to 480 sequence numbers */
+#define REPLAY_DEFAULT_WINDOW   64  /* sequence numbers */
+#define REPLAY_BLOCK_BITS       32
+
+typedef struct {
+    _Atomic uint64_t bits[REPLAY_WINDOW_MAX_WORDS]; /* block << 32 | bitmap */
+} replay_window_t;
+
+/* Number of words of a window covering at least `width` sequence numbers
+ * (a power of 2, at least 2), 0 for the strict mode, or -1 if the window
+ * would be too large. */
+static inline int replay_window_words(size_t width)
+{
+    if(width == 0) return 0;
+    int words = 2;
+    while((size_t)(words - 1) * REPLAY_BLOCK_BITS < width) words *= 2;
+    return words <= REPLAY_WINDOW_MAX_WORDS ? words : -1;
+}
+
+static inline uint64_t replay_window_width(int words)
+{
+    return words ? (uint64_t)(words - 1) * REPLAY_BLOCK_BITS : 0;
+}
+
+/* Raises *value to at least v. */
+static inline void replay_atomic_max(_Atomic uint64_t* value, uint64_t v)
+{
+    uint64_t current = atomic_load_explicit(value, memory_order_relaxed);
+    while(current < v && !atomic_compare_exchange_weak(value, &current, v)) ;
+}
+
+/* Returns 0 if a token with this sequence number can be accepted, given
+ * the session's next sequence number. This does not claim the sequence
+ * number, and only serves to reject replayed tokens before checking
+ * their MAC: the result of replay_window_claim is what counts. */
+static inline int replay_window_check(replay_window_t* window, int words,
+                                      _Atomic uint64_t* next, uint64_t seq_no)
+{
+    uint64_t n = atomic_load_explicit(next, memory_order_acquire);
+    if(words == 0) return seq_no == n ? 0 : -1;
+    if(seq_no < n && n - seq_no > replay_window_width(words)) return -1; // too old
+    uint32_t block = (uint32_t)(seq_no / REPLAY_BLOCK_BITS);
+    uint64_t entry = atomic_load_explicit(&window->bits[block & (words - 1)], memory_order_acquire);
+    int32_t  ahead = (int32_t)(block - (uint32_t)(entry >> 32));
+    if(ahead > 0) return 0;  // block not entered yet
+    if(ahead < 0) return -1; // block already left
+    return (entry >> (seq_no % REPLAY_BLOCK_BITS)) & 1 ? -1 : 0;
+}
+
+/* Claims a sequence number, once the token carrying it has been
+ * verified. Returns -1 if it was already used or is outside the window,
+ * in which case the token must be rejected. */
+static inline int replay_window_claim(replay_window_t* window, int words,
+                                      _Atomic uint64_t* next, uint64_t seq_no)
+{
+    if(words == 0) {
+        uint64_t expected = seq_no;
+        return atomic_compare_exchange_strong(next, &expected, seq_no + 1) ? 0 : -1;
+    }
+
+    uint64_t n = atomic_load_explicit(next, memory_order_acquire);
+    if(seq_no < n && n - seq_no > replay_window_width(words)) return -1; // too old
+
+    uint32_t          block = (uint32_t)(seq_no / REPLAY_BLOCK_BITS);
+    uint64_t          bit   = 1ULL << (seq_no % REPLAY_BLOCK_BITS);
+    _Atomic uint64_t* slot  = &window->bits[block & (words - 1)];
+    uint64_t          entry = atomic_load_explicit(slot, memory_order_acquire);
+    uint64_t          desired;
+    do {
+        int32_t ahead = (int32_t)(block - (uint32_t)(entry >> 32));
+        if(ahead < 0) return -1; // the window has moved past this block
+        if(ahead > 0)
+            desired = ((uint64_t)block << 32) | bit; // entering the block
+        else if(entry & bit)
+            return -1; // already used
+        else
+            desired = entry | bit;
+    } while(!atomic_compare_exchange_weak(slot, &entry, desired));
+
+    replay_atomic_max(next, seq_no + 1);
+    return 0;
+}
+
+/* Resets the window of a session restored or imported with only its
+ * next sequence number, treating all the sequence numbers below it as
+ * used. Must be called before the session is visible to handlers. */
+static inline void replay_window_restore(replay_window_t* window, int words, uint64_t next)
+{
+    for(int i = 0; i < REPLAY_WINDOW_MAX_WORDS; ++i) atomic_init(&window->bits[i], 0);
+    if(words == 0 || next == 0) return;
+    // give each entry the latest block that maps to it, so that none of
+    // them holds a block far behind the window
+    uint64_t last = (next - 1) / REPLAY_BLOCK_BITS;
+    for(uint64_t block = last >= (uint64_t)words ? last - words + 1 : 0; block <= last; ++block) {
+        uint64_t used = block < last ? 0xFFFFFFFFULL
+                                     : (2ULL << ((next - 1) % REPLAY_BLOCK_BITS)) - 1;
+        atomic_init(&window->bits[block & (words - 1)], (block << 32) | used);
+    }
+}
+
+#endif
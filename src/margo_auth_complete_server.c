@@ -1,58 +1,299 @@
 #include <margo.h>
-#include <munge.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <pwd.h>
+#include <getopt.h>
+#include <time.h>
 #include <openssl/rand.h>
 #include "common.h"
-#include "uthash.h"
 #include "margo_auth_complete_types.h"
-
-typedef struct session_t {
-    session_id_t     session_id;
-    UT_hash_handle   hh; /* hash by session_id */
-    uid_t            uid;
-    uint64_t         seq_no;
-    unsigned char    key[32];
-    double           last_used;
-    ABT_mutex_memory mtx;
-} session_t;
+#include "margo_auth_complete_sessions.h"
+#include "margo_auth_complete_expiry.h"
+#include "margo_auth_complete_verifier.h"
+#include "margo_auth_complete_tickets.h"
+#include "margo_auth_complete_group.h"
+#include "margo_auth_complete_auth_pool.h"
+#include "margo_auth_complete_destinations.h"
+#include "margo_auth_complete_credentials.h"
 
 typedef struct {
     margo_instance_id mid;
     char              self_addr[256];
-    session_t*        sessions;
-    ABT_mutex_memory  sessions_mtx;
+    session_table_t   sessions;
+    session_expiry_t  expiry;       /* expires idle and old sessions */
+    session_store_t   store;        /* persistent copy of the sessions, if enabled */
+    double            wall_offset;  /* wall-clock time minus ABT_get_wtime() */
+    shared_table_t    shared;       /* sessions of all the servers of the node, if enabled */
+    unsigned          allowed_macs; /* bitmask of accepted mac_alg_t */
+    verifier_t        verifier;     /* batches token verifications */
+    int               use_tickets;  /* issue tickets instead of storing sessions */
+    ticket_keeper_t   tickets;
+    int               replay_words; /* words of the sessions' replay windows, 0 for strict */
+    server_group_t    group;        /* ticket keys shared with a group of servers, if enabled */
+    auth_pool_t       auth_pool;    /* execution streams running authenticate */
+    credential_history_t credentials; /* multi-destination credentials accepted */
+    credential_backend_t credential_backend; /* munge, or a stand-in */
 } server_t;
 
 static void authenticate(hg_handle_t handle);
 DECLARE_MARGO_RPC_HANDLER(authenticate)
 
+static void run_authentication(void* arg);
+
 static void hello(hg_handle_t handle);
 DECLARE_MARGO_RPC_HANDLER(hello)
 
 static void close_session(hg_handle_t handle);
 DECLARE_MARGO_RPC_HANDLER(close_session)
 
-int main(int argc, char** argv)
+static void server_prefinalize(void* arg);
+
+static void server_finalize(void* arg);
+
+static int lookup_session_aead(void* arg, token_t* token);
+
+static void remove_evicted_sessions(server_t* server, session_t** victims, int num_victims);
+
+static int admit_session(server_t* server, session_t* session);
+
+static size_t restore_sessions(server_t* server);
+
+static session_t* find_session(server_t* server, session_id_t session_id);
+
+static void usage(const char* program)
 {
-    int ret = 0;
+    fprintf(stderr,
+        "Usage: %s <protocol> [options]\n"
+        "Options:\n"
+        "  --credentials=<spec>    credential backend, munge or local:<key file>[:<latency in us>]\n"
+        "                          (default: munge)\n"
+        "  --macs=<alg>,...        MAC algorithms accepted from clients (default: all)\n"
+        "  --verify-batch=<n>      verify tokens in batches of up to n (default: 0, no batching)\n"
+        "  --verify-window=<us>    maximum time a token waits for its batch (default: 50)\n"
+        "  --auth-xstreams=<n>     execution streams dedicated to authentications, 0 to run\n"
+        "                          them with the other RPCs (default: %d)\n"
+        "  --auth-queue=<n>        authentications queued or running beyond which clients are\n"
+        "                          told to retry later, 0 for no limit (default: %d)\n"
+        "  --tickets=<n>           issue stateless tickets, for up to n live sessions\n"
+        "  --ticket-lifetime=<s>   lifetime of a ticket, in seconds (default: 3600)\n"
+        "  --group-keys=<file>     issue group tickets with the keys shared by a group of servers\n"
+        "  --replay-window=<n>     accept the sequence numbers of a session out of order within a\n"
+        "                          window of at least n, 0 for strictly in order (default: %d)\n"
+        "  --session-shards=<n>    number of shards of the session table (default: %d)\n"
+        "  --idle-timeout=<s>      close sessions unused for s seconds, 0 to disable (default: %.0f)\n"
+        "  --session-lifetime=<s>  close sessions s seconds after they were opened, 0 to disable (default: %.0f)\n"
+        "  --huge-pages            allocate sessions from huge pages\n"
+        "  --max-sessions=<n>      evict the least recently used sessions beyond n sessions (default: no limit)\n"
+        "  --max-sessions-per-uid=<n>  same, per uid (default: no limit)\n"
+        "  --store=<file>          keep the sessions in this file across restarts\n"
+        "  --store-key=<file>      host-local key sealing the stored session keys (default: <store>.key)\n"
+        "  --store-capacity=<n>    number of sessions in a new store (default: %d)\n"
+        "  --shared-sessions=<name>  share the sessions with the servers of the node using this\n"
+        "                          POSIX shared memory object (e.g. /margo-auth)\n"
+        "  --shared-capacity=<n>   number of sessions in a new shared table (default: %d)\n",
+        program, AUTH_POOL_DEFAULT_XSTREAMS, AUTH_POOL_DEFAULT_QUEUE, REPLAY_DEFAULT_WINDOW, SESSION_TABLE_DEFAULT_SHARDS,
+        SESSION_DEFAULT_IDLE_TIMEOUT, SESSION_DEFAULT_LIFETIME,
+        SESSION_STORE_DEFAULT_CAPACITY, SHARED_TABLE_DEFAULT_CAPACITY);
+    exit(-1);
+}
+
+/* Parses the value of an integer option, which must lie within [min, max],
+ * exiting with the usage otherwise. */
+static unsigned long long parse_integer(const char* program, const char* arg,
+                                        unsigned long long min, unsigned long long max)
+{
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if(!isdigit((unsigned char)arg[0]) || *end != '\0' || errno == ERANGE
+    || value < min || value > max) {
+        fprintf(stderr, "Invalid value %s\n", arg);
+        usage(program);
+    }
+    return value;
+}
 
-    if(argc != 2) {
-        fprintf(stderr, "Usage: %s <protocol>\n", argv[0]);
-        exit(-1);
+/* Parses the value of an option that is a non-negative number, e.g. a
+ * duration, exiting with the usage if it is not one. */
+static double parse_number(const char* program, const char* arg)
+{
+    char* end;
+    errno = 0;
+    double value = strtod(arg, &end);
+    if(end == arg || *end != '\0' || errno == ERANGE || !isfinite(value) || value < 0) {
+        fprintf(stderr, "Invalid value %s\n", arg);
+        usage(program);
     }
+    return value;
+}
+
+int main(int argc, char** argv)
+{
+    int ret = 0;
 
     hg_addr_t address    = HG_ADDR_NULL;
-    const char* protocol = argv[1];
+    const char* protocol = NULL;
 
     server_t server = {0};
 
+    // by default all the MAC algorithms are accepted, otherwise
+    // the site can restrict them to a comma-separated list
+    server.allowed_macs = (1u << MAC_ALG_COUNT) - 1;
+
+    const char* credentials = "munge";
+
+    size_t verify_batch  = 0;
+    double verify_window = 50e-6;
+
+    int    auth_xstreams = AUTH_POOL_DEFAULT_XSTREAMS;
+    size_t auth_queue    = AUTH_POOL_DEFAULT_QUEUE;
+
+    uint32_t ticket_capacity = 0;
+    uint64_t ticket_lifetime = 3600;
+    const char* group_keys   = NULL;
+
+    server.replay_words = replay_window_words(REPLAY_DEFAULT_WINDOW);
+
+    size_t session_shards = SESSION_TABLE_DEFAULT_SHARDS;
+    double idle_timeout   = SESSION_DEFAULT_IDLE_TIMEOUT;
+    double lifetime       = SESSION_DEFAULT_LIFETIME;
+    int    huge_pages     = 0;
+    size_t max_sessions   = 0;
+    size_t max_per_uid    = 0;
+
+    const char* store_path     = NULL;
+    char*       store_key_path = NULL;
+    size_t      store_capacity = SESSION_STORE_DEFAULT_CAPACITY;
+
+    const char* shared_name     = NULL;
+    size_t      shared_capacity = SHARED_TABLE_DEFAULT_CAPACITY;
+
+    static const struct option options[] = {
+        { "credentials",   required_argument, NULL, 'B' },
+        { "macs",          required_argument, NULL, 'm' },
+        { "verify-batch",  required_argument, NULL, 'b' },
+        { "verify-window", required_argument, NULL, 'w' },
+        { "auth-xstreams", required_argument, NULL, 'A' },
+        { "auth-queue",    required_argument, NULL, 'Q' },
+        { "tickets",         required_argument, NULL, 't' },
+        { "ticket-lifetime", required_argument, NULL, 'l' },
+        { "group-keys",      required_argument, NULL, 'g' },
+        { "replay-window",   required_argument, NULL, 'r' },
+        { "session-shards",  required_argument, NULL, 's' },
+        { "idle-timeout",     required_argument, NULL, 'i' },
+        { "session-lifetime", required_argument, NULL, 'L' },
+        { "huge-pages",       no_argument,       NULL, 'H' },
+        { "max-sessions",         required_argument, NULL, 'M' },
+        { "max-sessions-per-uid", required_argument, NULL, 'U' },
+        { "store",          required_argument, NULL, 'S' },
+        { "store-key",      required_argument, NULL, 'K' },
+        { "store-capacity", required_argument, NULL, 'C' },
+        { "shared-sessions", required_argument, NULL, 'X' },
+        { "shared-capacity", required_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch(opt) {
+        case 'B':
+            credentials = optarg;
+            break;
+        case 'm':
+            server.allowed_macs = 0;
+            for(char* name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+                mac_alg_t alg;
+                if(mac_alg_from_name(name, &alg) != 0) {
+                    fprintf(stderr, "Unknown MAC algorithm %s\n", name);
+                    exit(-1);
+                }
+                server.allowed_macs |= 1u << alg;
+            }
+            break;
+        case 'b':
+            verify_batch = parse_integer(argv[0], optarg, 0, SIZE_MAX);
+            break;
+        case 'w':
+            verify_window = parse_number(argv[0], optarg) * 1e-6;
+            break;
+        case 'A':
+            auth_xstreams = (int)parse_integer(argv[0], optarg, 0, INT_MAX);
+            break;
+        case 'Q':
+            auth_queue = parse_integer(argv[0], optarg, 0, SIZE_MAX);
+            break;
+        case 't':
+            ticket_capacity = parse_integer(argv[0], optarg, 0, TICKET_SLOT_NONE - 1);
+            break;
+        case 'l':
+            ticket_lifetime = parse_integer(argv[0], optarg, 1, UINT32_MAX);
+            break;
+        case 'g':
+            group_keys = optarg;
+            break;
+        case 'r':
+            server.replay_words = replay_window_words(parse_integer(argv[0], optarg, 0, SIZE_MAX));
+            if(server.replay_words < 0) {
+                fprintf(stderr, "The replay window can't exceed %d sequence numbers\n",
+                        (int)replay_window_width(REPLAY_WINDOW_MAX_WORDS));
+                exit(-1);
+            }
+            break;
+        case 's':
+            session_shards = parse_integer(argv[0], optarg, 1, SIZE_MAX / 2);
+            break;
+        case 'i':
+            idle_timeout = parse_number(argv[0], optarg);
+            break;
+        case 'L':
+            lifetime = parse_number(argv[0], optarg);
+            break;
+        case 'H':
+            huge_pages = 1;
+            break;
+        case 'M':
+            max_sessions = parse_integer(argv[0], optarg, 0, SIZE_MAX);
+            break;
+        case 'U':
+            max_per_uid = parse_integer(argv[0], optarg, 0, SIZE_MAX);
+            break;
+        case 'S':
+            store_path = optarg;
+            break;
+        case 'K':
+            free(store_key_path);
+            store_key_path = strdup(optarg);
+            break;
+        case 'C':
+            store_capacity = parse_integer(argv[0], optarg, 1, UINT32_MAX);
+            break;
+        case 'X':
+            shared_name = optarg;
+            break;
+        case 'c':
+            shared_capacity = parse_integer(argv[0], optarg, 1, UINT32_MAX);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1) usage(argv[0]);
+    protocol = argv[optind];
+
     // initialize margo
     server.mid = margo_init(protocol, MARGO_SERVER_MODE, 0, 0);
     ASSERT(server.mid != MARGO_INSTANCE_NULL,
            "Could not initialize margo with protocol %s\n", protocol);
 
+    // tear down whatever is set up below when margo is finalized, which
+    // the error paths do as well: the callbacks skip what was not set up
+    margo_push_prefinalize_callback(server.mid, server_prefinalize, &server);
+    margo_push_finalize_callback(server.mid, server_finalize, &server);
+
     // get address of this server
     hg_return_t hret = margo_addr_self(server.mid, &address);
     ASSERT(hret == HG_SUCCESS,
@@ -67,8 +308,80 @@ int main(int argc, char** argv)
     server.self_addr[sizeof(server.self_addr)-1] = '\0';
 
     margo_addr_free(server.mid, address);
+    address = HG_ADDR_NULL;
+
+    // set up the session table
+    ret = session_table_init(&server.sessions, session_shards, huge_pages);
+    ASSERT(ret == 0, "Could not initialize the session table\n");
+    ret = session_table_set_limits(&server.sessions, max_sessions, max_per_uid);
+    ASSERT(ret == 0, "Could not set the limits of the session table\n");
+    session_expiry_init(&server.expiry, &server.sessions, idle_timeout, lifetime,
+                        SESSION_EXPIRY_TICK, ABT_get_wtime());
+
+    // reload the sessions stored by the previous run of the server
+    if(store_path) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        server.wall_offset = now.tv_sec + now.tv_nsec * 1e-9 - ABT_get_wtime();
+        if(!store_key_path) {
+            store_key_path = malloc(strlen(store_path) + sizeof(".key"));
+            sprintf(store_key_path, "%s.key", store_path);
+        }
+        ret = session_store_open(&server.store, store_path, store_key_path, store_capacity);
+        ASSERT(ret == 0, "Could not open session store %s\n", store_path);
+        server.sessions.store = &server.store;
+        printf("Restored %zu session(s) from %s\n", restore_sessions(&server), store_path);
+    }
+    free(store_key_path);
+    store_key_path = NULL;
+
+    // share the sessions with the other servers of the node
+    if(shared_name) {
+        ret = shared_table_open(&server.shared, shared_name, shared_capacity,
+                                server.self_addr, idle_timeout);
+        ASSERT(ret == 0, "Could not open shared session table %s\n", shared_name);
+        server.sessions.shared = &server.shared;
+        printf("Sharing sessions through %s as server %d\n", shared_name, server.shared.rank);
+    }
+
+    // set up the ticket keeper
+    if(ticket_capacity) {
+        ret = ticket_keeper_init(&server.tickets, ticket_capacity, ticket_lifetime);
+        ASSERT(ret == 0, "Could not initialize tickets\n");
+        server.use_tickets = 1;
+    }
+
+    // join the group of servers sharing the ticket keys
+    if(group_keys) {
+        ASSERT(!server.use_tickets, "Group mode and ticket mode are exclusive\n");
+        ret = server_group_init(&server.group, group_keys, ticket_lifetime,
+                                GROUP_DEFAULT_IMPORT_HISTORY);
+        ASSERT(ret == 0, "Could not read group keys from %s\n", group_keys);
+        printf("Issuing group tickets with key %u\n", server.group.key_ids[0]);
+    }
 
-    // TODO: use margo_push_finalize_callback to clear the content of server.sessions
+    // start the token verifier
+    ret = verifier_start(&server.verifier, verify_batch, verify_window);
+    ASSERT(ret == 0, "Could not start the token verifier\n");
+
+    // set up the backend decoding the credentials
+    ret = credential_backend_init(&server.credential_backend, credentials);
+    ASSERT(ret == 0, "Could not set up credential backend %s\n", credentials);
+
+    // remember the multi-destination credentials accepted, which munged
+    // doesn't refuse when another server of the node decoded them
+    ret = credential_history_init(&server.credentials, DESTINATIONS_DEFAULT_WINDOW,
+                                  DESTINATIONS_DEFAULT_HISTORY);
+    ASSERT(ret == 0, "Could not initialize the history of credentials\n");
+
+    // start the execution streams that run the authentications, so that
+    // the blocking munge_decode calls don't hold up the other RPCs
+    ret = auth_pool_start(&server.auth_pool, auth_xstreams, auth_queue);
+    ASSERT(ret == 0, "Could not start the authentication execution streams\n");
+
+    // start the ULT that expires sessions
+    ret = session_expiry_start(&server.expiry, server.mid);
+    ASSERT(ret == 0, "Could not start the session expiry ULT\n");
 
     // register RPCs
     hg_id_t id;
@@ -81,86 +394,548 @@ int main(int argc, char** argv)
 
     printf("Server running at address %s\n", server.self_addr);
 
-    // TODO: add a ULT that periodically prunes server.sessions
-    // of sessions that haven't been active in a while
-
     // run progress loop
     margo_wait_for_finalize(server.mid);
-
     return 0;
 
 finish:
-    margo_addr_free(server.mid, address);
-    margo_finalize(server.mid);
+    free(store_key_path);
+    if(server.mid != MARGO_INSTANCE_NULL) {
+        if(address != HG_ADDR_NULL) margo_addr_free(server.mid, address);
+        margo_finalize(server.mid);
+    }
+    return ret;
+}
+
+void server_prefinalize(void* arg)
+{
+    server_t* server = (server_t*)arg;
+    session_expiry_stop(&server->expiry);
+    verifier_stop(&server->verifier);
+    auth_pool_stop(&server->auth_pool);
+}
+
+/* Called by margo_finalize once the handlers are done, while Argobots
+ * can still run the mutexes and slabs of the session table. */
+void server_finalize(void* arg)
+{
+    server_t* server = (server_t*)arg;
+    session_table_finalize(&server->sessions); // leaves the stored sessions
+    session_store_close(&server->store);
+    shared_table_close(&server->shared); // leaves the sessions to the other servers
+    if(server->use_tickets) ticket_keeper_finalize(&server->tickets);
+    server_group_finalize(&server->group);
+    credential_history_finalize(&server->credentials);
+    credential_backend_finalize(&server->credential_backend);
+}
+
+/* Removes the sessions evicted to make room for a new one. */
+static void remove_evicted_sessions(server_t* server, session_t** victims, int num_victims)
+{
+    for(int i = 0; i < num_victims; ++i) {
+        printf("Evicted a session of uid=%d\n", victims[i]->uid);
+        session_expiry_cancel(&server->expiry, victims[i]);
+        session_table_remove(&server->sessions, victims[i]);
+    }
+}
+
+/* Arms the expiry timer of a session just inserted in the table, and
+ * counts it against the limits, removing the sessions evicted for it.
+ * If it can't be counted, the session is removed from the table, which
+ * drops the table's reference to it, and -1 is returned. */
+static int admit_session(server_t* server, session_t* session)
+{
+    session_t* victims[2];
+    // the session may expire or be evicted as soon as its timer is armed
+    // and it is counted, so hold a reference to it meanwhile
+    atomic_fetch_add_explicit(&session->refcount, 1, memory_order_relaxed);
+    session_expiry_add(&server->expiry, session);
+    int num_victims = session_table_admit(&server->sessions, session, victims);
+    if(num_victims >= 0) {
+        remove_evicted_sessions(server, victims, num_victims);
+    } else if(session_mark_closed(session)) {
+        session_expiry_cancel(&server->expiry, session);
+        session_table_remove(&server->sessions, session);
+    }
+    session_release(session);
+    return num_victims >= 0 ? 0 : -1;
+}
+
+/* Recreates the sessions found in the session store, keeping their
+ * records. Returns the number of sessions restored. */
+static size_t restore_sessions(server_t* server)
+{
+    size_t count = 0;
+    for(size_t i = 0; i < server->store.capacity; ++i) {
+        session_entry_t entry;
+        uint32_t        slot;
+        if(session_store_read(&server->store, i, &entry, &slot) != 1) continue;
+
+        session_t* session = session_alloc(&server->sessions);
+        int        ok      = session != NULL
+                          && entry.mac_alg < MAC_ALG_COUNT
+                          && (server->allowed_macs & (1u << entry.mac_alg));
+        if(ok) {
+            session->session_id = entry.session_id;
+            session->uid        = entry.uid;
+            session->seq_no     = entry.seq_no;
+            replay_window_restore(&session->replay, server->replay_words, session->seq_no);
+            session->created    = entry.created - server->wall_offset;
+            session->last_used  = entry.last_used - server->wall_offset;
+            session->mac_alg    = (mac_alg_t)entry.mac_alg;
+            session->store_slot = slot;
+            memcpy(session->key, entry.key, sizeof(session->key));
+            ok = mac_init(&session->mac, session->mac_alg, entry.tag_len,
+                          session->key, sizeof(session->key)) == 0
+              && aead_init(&session->aead, (aead_alg_t)entry.aead_alg,
+                           session->key, sizeof(session->key)) == 0;
+            session->sealed = session->aead.alg != AEAD_NONE;
+        }
+        OPENSSL_cleanse(&entry, sizeof(entry));
+
+        if(!ok || session_table_insert(&server->sessions, session) != 0) {
+            session_store_erase(&server->store, slot);
+            if(session) session_destroy(session);
+            continue;
+        }
+        // a session that can't be counted is removed, its record with it
+        if(admit_session(server, session) != 0) continue;
+        ++count;
+    }
+    return count;
+}
+
+/* Adds a session opened with another server to the table, from its
+ * parameters. Unless the session was opened with this server (before a
+ * restart), its key is derived from the session key and this server's
+ * address, as the client does. Returns the session with a reference, or
+ * NULL, and sets inserted if it was not already in the table. */
+static session_t* import_session(server_t* server, const shared_entry_t* entry,
+                                 uint32_t shared_slot, int* inserted)
+{
+    session_t* session = NULL;
+    session_t* found   = NULL;
+    int        ret     = 0;
+
+    *inserted = 0;
+    ASSERT(entry->mac_alg < MAC_ALG_COUNT && (server->allowed_macs & (1u << entry->mac_alg)),
+           "MAC algorithm %u of imported session is not accepted\n", entry->mac_alg);
+
+    session = session_alloc(&server->sessions);
+    ASSERT(session != NULL, "Could not allocate session\n");
+    session->session_id  = entry->session_id;
+    session->uid         = entry->uid;
+    session->seq_no      = entry->seq_no;
+    replay_window_restore(&session->replay, server->replay_words, session->seq_no);
+    session->mac_alg     = (mac_alg_t)entry->mac_alg;
+    session->shared_slot = shared_slot;
+    session->last_used   = ABT_get_wtime();
+    session->created     = session->last_used - entry->age;
+    if(entry->is_origin)
+        memcpy(session->key, entry->key, sizeof(session->key));
+    else {
+        ret = session_key_for_server(entry->key, server->self_addr, session->key);
+        ASSERT(ret == 0, "Could not derive key of imported session\n");
+    }
+    ret = mac_init(&session->mac, session->mac_alg, entry->tag_len,
+                   session->key, sizeof(session->key));
+    ASSERT(ret == 0, "Could not initialize MAC state for imported session\n");
+    ret = aead_init(&session->aead, (aead_alg_t)entry->aead_alg,
+                    session->key, sizeof(session->key));
+    ASSERT(ret == 0, "Could not derive AEAD key for imported session\n");
+    session->sealed = session->aead.alg != AEAD_NONE;
+
+    // another handler may have imported the session meanwhile
+    found = session_table_insert_or_find(&server->sessions, session);
+    if(found != session) goto finish;
+    session = NULL;
+    if(admit_session(server, found) != 0) {
+        session_release(found);
+        found = NULL;
+    }
+    ASSERT(found != NULL, "Could not count session against the limits\n");
+    printf("Imported session of uid=%d\n", found->uid);
+    *inserted = 1;
+
+finish:
+    if(session) session_destroy(session);
+    return found;
+}
+
+/* Imports a session opened with another server of the node from the
+ * shared session table. Returns it with a reference, or NULL. */
+static session_t* import_shared_session(server_t* server, session_id_t session_id)
+{
+    shared_entry_t entry;
+    int            inserted;
+    uint32_t slot = shared_table_lookup(&server->shared, session_id, &entry);
+    if(!slot) return NULL;
+    session_t* session = import_session(server, &entry, slot, &inserted);
+    OPENSSL_cleanse(&entry, sizeof(entry));
+    return session;
+}
+
+/* Returns the session with this ID with a reference, importing it from
+ * the shared session table if it was opened with another server of the
+ * node, or NULL. A session that another server has closed is removed
+ * from the table instead; the check is only made here, so an RPC
+ * already past it can still complete. */
+static session_t* find_session(server_t* server, session_id_t session_id)
+{
+    session_t* session = session_table_find(&server->sessions, session_id);
+    if(!shared_table_enabled(&server->shared)) return session;
+    if(!session) return import_shared_session(server, session_id);
+    if(!session->shared_slot
+    || shared_table_valid(&server->shared, session->shared_slot, session_id))
+        return session;
+
+    if(session_mark_closed(session)) {
+        session_expiry_cancel(&server->expiry, session);
+        session_table_remove(&server->sessions, session);
+    }
+    session_release(session);
+    return NULL;
+}
+
+/* Imports the session of a group ticket, opened with another member of
+ * the group, unless this server already has it. Sets the token's session
+ * ID. Returns the session with a reference, or NULL, setting evicted if
+ * the session was imported before and has been removed since. */
+static session_t* import_group_session(server_t* server, token_t* token, int* evicted)
+{
+    group_ticket_content_t content;
+    session_t*             session = NULL;
+    int                    inserted;
+
+    if(server_group_open(&server->group, &token->ticket, &content) != 0) goto finish;
+    token->session_id = content.session_id;
+
+    session = find_session(server, content.session_id);
+    if(session) goto finish;
+    if(server_group_claimed(&server->group, content.session_id)) {
+        // importing it again would restart its sequence numbers
+        *evicted = 1;
+        goto finish;
+    }
+
+    uint64_t now = (uint64_t)time(NULL);
+    shared_entry_t entry = {
+        .session_id = content.session_id,
+        .uid        = (uid_t)content.uid,
+        .mac_alg    = content.mac_alg,
+        .tag_len    = content.tag_len,
+        .aead_alg   = content.aead_alg,
+        .age        = (double)server->group.lifetime - (double)(content.expiry - now)
+    };
+    memcpy(entry.key, content.key, sizeof(entry.key));
+    session = import_session(server, &entry, 0, &inserted);
+    OPENSSL_cleanse(&entry, sizeof(entry));
+    if(!inserted
+    || server_group_claim(&server->group, content.session_id, content.expiry) == 0)
+        goto finish;
+
+    // the history of imported sessions is full
+    fprintf(stderr, "Too many group sessions imported, refusing group ticket\n");
+    if(session_mark_closed(session)) {
+        session_expiry_cancel(&server->expiry, session);
+        session_table_remove(&server->sessions, session);
+    }
+    session_release(session);
+    session = NULL;
+
+finish:
+    OPENSSL_cleanse(&content, sizeof(content));
+    return session;
+}
+
+/* Returns the session of a token with a reference, or NULL. In group
+ * mode, a token that carries a group ticket imports its session. */
+static session_t* find_token_session(server_t* server, token_t* token, int* evicted)
+{
+    *evicted = 0;
+    if(token->ticket.len && server_group_enabled(&server->group))
+        return import_group_session(server, token, evicted);
+    if(token->ticket.len) return NULL; // ticket mode
+    session_t* session = find_session(server, token->session_id);
+    if(!session) *evicted = session_table_evicted(&server->sessions, token->session_id);
+    return session;
+}
+
+/* Called while deserializing sealed arguments, copies the AEAD state of
+ * the session they belong to. */
+static int lookup_session_aead(void* arg, token_t* token)
+{
+    server_t*  server  = (server_t*)arg;
+    int        evicted = 0;
+    session_t* session = find_token_session(server, token, &evicted);
+    int        ret     = -1;
+    if(!session) return -1;
+    // the AEAD state of a session never changes once it is in the table
+    if(session->aead.alg != AEAD_NONE) {
+        token->aead = session->aead;
+        ret         = 0;
+    }
+    session_release(session);
+    return ret;
+}
+
+/* Returns the error to answer an RPC whose sealed arguments no session
+ * could open, RPC_ERR_SESSION_EVICTED if its session was evicted. */
+static int unopened_args_error(server_t* server, token_t* token)
+{
+    int        evicted = 0;
+    session_t* session = find_token_session(server, token, &evicted);
+    if(session) session_release(session); // not sealed, or closed meanwhile
+    if(evicted) {
+        fprintf(stderr, "Session was evicted\n");
+        return RPC_ERR_SESSION_EVICTED;
+    }
+    fprintf(stderr, "Could not open sealed arguments\n");
+    return -1;
+}
+
+/* Verifies a token that carries a ticket and claims its sequence number,
+ * revoking the ticket afterwards if requested. The MAC state is the one
+ * keyed in the ticket's slot when the ticket was issued. */
+static int check_ticket_token(server_t* server, token_t* token, uid_t* uid, int revoke)
+{
+    ticket_content_t content;
+    const mac_t*     mac = NULL;
+    int              ret = -1;
+
+    if(!server->use_tickets) return -1;
+    if(ticket_open(&server->tickets, &token->ticket, &content) != 0) goto finish;
+    token->session_id = content.session_id;
+    *uid = (uid_t)content.uid;
+
+    mac = ticket_acquire(&server->tickets, &content);
+    if(!mac) goto finish;
+    if(verifier_check(&server->verifier, token, token->session_id, token->seq_no, mac) != 0)
+        goto finish;
+    if(ticket_claim_seq_no(&server->tickets, &content, token->seq_no) != 0) goto finish;
+    if(revoke) ticket_revoke(&server->tickets, &content);
+    ret = 0;
+
+finish:
+    if(mac) ticket_release(&server->tickets, &content);
+    OPENSSL_cleanse(&content, sizeof(content));
     return ret;
 }
 
 void authenticate(hg_handle_t handle)
 {
+    margo_instance_id     mid  = margo_hg_handle_get_instance(handle);
+    const struct hg_info* info = margo_get_info(handle);
+    server_t* server           = margo_registered_data(mid, info->id);
+
+    // queue the authentication, or tell the client to come back later
+    // without decoding its credential if too many are queued already
+    auth_pool_handle(&server->auth_pool, handle, run_authentication);
+}
+DEFINE_MARGO_RPC_HANDLER(authenticate)
+
+/* Authenticates a client, in the pool of authentications once admitted
+ * by the authenticate handler. */
+void run_authentication(void* arg)
+{
+    hg_handle_t  handle     = (hg_handle_t)arg;
+    double       started    = ABT_get_wtime();
     auth_in_t    in         = {0};
     auth_out_t   out        = {0};
     hg_return_t  hret       = HG_SUCCESS;
     int          ret        = 0;
-    munge_err_t  err        = 0;
+    int          status     = CREDENTIAL_ERROR;
     session_t*   session    = NULL;
     char*        payload    = NULL;
-    int          payload_len;
+    size_t       payload_len;
+    gid_t        gid;
+    const char*  destinations;
+    size_t       destinations_len;
+    time_t       encoded;
+    uint8_t      params[3]; /* MAC algorithm, tag length, and AEAD algorithm */
 
     margo_instance_id     mid  = margo_hg_handle_get_instance(handle);
     const struct hg_info* info = margo_get_info(handle);
     server_t* server           = margo_registered_data(mid, info->id);
-    session                    = calloc(1, sizeof(*session));
 
     // get the input from the RPC
     hret = margo_get_input(handle, &in);
     ASSERT(hret == HG_SUCCESS,
             "Could not deserialize input arguments\n");
 
-    // decode the credential part
-    err = munge_decode(in.credential, NULL, (void**)&payload, &payload_len, &session->uid, NULL);
-    ASSERT(err == 0, "Failed to decode credential\n");
-    ASSERT((unsigned)payload_len > sizeof(session->session_id) + 1,
-           "Invalid munge payload size found in credential\n");
+    session = session_alloc(&server->sessions);
+    ASSERT(session != NULL, "Could not allocate session\n");
+
+    // decode the credential part, a credential already decoded on this
+    // node being only acceptable if it has several destinations
+    status = server->credential_backend.decode(&server->credential_backend, in.credential,
+                                               (void**)&payload, &payload_len,
+                                               &session->uid, &gid, &encoded);
+    ASSERT(status != CREDENTIAL_ERROR && payload,
+           "Failed to decode credential\n");
+    ASSERT(payload_len > sizeof(session->key) + sizeof(params),
+           "Invalid payload size found in credential\n");
 
-    // the payload should contain key + server address,
+    // the payload should contain key + MAC algorithm + tag length + AEAD algorithm
+    // + server address (or list of server addresses),
     // the key is 32 bytes of binary data
-    // the server address is a null-terminated ASCII string
+    // the MAC algorithm is a single byte holding a mac_alg_t
+    // the tag length is a single byte holding the number of MAC bytes in tokens
+    // the AEAD algorithm is a single byte holding an aead_alg_t (AEAD_NONE if
+    // the RPCs of the session are not sealed)
+    // the server address is an ASCII string, or, for a credential with
+    // several destinations, an empty string followed by the addresses, each
+    // null-terminated (see margo_auth_complete_destinations.h)
 
     // get the key from the payload
     memcpy(session->key, payload, sizeof(session->key));
 
-    // check that this server is the intended destination
-    ASSERT(strncmp(server->self_addr, payload + sizeof(session->key), payload_len - sizeof(session->key)) == 0,
-           "Replay attempt, not intended destination for this RPC!\n");
+    // check that this server is an intended destination
+    destinations     = payload + sizeof(session->key) + sizeof(params);
+    destinations_len = payload_len - sizeof(session->key) - sizeof(params);
+    if(destinations_multiple(destinations, destinations_len)) {
+        ASSERT(destinations_contain(destinations, destinations_len, server->self_addr),
+               "Replay attempt, not intended destination for this RPC!\n");
+        ret = credential_history_claim(&server->credentials, session->key, encoded);
+        ASSERT(ret >= 0, "Too many credentials accepted recently to detect replays\n");
+        ASSERT(ret == 0, "Replay attempt, credential already used with this server!\n");
+        // use this server's own key for the session
+        unsigned char key[32];
+        ret = session_key_for_server(session->key, server->self_addr, key);
+        memcpy(session->key, key, sizeof(session->key));
+        OPENSSL_cleanse(key, sizeof(key));
+        ASSERT(ret == 0, "Could not derive the session key of this server\n");
+    } else {
+        ASSERT(status == CREDENTIAL_SUCCESS, "Failed to decode credential, already used\n");
+        ASSERT(strncmp(server->self_addr, destinations, destinations_len) == 0,
+               "Replay attempt, not intended destination for this RPC!\n");
+    }
+
+    // get the MAC algorithm and check that this server accepts it
+    memcpy(params, payload + sizeof(session->key), sizeof(params));
+    ASSERT(params[0] < MAC_ALG_COUNT && (server->allowed_macs & (1u << params[0])),
+           "MAC algorithm %u proposed by the client is not accepted\n", params[0]);
+    session->mac_alg = (mac_alg_t)params[0];
+
+    // key the session's MAC state once, for all the RPCs to come,
+    // mac_init also rejects tag lengths that are too short or too long
+    ret = mac_init(&session->mac, session->mac_alg, params[1],
+                   session->key, sizeof(session->key));
+    ASSERT(ret == 0, "Could not initialize MAC state for session\n");
+
+    // derive the key used to seal the session's RPCs, if requested
+    ret = aead_init(&session->aead, (aead_alg_t)params[2], session->key, sizeof(session->key));
+    ASSERT(ret == 0, "AEAD algorithm %u proposed by the client is not supported\n", params[2]);
+    session->sealed = session->aead.alg != AEAD_NONE;
 
     // create a session ID for this new connection
-    ret = RAND_bytes((unsigned char*)(&session->session_id), sizeof(session->session_id));
-    ASSERT(ret == 1, "Error generating random session ID\n");
+    // (0 is reserved to mark free ticket slots, and 1 deleted shared slots)
+    do {
+        ret = RAND_bytes((unsigned char*)(&session->session_id), sizeof(session->session_id));
+        ASSERT(ret == 1, "Error generating random session ID\n");
+    } while(session->session_id <= SHARED_SESSION_DELETED);
     ret = 0;
     out.session_id = session->session_id;
 
     // print out some information
-    struct passwd *pws = getpwuid(session->uid);
-    printf("Authenticated with uid=%d (%s)\n", session->uid, pws->pw_name);
+    printf("Authenticated with uid=%d (%s) using %s\n",
+           session->uid, user_name(session->uid), mac_algs[session->mac_alg].name);
 
-    // initialize last_used field for the session
-    session->last_used = ABT_get_wtime();
+    // in ticket mode, the session is handed to the client instead of stored
+    if(server->use_tickets) {
+        ASSERT(!session->sealed,
+               "Sealed RPCs are not supported in ticket mode\n");
+        ticket_content_t content = {
+            .session_id = session->session_id,
+            .uid        = (uint32_t)session->uid,
+            .mac_alg    = (uint8_t)session->mac_alg,
+            .tag_len    = session->mac.tag_len
+        };
+        memcpy(content.key, session->key, sizeof(content.key));
+        ret = ticket_issue(&server->tickets, &content, &out.ticket);
+        OPENSSL_cleanse(&content, sizeof(content));
+        ASSERT(ret == 0, "Could not issue ticket, too many live sessions\n");
+        goto finish;
+    }
+
+    // initialize the created and last_used fields for the session
+    session->created   = ABT_get_wtime();
+    session->last_used = session->created;
+
+    // in group mode, also hand the client a ticket that the other members
+    // of the group accept, and never import it here
+    if(server_group_enabled(&server->group)) {
+        group_ticket_content_t content = {
+            .session_id = session->session_id,
+            .uid        = (uint32_t)session->uid,
+            .mac_alg    = (uint8_t)session->mac_alg,
+            .tag_len    = session->mac.tag_len,
+            .aead_alg   = (uint8_t)session->aead.alg
+        };
+        memcpy(content.key, session->key, sizeof(content.key));
+        ret = server_group_issue(&server->group, &content, &out.ticket);
+        if(ret == 0) ret = server_group_claim(&server->group, session->session_id, content.expiry);
+        OPENSSL_cleanse(&content, sizeof(content));
+        ASSERT(ret == 0, "Could not issue group ticket\n");
+        out.group = 1;
+    }
+
+    // save the session in the store, if any, so that it survives a restart
+    if(session_store_enabled(&server->store)) {
+        session_entry_t entry = {
+            .session_id = session->session_id,
+            .seq_no     = session->seq_no,
+            .last_used  = session->last_used + server->wall_offset,
+            .created    = session->created + server->wall_offset,
+            .uid        = session->uid,
+            .mac_alg    = (uint8_t)session->mac_alg,
+            .tag_len    = session->mac.tag_len,
+            .aead_alg   = (uint8_t)session->aead.alg
+        };
+        memcpy(entry.key, session->key, sizeof(entry.key));
+        session->store_slot = session_store_save(&server->store, &entry);
+        OPENSSL_cleanse(&entry, sizeof(entry));
+        if(!session->store_slot) fprintf(stderr, "Session store is full, session not saved\n");
+    }
+
+    // publish the session to the other servers of the node, if shared
+    if(shared_table_enabled(&server->shared)) {
+        session->shared_slot = shared_table_publish(&server->shared, session->session_id,
+                                                    session->uid, (uint8_t)session->mac_alg,
+                                                    session->mac.tag_len, (uint8_t)session->aead.alg,
+                                                    session->key);
+        if(!session->shared_slot) fprintf(stderr, "Shared session table is full, session not shared\n");
+    }
+
+    // insert the new session in the session table and arm its expiry
+    // timer, which must be done before the client knows the session ID
+    ret = session_table_insert(&server->sessions, session);
+    if(ret != 0) {
+        if(session->store_slot) session_store_erase(&server->store, session->store_slot);
+        if(session->shared_slot)
+            shared_table_remove(&server->shared, session->shared_slot, session->session_id);
+    }
+    ASSERT(ret == 0, "Could not insert session in the session table\n");
 
-    // insert the new session in the sessions hash
-    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&server->sessions_mtx));
-    HASH_ADD(hh, server->sessions, session_id, sizeof(session->session_id), session);
-    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&server->sessions_mtx));
+    // count the session against the limits, evicting the least recently
+    // used session of its uid or of the table if it exceeds one; if it
+    // can't be counted, it has been removed from the table
+    session_id_t session_id  = session->session_id;
+    uint32_t     shared_slot = session->shared_slot;
+    ret     = admit_session(server, session);
     session = NULL;
+    if(ret != 0 && shared_slot) shared_table_remove(&server->shared, shared_slot, session_id);
+    ASSERT(ret == 0, "Could not count session against the limits\n");
 
 finish:
-    free(session);
+    if(session) session_destroy(session);
     free(payload);
     out.ret = ret;
     margo_respond(handle, &out);
     margo_free_input(handle, &in);
     margo_destroy(handle);
+    auth_pool_release(&server->auth_pool, started);
 }
-DEFINE_MARGO_RPC_HANDLER(authenticate)
 
 void hello(hg_handle_t handle)
 {
@@ -168,45 +943,89 @@ void hello(hg_handle_t handle)
     hello_out_t  out     = {0};
     hg_return_t  hret    = HG_SUCCESS;
     int          ret     = 0;
+    int          evicted = 0;
     session_t*   session = NULL;
 
     margo_instance_id     mid  = margo_hg_handle_get_instance(handle);
     const struct hg_info* info = margo_get_info(handle);
     server_t* server           = margo_registered_data(mid, info->id);
 
-    // get the input of the RPC
+    // get the input of the RPC, which may be sealed with the session's key
+    in.token.aead_lookup     = lookup_session_aead;
+    in.token.aead_lookup_arg = server;
     hret = margo_get_input(handle, &in);
     ASSERT(hret == HG_SUCCESS, "Could not deserialize input arguments\n");
+    if(in.token.sealed && in.token.aead.alg == AEAD_NONE) {
+        ret = unopened_args_error(server, &in.token);
+        goto finish;
+    }
 
-    // find the corresponding session
-    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&server->sessions_mtx));
-    HASH_FIND(hh, server->sessions, &in.token.session_id, sizeof(in.token.session_id), session);
-    if(session) ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&session->mtx));
-    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&server->sessions_mtx));
+    // in ticket mode, tokens carry their session in a ticket
+    if(in.token.ticket.len && server->use_tickets) {
+        uid_t uid;
+        ret = check_ticket_token(server, &in.token, &uid, 0);
+        if(ret == 0)
+            printf("Hello %s (username %s)\n", in.name, user_name(uid));
+        else
+            printf("Unauthorized attempt to call the hello RPC\n");
+        goto finish;
+    }
 
-    // check validity of the session
+    // find the corresponding session, which can't be freed until we release it
+    session = find_token_session(server, &in.token, &evicted);
+    if(!session && evicted) {
+        fprintf(stderr, "Session was evicted\n");
+        ret = RPC_ERR_SESSION_EVICTED;
+        goto finish;
+    }
     ASSERT(session != NULL, "Could not find session\n");
-    ASSERT(in.token.seq_no == session->seq_no,
-           "Unexpected sequence number for session\n");
 
-    // TODO if there is a ULT that clears the sessions periodically,
-    // we should make sure it doesn't remove a session that's in use here
+    // check validity of the session, rejecting replayed tokens before
+    // computing their MAC
+    ASSERT(!atomic_load(&session->closed), "Session is being closed or has expired\n");
+    ASSERT(replay_window_check(&session->replay, server->replay_words,
+                               &session->seq_no, in.token.seq_no) == 0,
+           "Sequence number already used or outside the replay window\n");
+    ASSERT(in.token.sealed == session->sealed,
+           "RPC not sealed as agreed for session\n");
 
-    // check the token sent by the client against the session
-    ret = check_token(&in.token, in.token.session_id, in.token.seq_no,
-                      (const char*)session->key, sizeof(session->key));
+    // check the token sent by the client against the session, without
+    // any lock, then claim its sequence number, which only one RPC can do
+    ret = verifier_check(&server->verifier, &in.token,
+                         in.token.session_id, in.token.seq_no, &session->mac);
+    if(ret == 0 && replay_window_claim(&session->replay, server->replay_words,
+                                       &session->seq_no, in.token.seq_no) != 0) {
+        fprintf(stderr, "Sequence number claimed by a concurrent RPC\n");
+        ret = -1;
+    }
 
     if(ret == 0) {
-        session->last_used = ABT_get_wtime();
-        session->seq_no += 1;
-        printf("Hello %s (username %s)\n", in.name, getpwuid(session->uid)->pw_name);
+        double now = ABT_get_wtime();
+        session->last_used = now;
+        session_store_touch(&server->store, session->store_slot, in.token.seq_no + 1,
+                            now + server->wall_offset);
+        if(session->shared_slot)
+            shared_table_touch(&server->shared, session->shared_slot,
+                               session->session_id, in.token.seq_no + 1);
+        printf("Hello %s (username %s)\n", in.name, user_name(session->uid));
+        // seal the response, a verified sequence number is only ever
+        // claimed once so it can serve as the nonce counter
+        if(in.token.sealed) {
+            out.sealing = (sealing_t){
+                .aead       = &in.token.aead,
+                .direction  = AEAD_DIRECTION_RESPONSE,
+                .counter    = in.token.seq_no,
+                .session_id = in.token.session_id,
+                .seq_no     = in.token.seq_no
+            };
+        }
     } else {
         printf("Unauthorized attempt to call the hello RPC\n");
     }
 
 finish:
     // cleanup
-    if(session) ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&session->mtx));
+    if(session) session_release(session);
     out.ret = ret;
     margo_respond(handle, &out);
     margo_free_input(handle, &in);
@@ -220,50 +1039,97 @@ void close_session(hg_handle_t handle)
     close_out_t  out     = {0};
     hg_return_t  hret    = HG_SUCCESS;
     int          ret     = 0;
+    int          evicted = 0;
     session_t*   session = NULL;
 
     margo_instance_id     mid  = margo_hg_handle_get_instance(handle);
     const struct hg_info* info = margo_get_info(handle);
     server_t* server           = margo_registered_data(mid, info->id);
 
-    // get the input of the RPC
+    // get the input of the RPC, which may be sealed with the session's key
+    in.token.aead_lookup     = lookup_session_aead;
+    in.token.aead_lookup_arg = server;
     hret = margo_get_input(handle, &in);
     ASSERT(hret == HG_SUCCESS, "Could not deserialize input arguments\n");
+    if(in.token.sealed && in.token.aead.alg == AEAD_NONE) {
+        ret = unopened_args_error(server, &in.token);
+        goto finish;
+    }
 
-    // find the corresponding session
-    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&server->sessions_mtx));
-    HASH_FIND(hh, server->sessions, &in.token.session_id, sizeof(in.token.session_id), session);
+    // closing a ticket's session frees its slot
+    if(in.token.ticket.len && server->use_tickets) {
+        uid_t uid;
+        ret = check_ticket_token(server, &in.token, &uid, 1);
+        if(ret == 0)
+            printf("Successfully revoked ticket\n");
+        else
+            fprintf(stderr, "Unauthorized attempt to call the close RPC\n");
+        goto finish;
+    }
+
+    // find the corresponding session, which can't be freed until we release it
+    session = find_token_session(server, &in.token, &evicted);
+    if(!session && evicted) {
+        fprintf(stderr, "Session was evicted\n");
+        ret = RPC_ERR_SESSION_EVICTED;
+        goto finish;
+    }
     if(!session) {
         fprintf(stderr, "Could not find session\n");
         ret = -1;
-        goto unlock;
+        goto finish;
     }
 
     // check validity of the session
-    if(in.token.seq_no != session->seq_no) {
-        fprintf(stderr, "Unexpected sequence number for session\n");
+    if(atomic_load(&session->closed)) {
+        fprintf(stderr, "Session is already being closed or has expired\n");
         ret = -1;
-        goto unlock;
+        goto finish;
+    }
+    if(replay_window_check(&session->replay, server->replay_words,
+                           &session->seq_no, in.token.seq_no) != 0) {
+        fprintf(stderr, "Sequence number already used or outside the replay window\n");
+        ret = -1;
+        goto finish;
+    }
+    if(in.token.sealed != session->sealed) {
+        fprintf(stderr, "RPC not sealed as agreed for session\n");
+        ret = -1;
+        goto finish;
     }
 
-    // check the token sent by the client against the session
-    ret = check_token(&in.token, in.token.session_id, in.token.seq_no,
-                      (const char*)session->key, sizeof(session->key));
+    // check the token sent by the client against the session, then claim
+    // its sequence number and the closing of the session
+    ret = check_token(&in.token, in.token.session_id, in.token.seq_no, &session->mac);
     if(ret != 0) {
         fprintf(stderr, "Unauthorized attempt to call the close RPC\n");
-        goto unlock;
+        goto finish;
+    }
+    if(replay_window_claim(&session->replay, server->replay_words,
+                           &session->seq_no, in.token.seq_no) != 0) {
+        fprintf(stderr, "Sequence number claimed by a concurrent RPC\n");
+        ret = -1;
+        goto finish;
+    }
+    if(!session_mark_closed(session)) {
+        fprintf(stderr, "Session is already being closed or has expired\n");
+        ret = -1;
+        goto finish;
     }
 
-    // remove the session from the hash
-    HASH_DELETE(hh, server->sessions, session);
-    free(session);
-    printf("Successfully removed session\n");
+    // close the session on the other servers of the node too
+    if(session->shared_slot)
+        shared_table_remove(&server->shared, session->shared_slot, session->session_id);
 
-unlock:
-    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&server->sessions_mtx));
+    // remove the session from the table, it is destroyed when the
+    // last handler using it releases it
+    session_expiry_cancel(&server->expiry, session);
+    session_table_remove(&server->sessions, session);
+    printf("Successfully removed session\n");
 
 finish:
     // cleanup
+    if(session) session_release(session);
     out.ret = ret;
     margo_respond(handle, &out);
     margo_free_input(handle, &in);
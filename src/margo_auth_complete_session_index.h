@@ -0,0 +1,133 @@
+#ifndef MARGO_AUTH_COMPLETE_SESSION_INDEX_H
+#define MARGO_AUTH_COMPLETE_SESSION_INDEX_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "margo_auth_complete_types.h"
+
+/* Open-addressing hash index from session IDs to sessions. Each slot
+ * holds the 8-byte session ID inline next to the pointer to its session,
+ * four slots to a cache line, so a lookup compares IDs in one or two
+ * contiguous cache lines and dereferences only the session it found,
+ * instead of following uthash's bucket chains through the sessions
+ * themselves. Collisions are resolved by linear probing, the index
+ * doubles when it is half full, and removals shift the following slots
+ * back instead of leaving tombstones, so probe sequences stay short
+ * under churn.
+ *
+ * Session IDs are random and 0 is never a valid one, so an ID of 0 marks
+ * an empty slot. The index does no locking of its own. */
+
+#define SESSION_INDEX_ALIGNMENT        64
+#define SESSION_INDEX_INITIAL_CAPACITY 16
+
+typedef struct {
+    session_id_t session_id; /* 0 if the slot is empty */
+    void*        session;
+} session_slot_t;
+
+typedef struct {
+    session_slot_t* slots;
+    size_t          capacity; /* power of 2 */
+    size_t          count;
+} session_index_t;
+
+static inline size_t session_index_hash(session_id_t session_id)
+{
+    // the low bits of the ID select the shard, so mix in the high bits
+    return (size_t)((session_id * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline session_slot_t* session_index_alloc_slots(size_t capacity)
+{
+    session_slot_t* slots = (session_slot_t*)aligned_alloc(
+        SESSION_INDEX_ALIGNMENT, capacity * sizeof(session_slot_t));
+    if(slots) memset(slots, 0, capacity * sizeof(session_slot_t));
+    return slots;
+}
+
+static inline int session_index_init(session_index_t* index)
+{
+    index->slots    = session_index_alloc_slots(SESSION_INDEX_INITIAL_CAPACITY);
+    index->capacity = SESSION_INDEX_INITIAL_CAPACITY;
+    index->count    = 0;
+    return index->slots ? 0 : -1;
+}
+
+static inline void session_index_finalize(session_index_t* index)
+{
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+static inline void* session_index_find(const session_index_t* index, session_id_t session_id)
+{
+    size_t mask = index->capacity - 1;
+    for(size_t i = session_index_hash(session_id) & mask;; i = (i + 1) & mask) {
+        const session_slot_t* slot = &index->slots[i];
+        if(slot->session_id == session_id) return slot->session;
+        if(slot->session_id == 0) return NULL;
+    }
+}
+
+/* Puts a session in the first empty slot of its probe sequence. */
+static inline void session_index_place(session_slot_t* slots, size_t capacity,
+                                       session_id_t session_id, void* session)
+{
+    size_t mask = capacity - 1;
+    size_t i    = session_index_hash(session_id) & mask;
+    while(slots[i].session_id != 0) i = (i + 1) & mask;
+    slots[i].session_id = session_id;
+    slots[i].session    = session;
+}
+
+/* Adds a session, whose ID must not be in the index already. Returns -1
+ * if the index could not grow. */
+static inline int session_index_insert(session_index_t* index, session_id_t session_id, void* session)
+{
+    if(2 * (index->count + 1) > index->capacity) {
+        size_t          capacity = 2 * index->capacity;
+        session_slot_t* slots    = session_index_alloc_slots(capacity);
+        if(!slots) return -1;
+        for(size_t i = 0; i < index->capacity; ++i) {
+            if(index->slots[i].session_id == 0) continue;
+            session_index_place(slots, capacity, index->slots[i].session_id, index->slots[i].session);
+        }
+        free(index->slots);
+        index->slots    = slots;
+        index->capacity = capacity;
+    }
+    session_index_place(index->slots, index->capacity, session_id, session);
+    index->count += 1;
+    return 0;
+}
+
+/* Removes a session from the index, returning it, or NULL if it was not
+ * there. */
+static inline void* session_index_remove(session_index_t* index, session_id_t session_id)
+{
+    size_t mask = index->capacity - 1;
+    size_t i    = session_index_hash(session_id) & mask;
+    while(index->slots[i].session_id != session_id) {
+        if(index->slots[i].session_id == 0) return NULL;
+        i = (i + 1) & mask;
+    }
+    void* session = index->slots[i].session;
+
+    // shift back the following slots that would no longer be reachable
+    // from their home slot through the hole
+    for(size_t j = (i + 1) & mask; index->slots[j].session_id != 0; j = (j + 1) & mask) {
+        size_t home = session_index_hash(index->slots[j].session_id) & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+    index->slots[i].session_id = 0;
+    index->slots[i].session    = NULL;
+    index->count -= 1;
+    return session;
+}
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef MARGO_AUTH_COMPLETE_SESSIONS_H
+#define MARGO_AUTH_COMPLETE_SESSIONS_H
+
+#include <margo.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "margo_auth_complete_types.h"
+#include "margo_auth_complete_timer_wheel.h"
+#include "margo_auth_complete_slab.h"
+#include "margo_auth_complete_session_index.h"
+#include "margo_auth_complete_quota.h"
+#include "margo_auth_complete_store.h"
+#include "margo_auth_complete_shared.h"
+#include "margo_auth_complete_replay.h"
+
+/* The sessions of the server are spread over a number of shards, each
+ * with its own index (see margo_auth_complete_session_index.h) and its
+ * own reader-writer lock, the shard of a session being given by the low
+ * bits of its (random) session ID. Lookups only take the read lock of
+ * one shard, so they never block
+ * each other, and insertions and removals only block the lookups of the
+ * sessions in the same shard. Shards are aligned on cache lines so that
+ * handlers working on different shards don't share any.
+ *
+ * Sessions are reference-counted. The table holds one reference, and
+ * session_table_find takes another one under the shard's read lock, which
+ * the handler drops with session_release when it is done, so a handler
+ * only holds the shard lock for the duration of the hash lookup. Removing
+ * a session from the table (when it is closed or expires) drops the
+ * table's reference, and the session is destroyed when the last handler
+ * that found it releases it, never while a handler can still see it.
+ *
+ * Sessions have no lock. A handler checks the token's MAC first, then
+ * claims its sequence number with a compare-and-swap on the replay window
+ * (see margo_auth_complete_replay.h), and stores last_used atomically, so
+ * a handler busy with one session never blocks another handler of the
+ * same session. Closing a session happens in two steps: the session is
+ * marked as closed with an atomic exchange (session_mark_closed), so that
+ * no other RPC, the expiry ULT or the quota can close it too, then it is
+ * removed from the table.
+ *
+ * Sessions are allocated from a slab owned by the table (see
+ * margo_auth_complete_slab.h) with session_alloc, and given back to it
+ * by session_destroy, which zeroes them.
+ *
+ * The fields of a session_t are ordered by how often they are used. The
+ * first cache line holds everything a hello RPC reads or writes besides
+ * the replay window (reference count, closed flag, sequence number,
+ * last_used, the pre-keyed MAC state...), the replay window comes next,
+ * RPCs only touching its words around the current sequence number, and the
+ * fields only used when the session is opened, sealed RPCs are decoded,
+ * or the session expires come after.
+ *
+ * The number of sessions can be limited globally and per uid (see
+ * margo_auth_complete_quota.h), in which case opening a session over a
+ * limit evicts the least recently used session of the table or of the
+ * uid.
+ *
+ * If the table has a session store (see margo_auth_complete_store.h),
+ * a session removed from the table also has its record erased, while
+ * session_table_finalize leaves the records of the remaining sessions
+ * for the next run of the server. Likewise, if the table shares its
+ * sessions with the other servers of the node (see
+ * margo_auth_complete_shared.h), a removed session that has been idle
+ * on all of them is removed from the shared table. Both are done when
+ * the last reference to the session is dropped, since the handlers
+ * still using it record their progress in its record and shared slot,
+ * which must not be given to another session before they are done. */
+
+#define SESSION_TABLE_DEFAULT_SHARDS 64
+#define SESSION_TABLE_ALIGNMENT      64
+
+typedef struct session_t {
+    /* hot: used by every RPC */
+    _Alignas(SESSION_TABLE_ALIGNMENT)
+    _Atomic uint32_t refcount;  /* one for the table, one per handler using it */
+    _Atomic int      closed;    /* set when the session is being closed or has expired */
+    _Atomic uint64_t seq_no;    /* highest sequence number accepted + 1 */
+    _Atomic double   last_used;
+    mac_t            mac;       /* MAC state pre-keyed with key */
+    session_id_t     session_id;
+    uid_t            uid;
+    uint8_t          sealed;    /* 1 if the RPCs of the session are sealed */
+    _Alignas(SESSION_TABLE_ALIGNMENT)
+    replay_window_t  replay;    /* sequence numbers accepted below seq_no */
+    /* cold */
+    _Alignas(SESSION_TABLE_ALIGNMENT)
+    aead_t           aead;      /* AEAD state if the client asked for sealed RPCs */
+    unsigned char    key[32];
+    mac_alg_t        mac_alg;   /* MAC algorithm proposed by the client */
+    double           created;
+    timer_node_t     timer;     /* expiry timer, see margo_auth_complete_expiry.h */
+    session_link_t   lru;       /* quota's LRU lists, see margo_auth_complete_quota.h */
+    session_link_t   user_lru;
+    double           lru_stamp; /* last_used when moved to the front of lru */
+    double           user_lru_stamp;
+    session_user_t*  user;      /* NULL if not counted against the limits */
+    uint32_t         store_slot; /* record in the session store, 0 if none */
+    uint32_t         shared_slot; /* slot in the shared session table, 0 if none */
+    struct session_table_t* removed_from; /* set by session_table_remove */
+} session_t;
+
+_Static_assert(offsetof(session_t, replay) == SESSION_TABLE_ALIGNMENT,
+               "the hot fields of session_t must fit in one cache line");
+
+typedef struct {
+    _Alignas(SESSION_TABLE_ALIGNMENT) ABT_rwlock lock;
+    session_index_t sessions;
+} session_shard_t;
+
+typedef struct session_table_t {
+    size_t           num_shards; /* power of 2 */
+    session_shard_t* shards;
+    slab_t           slab;       /* memory of the sessions */
+    session_quota_t  quota;      /* limits on the number of sessions */
+    session_store_t* store;      /* persistent copy of the sessions, or NULL */
+    shared_table_t*  shared;     /* sessions of all the servers of the node, or NULL */
+} session_table_t;
+
+/* Returns a zeroed session, or NULL. */
+static inline session_t* session_alloc(session_table_t* table)
+{
+    return (session_t*)slab_alloc(&table->slab);
+}
+
+/* Marks a session as closed. Returns 1 if the caller is the one closing
+ * it, and should remove it from the table, 0 if it was already closed. */
+static inline int session_mark_closed(session_t* session)
+{
+    return atomic_exchange(&session->closed, 1) == 0;
+}
+
+static inline void session_destroy(session_t* session)
+{
+    mac_destroy(&session->mac);
+    aead_destroy(&session->aead);
+    slab_free(session); // also zeroes the key
+}
+
+/* Initializes a table with num_shards shards (rounded up to a power of
+ * 2), backing its sessions with huge pages if huge_pages is set. */
+static inline int session_table_init(session_table_t* table, size_t num_shards, int huge_pages)
+{
+    size_t n = 1;
+    while(n < num_shards) n <<= 1;
+    if(slab_init(&table->slab, sizeof(session_t), huge_pages) != 0) return -1;
+    table->shards = (session_shard_t*)aligned_alloc(SESSION_TABLE_ALIGNMENT, n * sizeof(*table->shards));
+    if(!table->shards) {
+        slab_finalize(&table->slab);
+        return -1;
+    }
+    memset(table->shards, 0, n * sizeof(*table->shards));
+    table->num_shards = n;
+    table->store      = NULL;
+    table->shared     = NULL;
+    for(size_t i = 0; i < n; ++i) {
+        if(session_index_init(&table->shards[i].sessions) != 0
+        || ABT_rwlock_create(&table->shards[i].lock) != ABT_SUCCESS) {
+            session_index_finalize(&table->shards[i].sessions);
+            while(i--) {
+                ABT_rwlock_free(&table->shards[i].lock);
+                session_index_finalize(&table->shards[i].sessions);
+            }
+            free(table->shards);
+            table->shards = NULL;
+            slab_finalize(&table->slab);
+            return -1;
+        }
+    }
+    session_quota_init(&table->quota, 0, 0);
+    return 0;
+}
+
+/* Limits the number of sessions in the table, and per uid (0 for no
+ * limit). Must be called before any session is inserted. */
+static inline int session_table_set_limits(session_table_t* table, size_t max_sessions, size_t max_per_uid)
+{
+    session_quota_finalize(&table->quota);
+    return session_quota_init(&table->quota, max_sessions, max_per_uid);
+}
+
+/* Destroys all the sessions left in the table. Should only be called
+ * once no handler can be using it anymore. */
+static inline void session_table_finalize(session_table_t* table)
+{
+    if(!table->shards) return;
+    for(size_t i = 0; i < table->num_shards; ++i) {
+        session_index_t* index = &table->shards[i].sessions;
+        for(size_t j = 0; j < index->capacity; ++j) {
+            if(index->slots[j].session_id != 0)
+                session_destroy((session_t*)index->slots[j].session);
+        }
+        session_index_finalize(index);
+        ABT_rwlock_free(&table->shards[i].lock);
+    }
+    free(table->shards);
+    table->shards = NULL;
+    slab_finalize(&table->slab);
+    session_quota_finalize(&table->quota);
+}
+
+static inline session_shard_t* session_table_shard(const session_table_t* table, session_id_t session_id)
+{
+    return &table->shards[session_id & (table->num_shards - 1)];
+}
+
+/* Drops a reference to a session, destroying it if it was the last one,
+ * along with its record and shared slot if it was removed from its
+ * table. */
+static inline void session_release(session_t* session)
+{
+    if(atomic_fetch_sub_explicit(&session->refcount, 1, memory_order_acq_rel) != 1) return;
+    session_table_t* table = session->removed_from;
+    if(table && table->store) session_store_erase(table->store, session->store_slot);
+    if(table && table->shared && session->shared_slot)
+        shared_table_expire(table->shared, session->shared_slot, session->session_id);
+    session_destroy(session);
+}
+
+/* Adds a session to the table, which takes a reference to it. Returns -1
+ * if the shard's index could not grow, in which case the session still
+ * belongs to the caller. */
+static inline int session_table_insert(session_table_t* table, session_t* session)
+{
+    session_shard_t* shard = session_table_shard(table, session->session_id);
+    atomic_store(&session->refcount, 1);
+    ABT_rwlock_wrlock(shard->lock);
+    int ret = session_index_insert(&shard->sessions, session->session_id, session);
+    ABT_rwlock_unlock(shard->lock);
+    return ret;
+}
+
+/* Adds a session unless the table already has one with the same ID, as
+ * happens when two handlers import the same shared session. Returns the
+ * session in the table with a reference for the caller, which is either
+ * this session or the one already there (then this one still belongs to
+ * the caller), or NULL if the shard's index could not grow. */
+static inline session_t* session_table_insert_or_find(session_table_t* table, session_t* session)
+{
+    session_shard_t* shard = session_table_shard(table, session->session_id);
+    atomic_store(&session->refcount, 2);
+    ABT_rwlock_wrlock(shard->lock);
+    session_t* found = (session_t*)session_index_find(&shard->sessions, session->session_id);
+    if(found)
+        atomic_fetch_add_explicit(&found->refcount, 1, memory_order_relaxed);
+    else if(session_index_insert(&shard->sessions, session->session_id, session) == 0)
+        found = session;
+    ABT_rwlock_unlock(shard->lock);
+    return found;
+}
+
+/* Returns the session with this ID, with a reference that the caller
+ * must drop with session_release, or NULL. */
+static inline session_t* session_table_find(session_table_t* table, session_id_t session_id)
+{
+    session_shard_t* shard = session_table_shard(table, session_id);
+    ABT_rwlock_rdlock(shard->lock);
+    session_t* session = (session_t*)session_index_find(&shard->sessions, session_id);
+    if(session) atomic_fetch_add_explicit(&session->refcount, 1, memory_order_relaxed);
+    ABT_rwlock_unlock(shard->lock);
+    return session;
+}
+
+/* Stops counting a session against the limits. Must be called with the
+ * quota's mutex held. */
+static inline void session_quota_detach(session_quota_t* quota, session_t* session)
+{
+    if(!session->user) return;
+    session_list_unlink(&session->lru);
+    session_list_unlink(&session->user_lru);
+    quota->count        -= 1;
+    session->user->count -= 1;
+    session_quota_put_user(quota, session->user);
+    session->user = NULL;
+}
+
+/* Evicts the least recently used sessions of a list (the global one, or
+ * the one of a uid if per_user is set) until *count is at most max, not
+ * going past the session except. Sessions used since they were stamped
+ * go back to the front of the list, and sessions already being closed
+ * are only detached. Evicted sessions are marked as closed, detached and
+ * returned in victims. Must be called with the quota's mutex held. */
+static inline int session_quota_evict(session_quota_t* quota, session_link_t* head, int per_user,
+                                      size_t* count, size_t max, const session_t* except,
+                                      session_t** victims, int max_victims)
+{
+    size_t offset = per_user ? offsetof(session_t, user_lru) : offsetof(session_t, lru);
+    int    n      = 0;
+    while(*count > max && n < max_victims && head->prev != head) {
+        session_link_t* link    = head->prev;
+        session_t*      session = (session_t*)((char*)link - offset);
+        double*         stamp   = per_user ? &session->user_lru_stamp : &session->lru_stamp;
+        if(session == except) break;
+
+        double last_used = session->last_used;
+        if(!atomic_load(&session->closed) && last_used > *stamp) {
+            // used since it was stamped, give it a second chance
+            *stamp = last_used;
+            session_list_unlink(link);
+            session_list_push_front(head, link);
+            continue;
+        }
+        if(!session_mark_closed(session)) {
+            // being closed or expiring, it no longer counts
+            session_quota_detach(quota, session);
+            continue;
+        }
+        session_quota_detach(quota, session);
+        session_quota_remember_evicted(quota, session->session_id);
+        victims[n++] = session;
+    }
+    return n;
+}
+
+/* Counts a new session against the limits, once it is inserted: the
+ * LRU lists then only hold sessions of the index, so an evicted session
+ * can always be removed from it. If this puts its uid or the table over
+ * a limit, the least recently used session of the uid or of the table is
+ * evicted: it is marked as closed and returned in victims, and the
+ * caller must then remove it from the table (after cancelling its expiry
+ * timer) as for a closed session. A session closed since it was inserted
+ * is not counted, session_table_remove having already forgotten it.
+ * Returns the number of victims (at most 2), or -1 on error. */
+static inline int session_table_admit(session_table_t* table, session_t* session, session_t* victims[2])
+{
+    session_quota_t* quota = &table->quota;
+    int              n     = 0;
+    if(!session_quota_enabled(quota)) return 0;
+
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+    if(atomic_load(&session->closed)) {
+        ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+        return 0;
+    }
+    session_user_t* user = session_quota_user(quota, session->uid);
+    if(!user) {
+        ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+        return -1;
+    }
+    session->user           = user;
+    session->lru_stamp      = session->last_used;
+    session->user_lru_stamp = session->last_used;
+    session_list_push_front(&quota->lru, &session->lru);
+    session_list_push_front(&user->lru, &session->user_lru);
+    quota->count += 1;
+    user->count  += 1;
+
+    if(quota->max_per_uid)
+        n += session_quota_evict(quota, &user->lru, 1, &user->count, quota->max_per_uid,
+                                 session, victims + n, 2 - n);
+    if(quota->max_sessions)
+        n += session_quota_evict(quota, &quota->lru, 0, &quota->count, quota->max_sessions,
+                                 session, victims + n, 2 - n);
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+    return n;
+}
+
+/* Stops counting a session against the limits. Done by
+ * session_table_remove. */
+static inline void session_table_forget(session_table_t* table, session_t* session)
+{
+    session_quota_t* quota = &table->quota;
+    if(!session_quota_enabled(quota)) return;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+    session_quota_detach(quota, session);
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&quota->mtx));
+}
+
+/* Returns 1 if the session with this ID was evicted to make room for
+ * other sessions. */
+static inline int session_table_evicted(session_table_t* table, session_id_t session_id)
+{
+    return session_quota_was_evicted(&table->quota, session_id);
+}
+
+/* Removes a session that has been marked as closed from the table and
+ * drops the table's reference to it, destroying it unless a handler
+ * still holds a reference. */
+static inline void session_table_remove(session_table_t* table, session_t* session)
+{
+    session_shard_t* shard = session_table_shard(table, session->session_id);
+    ABT_rwlock_wrlock(shard->lock);
+    session_index_remove(&shard->sessions, session->session_id);
+    ABT_rwlock_unlock(shard->lock);
+    session_table_forget(table, session);
+    session->removed_from = table;
+    session_release(session);
+}
+
+#endif
@@ -0,0 +1,411 @@
+#ifndef MARGO_AUTH_COMPLETE_SHARED_H
+#define MARGO_AUTH_COMPLETE_SHARED_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "margo_auth_complete_types.h"
+
+/* Node-wide session table in POSIX shared memory, so that a client that
+ * authenticated with one server process can use its session with the
+ * other server processes of the node without another munge round-trip.
+ *
+ * The server that authenticates a client publishes the session (uid,
+ * key, MAC and AEAD parameters) in a slot of the shared table. Another
+ * server receiving an RPC for a session it doesn't know looks it up in
+ * the shared table and imports it in its own session table; its key is
+ * then derived from the session key and the server's address (see
+ * session_key_for_server), so tokens sent to a server can't be replayed
+ * on another one, and each server keeps its own sequence numbers.
+ *
+ * Slots are found by open addressing on the session ID and protected by
+ * a seqlock: a writer makes the slot's version odd with a CAS, writes,
+ * and makes it even again, and readers retry if the version was odd or
+ * changed while they copied the slot, so lookups never block writers.
+ * Removed slots become tombstones, reused by later insertions. Each
+ * server writes the next sequence number it expects for a session in
+ * the slot's entry for its rank, which only it writes (a CAS per RPC,
+ * once it has checked that the slot still holds the session), so that
+ * it can resume after a restart with the same address instead of
+ * accepting old tokens again.
+ *
+ * Servers register in the header, where their rank is kept along with
+ * their address. A server restarting with the same address gets its rank
+ * back; a new address takes the rank of a dead server and bumps its
+ * epoch, which invalidates the sequence numbers recorded for that rank.
+ *
+ * A session is removed from the shared table when it is closed on any
+ * server, or when it expires on a server after having been idle on all
+ * of them. Times are CLOCK_MONOTONIC nanoseconds, the same for all the
+ * processes of the node. The segment is created with mode 0600, so only
+ * processes running as the server's user can map it. */
+
+#define SHARED_TABLE_MAGIC            0x3148535f4d41ULL /* "AM_SH1" */
+#define SHARED_TABLE_VERSION          1
+#define SHARED_TABLE_MAX_SERVERS      16
+#define SHARED_TABLE_DEFAULT_CAPACITY 65536
+#define SHARED_SESSION_EMPTY          0 /* session IDs 0 and 1 are never used */
+#define SHARED_SESSION_DELETED        1
+#define SHARED_SEQ_BITS               48
+
+typedef struct {
+    char     address[256];
+    pid_t    pid;   /* 0 if no server has this rank */
+    uint32_t epoch; /* incremented when the rank changes address */
+} shared_server_t;
+
+typedef struct {
+    _Alignas(64)
+    _Atomic uint64_t magic;       /* written last by the creator */
+    uint32_t         version;
+    uint32_t         slot_size;
+    uint64_t         capacity;    /* power of 2 */
+    _Atomic uint32_t lock;        /* protects servers */
+    shared_server_t  servers[SHARED_TABLE_MAX_SERVERS];
+} shared_header_t;
+
+typedef struct {
+    _Alignas(64)
+    _Atomic uint64_t version;     /* seqlock, odd while the slot is written */
+    _Atomic uint64_t session_id;  /* SHARED_SESSION_EMPTY or _DELETED if free */
+    _Atomic uint64_t last_used;   /* by any server */
+    uint64_t         created;
+    uint32_t         uid;
+    uint8_t          mac_alg;
+    uint8_t          tag_len;
+    uint8_t          aead_alg;
+    uint8_t          origin;       /* rank of the server that opened the session */
+    uint32_t         origin_epoch;
+    unsigned char    key[32];
+    /* next sequence number expected by each rank, with the rank's epoch
+     * in the high bits */
+    _Alignas(64) _Atomic uint64_t seq_no[SHARED_TABLE_MAX_SERVERS];
+} shared_slot_t;
+
+/* Copy of a slot. */
+typedef struct {
+    session_id_t  session_id;
+    uid_t         uid;
+    uint8_t       mac_alg;
+    uint8_t       tag_len;
+    uint8_t       aead_alg;
+    int           is_origin; /* 1 if the session was opened with this server */
+    double        age;       /* seconds since the session was opened */
+    uint64_t      seq_no;    /* next sequence number expected by this server */
+    unsigned char key[32];
+} shared_entry_t;
+
+typedef struct {
+    shared_header_t* header;
+    shared_slot_t*   slots;
+    size_t           capacity;
+    size_t           map_size;
+    int              rank;
+    uint32_t         epoch;
+    uint64_t         idle_timeout; /* ns, 0 if sessions don't expire */
+} shared_table_t;
+
+static inline int shared_table_enabled(const shared_table_t* shared)
+{
+    return shared->slots != NULL;
+}
+
+static inline uint64_t shared_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline size_t shared_table_hash(session_id_t session_id)
+{
+    return (size_t)((session_id * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline void shared_lock_header(shared_header_t* header)
+{
+    uint32_t expected = 0;
+    while(!atomic_compare_exchange_weak(&header->lock, &expected, 1)) expected = 0;
+}
+
+static inline void shared_unlock_header(shared_header_t* header)
+{
+    atomic_store(&header->lock, 0);
+}
+
+/* Takes the rank registered with this address, or the rank of a server
+ * that is gone. Returns -1 if all the ranks are taken. */
+static inline int shared_table_register(shared_table_t* shared, const char* address)
+{
+    shared_header_t* header = shared->header;
+    int              rank   = -1;
+    shared_lock_header(header);
+    for(int r = 0; r < SHARED_TABLE_MAX_SERVERS && rank < 0; ++r) {
+        if(strncmp(header->servers[r].address, address, sizeof(header->servers[r].address)) == 0)
+            rank = r;
+    }
+    for(int r = 0; r < SHARED_TABLE_MAX_SERVERS && rank < 0; ++r) {
+        pid_t pid = header->servers[r].pid;
+        if(pid == 0 || (kill(pid, 0) != 0 && errno == ESRCH)) {
+            rank = r;
+            header->servers[r].epoch += 1;
+            strncpy(header->servers[r].address, address, sizeof(header->servers[r].address) - 1);
+        }
+    }
+    if(rank >= 0) {
+        header->servers[rank].pid = getpid();
+        shared->rank  = rank;
+        shared->epoch = header->servers[rank].epoch;
+    }
+    shared_unlock_header(header);
+    return rank < 0 ? -1 : 0;
+}
+
+/* Maps the shared table with the given name, creating it if this is the
+ * first server of the node, and registers this server's address. The
+ * capacity is only used when creating the table. */
+static inline int shared_table_open(shared_table_t* shared, const char* name, size_t capacity,
+                                    const char* address, double idle_timeout)
+{
+    memset(shared, 0, sizeof(*shared));
+    size_t n = 1;
+    while(n < capacity) n <<= 1;
+
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(created) {
+        st.st_size = sizeof(shared_header_t) + n * sizeof(shared_slot_t);
+        if(ftruncate(fd, st.st_size) != 0) goto error;
+    } else {
+        // wait for the creator to size the segment
+        for(int i = 0; i < 1000; ++i) {
+            if(fstat(fd, &st) != 0) goto error;
+            if(st.st_size != 0) break;
+            usleep(1000);
+        }
+        if((size_t)st.st_size < sizeof(shared_header_t)) goto error;
+    }
+    shared->map_size = st.st_size;
+    void* map = mmap(NULL, shared->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) goto error;
+    close(fd);
+    fd = -1;
+    shared->header = (shared_header_t*)map;
+
+    if(created) {
+        shared->header->version   = SHARED_TABLE_VERSION;
+        shared->header->slot_size = sizeof(shared_slot_t);
+        shared->header->capacity  = n;
+        atomic_store(&shared->header->magic, SHARED_TABLE_MAGIC);
+    } else {
+        for(int i = 0; i < 1000 && atomic_load(&shared->header->magic) != SHARED_TABLE_MAGIC; ++i)
+            usleep(1000);
+    }
+    if(atomic_load(&shared->header->magic) != SHARED_TABLE_MAGIC
+    || shared->header->version != SHARED_TABLE_VERSION
+    || shared->header->slot_size != sizeof(shared_slot_t)
+    || shared->map_size < sizeof(shared_header_t) + shared->header->capacity * sizeof(shared_slot_t))
+        goto error;
+    shared->capacity     = shared->header->capacity;
+    shared->slots        = (shared_slot_t*)(shared->header + 1);
+    shared->idle_timeout = (uint64_t)(idle_timeout * 1e9);
+    if(shared_table_register(shared, address) != 0) goto error;
+    return 0;
+
+error:
+    if(fd >= 0) close(fd);
+    if(shared->header) munmap(shared->header, shared->map_size);
+    memset(shared, 0, sizeof(*shared));
+    return -1;
+}
+
+/* Unmaps the table, leaving the sessions to the other servers. */
+static inline void shared_table_close(shared_table_t* shared)
+{
+    if(!shared_table_enabled(shared)) return;
+    shared_lock_header(shared->header);
+    shared->header->servers[shared->rank].pid = 0;
+    shared_unlock_header(shared->header);
+    munmap(shared->header, shared->map_size);
+    memset(shared, 0, sizeof(*shared));
+}
+
+/* Write side of a slot's seqlock. */
+static inline void shared_slot_lock(shared_slot_t* slot)
+{
+    uint64_t version = atomic_load_explicit(&slot->version, memory_order_relaxed);
+    for(;;) {
+        if((version & 1) == 0
+        && atomic_compare_exchange_weak_explicit(&slot->version, &version, version + 1,
+                                                 memory_order_acquire, memory_order_relaxed))
+            return;
+        version = atomic_load_explicit(&slot->version, memory_order_relaxed);
+    }
+}
+
+static inline void shared_slot_unlock(shared_slot_t* slot)
+{
+    atomic_fetch_add_explicit(&slot->version, 1, memory_order_release);
+}
+
+static inline uint64_t shared_pack_seq_no(const shared_table_t* shared, uint64_t seq_no)
+{
+    return ((uint64_t)shared->epoch << SHARED_SEQ_BITS) | (seq_no & ((1ULL << SHARED_SEQ_BITS) - 1));
+}
+
+static inline uint64_t shared_unpack_seq_no(const shared_table_t* shared, uint64_t packed)
+{
+    if((packed >> SHARED_SEQ_BITS) != (shared->epoch & 0xffff)) return 0; // set by another address
+    return packed & ((1ULL << SHARED_SEQ_BITS) - 1);
+}
+
+/* Publishes a session opened with this server. Returns its slot (index
+ * + 1), or 0 if the table is full. */
+static inline uint32_t shared_table_publish(shared_table_t* shared, session_id_t session_id,
+                                            uid_t uid, uint8_t mac_alg, uint8_t tag_len,
+                                            uint8_t aead_alg, const unsigned char key[32])
+{
+    uint64_t now  = shared_now();
+    size_t   mask = shared->capacity - 1;
+    size_t   i    = shared_table_hash(session_id) & mask;
+    for(size_t probes = 0; probes < shared->capacity; ++probes, i = (i + 1) & mask) {
+        shared_slot_t* slot = &shared->slots[i];
+        uint64_t id = atomic_load(&slot->session_id);
+        // slots of sessions idle everywhere for longer than the timeout
+        // belong to servers that are gone and can be reused
+        int stale = id > SHARED_SESSION_DELETED && shared->idle_timeout
+                 && atomic_load(&slot->last_used) + 2 * shared->idle_timeout < now;
+        if(id > SHARED_SESSION_DELETED && !stale) continue;
+
+        shared_slot_lock(slot);
+        if(atomic_load(&slot->session_id) != id) { // taken meanwhile
+            shared_slot_unlock(slot);
+            continue;
+        }
+        slot->uid          = (uint32_t)uid;
+        slot->mac_alg      = mac_alg;
+        slot->tag_len      = tag_len;
+        slot->aead_alg     = aead_alg;
+        slot->origin       = (uint8_t)shared->rank;
+        slot->origin_epoch = shared->epoch;
+        slot->created      = now;
+        memcpy(slot->key, key, sizeof(slot->key));
+        for(int r = 0; r < SHARED_TABLE_MAX_SERVERS; ++r) atomic_store(&slot->seq_no[r], 0);
+        atomic_store(&slot->last_used, now);
+        atomic_store(&slot->session_id, session_id);
+        shared_slot_unlock(slot);
+        return (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+/* Copies the session with this ID. Returns its slot, or 0 if the session
+ * is not in the table. */
+static inline uint32_t shared_table_lookup(shared_table_t* shared, session_id_t session_id,
+                                           shared_entry_t* entry)
+{
+    size_t mask = shared->capacity - 1;
+    size_t i    = shared_table_hash(session_id) & mask;
+    for(size_t probes = 0; probes < shared->capacity; ++probes, i = (i + 1) & mask) {
+        shared_slot_t* slot = &shared->slots[i];
+        uint64_t version, id = SHARED_SESSION_EMPTY;
+        do {
+            version = atomic_load_explicit(&slot->version, memory_order_acquire);
+            if(version & 1) continue;
+            id = atomic_load_explicit(&slot->session_id, memory_order_relaxed);
+            if(id == session_id) {
+                entry->session_id = id;
+                entry->uid        = (uid_t)slot->uid;
+                entry->mac_alg    = slot->mac_alg;
+                entry->tag_len    = slot->tag_len;
+                entry->aead_alg   = slot->aead_alg;
+                entry->is_origin  = slot->origin == shared->rank && slot->origin_epoch == shared->epoch;
+                entry->age        = (shared_now() - slot->created) * 1e-9;
+                entry->seq_no     = shared_unpack_seq_no(shared, atomic_load(&slot->seq_no[shared->rank]));
+                memcpy(entry->key, slot->key, sizeof(entry->key));
+            }
+            atomic_thread_fence(memory_order_acquire);
+        } while((version & 1) || atomic_load_explicit(&slot->version, memory_order_relaxed) != version);
+        if(id == session_id) return (uint32_t)i + 1;
+        if(id == SHARED_SESSION_EMPTY) break;
+    }
+    OPENSSL_cleanse(entry, sizeof(*entry));
+    return 0;
+}
+
+/* Returns 1 if the slot still holds the session, i.e. it has not been
+ * closed on another server. */
+static inline int shared_table_valid(shared_table_t* shared, uint32_t slot, session_id_t session_id)
+{
+    return atomic_load_explicit(&shared->slots[slot - 1].session_id, memory_order_acquire) == session_id;
+}
+
+/* Records that this server expects seq_no next for the session. The
+ * server's concurrent RPCs may call it out of order, so the recorded
+ * sequence number only goes up, unless it was recorded in another epoch.
+ * Nothing is recorded if the slot no longer holds the session: it may
+ * have been closed on another server and given to a new session, whose
+ * sequence number must not be moved. */
+static inline void shared_table_touch(shared_table_t* shared, uint32_t slot,
+                                      session_id_t session_id, uint64_t seq_no)
+{
+    shared_slot_t*    s       = &shared->slots[slot - 1];
+    _Atomic uint64_t* mine    = &s->seq_no[shared->rank];
+    uint64_t          packed  = shared_pack_seq_no(shared, seq_no);
+    uint64_t          version = atomic_load_explicit(&s->version, memory_order_acquire);
+    if((version & 1) || atomic_load(&s->session_id) != session_id) return;
+
+    uint64_t current = atomic_load_explicit(mine, memory_order_relaxed);
+    while((current < packed || (current >> SHARED_SEQ_BITS) != (packed >> SHARED_SEQ_BITS))
+       && !atomic_compare_exchange_weak(mine, &current, packed)) ;
+
+    // if the slot was given to another session between the check and the
+    // CAS, which publishes under the seqlock, undo what was written to it
+    if(atomic_load(&s->version) != version) {
+        shared_slot_lock(s);
+        if(atomic_load(&s->session_id) != session_id) {
+            uint64_t written = packed;
+            atomic_compare_exchange_strong(mine, &written, 0);
+        }
+        shared_slot_unlock(s);
+        return;
+    }
+    atomic_store_explicit(&s->last_used, shared_now(), memory_order_relaxed);
+}
+
+static inline void shared_table_remove(shared_table_t* shared, uint32_t slot, session_id_t session_id)
+{
+    shared_slot_t* s = &shared->slots[slot - 1];
+    shared_slot_lock(s);
+    if(atomic_load(&s->session_id) == session_id) {
+        atomic_store(&s->session_id, SHARED_SESSION_DELETED);
+        OPENSSL_cleanse(s->key, sizeof(s->key));
+    }
+    shared_slot_unlock(s);
+}
+
+/* Removes the session if it has been idle on all the servers, called
+ * when it expires on this one. */
+static inline void shared_table_expire(shared_table_t* shared, uint32_t slot, session_id_t session_id)
+{
+    shared_slot_t* s = &shared->slots[slot - 1];
+    if(shared->idle_timeout
+    && atomic_load(&s->last_used) + shared->idle_timeout <= shared_now())
+        shared_table_remove(shared, slot, session_id);
+}
+
+#endif
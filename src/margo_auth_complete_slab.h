@@ -0,0 +1,217 @@
+#ifndef MARGO_AUTH_COMPLETE_SLAB_H
+#define MARGO_AUTH_COMPLETE_SLAB_H
+
+#include <abt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <openssl/crypto.h>
+
+/* Slab allocator for fixed-size objects. Objects are carved out of 2 MiB
+ * chunks obtained with mmap and aligned on their size, so the slab an
+ * object belongs to is found from the chunk header at the start of the
+ * chunk, and the chunks can be backed by huge pages (hugetlbfs if some
+ * are reserved, transparent huge pages otherwise).
+ *
+ * Each execution stream has its own cache of free objects, used without
+ * any locking since a ULT is not preempted between two yield points.
+ * When a cache is empty it is refilled with half its capacity from the
+ * depot, a list of free objects shared by all the execution streams and
+ * protected by a mutex, and when it is full half of it goes back to the
+ * depot, so the depot is only touched once every SLAB_CACHE_SIZE/2
+ * operations. Locking the depot's mutex may yield to another ULT of the
+ * same execution stream, which may use the cache in the meantime, so the
+ * objects moved to or from the depot go through a local array and the
+ * cache is never read or written while the mutex is held. Threads that
+ * are not execution streams use the depot directly.
+ *
+ * Objects are zeroed when they are freed (with OPENSSL_cleanse, as they
+ * may hold keys), so slab_alloc always returns zeroed memory. Chunks are
+ * only unmapped by slab_finalize. Objects must be freed before Argobots
+ * is finalized. */
+
+#define SLAB_CHUNK_SIZE ((size_t)2 << 20)
+#define SLAB_ALIGNMENT  64
+#define SLAB_MAX_CACHES 64 /* execution streams with a cache */
+#define SLAB_CACHE_SIZE 64 /* objects per cache */
+
+typedef struct slab_object_t {
+    struct slab_object_t* next; /* only used while the object is in the depot */
+} slab_object_t;
+
+typedef struct slab_chunk_t {
+    struct slab_t*       slab;
+    struct slab_chunk_t* next;
+} slab_chunk_t;
+
+typedef struct {
+    _Alignas(SLAB_ALIGNMENT) size_t count;
+    void* objects[SLAB_CACHE_SIZE];
+} slab_cache_t;
+
+typedef struct slab_t {
+    size_t           object_size; /* multiple of SLAB_ALIGNMENT */
+    int              huge_pages;
+    ABT_mutex_memory mtx;         /* protects the fields below */
+    slab_object_t*   depot;
+    slab_chunk_t*    chunks;
+    char*            next;        /* unused part of the last chunk */
+    char*            end;
+    size_t           num_chunks;
+    slab_cache_t*    caches;      /* SLAB_MAX_CACHES caches */
+} slab_t;
+
+static inline int slab_init(slab_t* slab, size_t object_size, int huge_pages)
+{
+    memset(slab, 0, sizeof(*slab));
+    slab->object_size = (object_size + SLAB_ALIGNMENT - 1) & ~(size_t)(SLAB_ALIGNMENT - 1);
+    slab->huge_pages  = huge_pages;
+    slab->caches = (slab_cache_t*)aligned_alloc(SLAB_ALIGNMENT, SLAB_MAX_CACHES * sizeof(slab_cache_t));
+    if(!slab->caches) return -1;
+    memset(slab->caches, 0, SLAB_MAX_CACHES * sizeof(slab_cache_t));
+    return 0;
+}
+
+/* Unmaps all the chunks, whether or not their objects have been freed. */
+static inline void slab_finalize(slab_t* slab)
+{
+    while(slab->chunks) {
+        slab_chunk_t* chunk = slab->chunks;
+        slab->chunks = chunk->next;
+        munmap(chunk, SLAB_CHUNK_SIZE);
+    }
+    free(slab->caches);
+    memset(slab, 0, sizeof(*slab));
+}
+
+static inline void* slab_map_chunk(int huge_pages)
+{
+#ifdef MAP_HUGETLB
+    // hugetlbfs mappings are aligned on the huge page size
+    if(huge_pages) {
+        void* p = mmap(NULL, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p != MAP_FAILED && ((uintptr_t)p & (SLAB_CHUNK_SIZE - 1)) == 0) return p;
+        if(p != MAP_FAILED) munmap(p, SLAB_CHUNK_SIZE);
+    }
+#endif
+    // otherwise map twice the size and trim it to an aligned chunk
+    char* raw = (char*)mmap(NULL, 2 * SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED) return NULL;
+    char* chunk = (char*)(((uintptr_t)raw + SLAB_CHUNK_SIZE - 1) & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+    if(chunk != raw) munmap(raw, chunk - raw);
+    munmap(chunk + SLAB_CHUNK_SIZE, raw + SLAB_CHUNK_SIZE - chunk);
+#ifdef MADV_HUGEPAGE
+    if(huge_pages) madvise(chunk, SLAB_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+    return chunk;
+}
+
+/* Takes up to n free objects from the depot, carving them out of a new
+ * chunk if needed. Must be called with the slab's mutex held. */
+static inline size_t slab_depot_get(slab_t* slab, void** objects, size_t n)
+{
+    size_t count = 0;
+    while(count < n && slab->depot) {
+        slab_object_t* object = slab->depot;
+        slab->depot  = object->next;
+        object->next = NULL;
+        objects[count++] = object;
+    }
+    while(count < n) {
+        if(slab->next + slab->object_size > slab->end) {
+            slab_chunk_t* chunk = (slab_chunk_t*)slab_map_chunk(slab->huge_pages);
+            if(!chunk) break;
+            chunk->slab   = slab;
+            chunk->next   = slab->chunks;
+            slab->chunks  = chunk;
+            slab->next    = (char*)chunk + SLAB_ALIGNMENT;
+            slab->end     = (char*)chunk + SLAB_CHUNK_SIZE;
+            slab->num_chunks += 1;
+        }
+        objects[count++] = slab->next;
+        slab->next += slab->object_size;
+    }
+    return count;
+}
+
+/* Gives n objects back to the depot. Must be called with the slab's
+ * mutex held. */
+static inline void slab_depot_put(slab_t* slab, void** objects, size_t n)
+{
+    for(size_t i = 0; i < n; ++i) {
+        slab_object_t* object = (slab_object_t*)objects[i];
+        object->next = slab->depot;
+        slab->depot  = object;
+    }
+}
+
+/* Cache of the calling execution stream, or NULL if the caller is not
+ * an execution stream or its rank has no cache. */
+static inline slab_cache_t* slab_local_cache(slab_t* slab)
+{
+    int rank;
+    if(ABT_self_get_xstream_rank(&rank) != ABT_SUCCESS) return NULL;
+    if(rank < 0 || rank >= SLAB_MAX_CACHES) return NULL;
+    return &slab->caches[rank];
+}
+
+/* Returns a zeroed object, or NULL if no memory could be mapped. */
+static inline void* slab_alloc(slab_t* slab)
+{
+    void*         refill[SLAB_CACHE_SIZE / 2];
+    size_t        n     = 0;
+    slab_cache_t* cache = slab_local_cache(slab);
+    if(cache && cache->count) return cache->objects[--cache->count];
+
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&slab->mtx));
+    n = slab_depot_get(slab, refill, cache ? SLAB_CACHE_SIZE / 2 : 1);
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&slab->mtx));
+    if(n == 0) return NULL;
+
+    // other ULTs may have filled the cache while the mutex was taken,
+    // the objects that don't fit in it go back to the depot
+    void* object = refill[--n];
+    while(n && cache->count < SLAB_CACHE_SIZE)
+        cache->objects[cache->count++] = refill[--n];
+    if(n) {
+        ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&slab->mtx));
+        slab_depot_put(slab, refill, n);
+        ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&slab->mtx));
+    }
+    return object;
+}
+
+/* Zeroes an object allocated by slab_alloc and gives it back to its slab. */
+static inline void slab_free(void* object)
+{
+    slab_chunk_t* chunk = (slab_chunk_t*)((uintptr_t)object & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+    slab_t*       slab  = chunk->slab;
+    OPENSSL_cleanse(object, slab->object_size);
+
+    void*         drain[SLAB_CACHE_SIZE / 2];
+    size_t        n     = 0;
+    slab_cache_t* cache = slab_local_cache(slab);
+    if(cache && cache->count < SLAB_CACHE_SIZE) {
+        cache->objects[cache->count++] = object;
+        return;
+    }
+
+    // take half of the cache out before taking the mutex
+    if(cache) {
+        n = SLAB_CACHE_SIZE / 2;
+        cache->count -= n;
+        memcpy(drain, cache->objects + cache->count, n * sizeof(*drain));
+        cache->objects[cache->count++] = object;
+    } else {
+        drain[n++] = object;
+    }
+
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&slab->mtx));
+    slab_depot_put(slab, drain, n);
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&slab->mtx));
+}
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef MARGO_AUTH_COMPLETE_STORE_H
+#define MARGO_AUTH_COMPLETE_STORE_H
+
+#include <abt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_types.h"
+
+/* Persistent session store, so that restarting a server doesn't force
+ * all its clients to authenticate again at once. The store is a file of
+ * fixed-size records mapped in memory with MAP_SHARED: a session gets a
+ * record when it is opened, its sequence number and last_used time are
+ * written to its record by every RPC (a plain store to memory), and the
+ * record is erased when the session is closed, expires or is evicted.
+ * The kernel writes the dirty pages back, so the records survive the
+ * server process; they are also flushed with msync when the store is
+ * closed. The server reloads the records when it starts.
+ *
+ * A record's session ID is written last when it is saved and cleared
+ * first when it is erased, so a record is either valid or ignored.
+ *
+ * Session keys are sealed with AES-256-GCM under a key derived from a
+ * host-local key file, readable only by the server's user and created on
+ * first use, with the session ID, uid and MAC/AEAD parameters as
+ * associated data so that a record can't be altered to grant a session
+ * to another uid. The nonce is a counter kept in the file's header,
+ * which is moved past the nonces of all the records and past as many
+ * nonces as there are records when the store is opened, in case the
+ * header was not written back before a crash while records were.
+ *
+ * Sequence numbers written to the page cache but not to the disk are
+ * lost if the host (not the server) crashes; the sessions then expect
+ * an older sequence number, and replaying the tokens sent since would be
+ * possible for them. */
+
+#define SESSION_STORE_MAGIC            0x3145524f54534d41ULL /* "AMSTORE1" */
+#define SESSION_STORE_VERSION          1
+#define SESSION_STORE_DEFAULT_CAPACITY 65536
+#define SESSION_STORE_AEAD_DIRECTION   2 /* nonces don't collide with RPC ones */
+
+typedef struct {
+    _Alignas(64)
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t nonce_counter; /* next nonce to seal a key with */
+} session_store_header_t;
+
+typedef struct {
+    _Alignas(64)
+    _Atomic uint64_t session_id;   /* 0 if the record is free */
+    _Atomic uint64_t seq_no;
+    _Atomic double   last_used;    /* wall-clock time */
+    double           created;      /* wall-clock time */
+    uint64_t         nonce;
+    uint32_t         uid;
+    uint8_t          mac_alg;
+    uint8_t          tag_len;
+    uint8_t          aead_alg;
+    uint8_t          reserved;
+    unsigned char    sealed_key[32];
+    unsigned char    tag[AEAD_TAG_SIZE];
+} session_record_t;
+
+/* Plaintext content of a record. */
+typedef struct {
+    session_id_t  session_id;
+    uint64_t      seq_no;
+    double        last_used;
+    double        created;
+    uid_t         uid;
+    uint8_t       mac_alg;
+    uint8_t       tag_len;
+    uint8_t       aead_alg;
+    unsigned char key[32];
+} session_entry_t;
+
+typedef struct {
+    int                     fd;
+    size_t                  map_size;
+    session_store_header_t* header;
+    session_record_t*       records;
+    size_t                  capacity;
+    aead_t                  aead;       /* seals the session keys */
+    ABT_mutex_memory        mtx;        /* protects the fields below */
+    uint32_t*               free_slots; /* stack of free record indices */
+    size_t                  num_free;
+} session_store_t;
+
+static inline int session_store_enabled(const session_store_t* store)
+{
+    return store->records != NULL;
+}
+
+/* Reads the host-local key, creating it if it doesn't exist. */
+static inline int session_store_host_key(const char* path, unsigned char key[32])
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 && errno == ENOENT) {
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if(fd < 0) return -1;
+        int ok = RAND_bytes(key, 32) == 1 && write(fd, key, 32) == 32 && fsync(fd) == 0;
+        close(fd);
+        return ok ? 0 : -1;
+    }
+    if(fd < 0) return -1;
+    struct stat st;
+    int ok = fstat(fd, &st) == 0 && (st.st_mode & 077) == 0 && read(fd, key, 32) == 32;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/* Associated data of a record. */
+static inline size_t session_store_aad(const session_record_t* record, session_id_t session_id,
+                                       unsigned char aad[24])
+{
+    memcpy(aad, &session_id, 8);
+    memcpy(aad + 8, &record->created, 8);
+    memcpy(aad + 16, &record->uid, 4);
+    aad[20] = record->mac_alg;
+    aad[21] = record->tag_len;
+    aad[22] = record->aead_alg;
+    aad[23] = 0;
+    return 24;
+}
+
+/* Opens (or creates) the store at path, with the host-local key at
+ * key_path. The capacity is only used when creating the file. Records in
+ * use are left as they are, for session_store_read to restore. */
+static inline int session_store_open(session_store_t* store, const char* path,
+                                     const char* key_path, size_t capacity)
+{
+    unsigned char host_key[32];
+    struct stat   st;
+    memset(store, 0, sizeof(*store));
+    store->fd = -1;
+
+    if(session_store_host_key(key_path, host_key) != 0) return -1;
+    int ret = aead_init(&store->aead, AEAD_AES_256_GCM, host_key, sizeof(host_key));
+    OPENSSL_cleanse(host_key, sizeof(host_key));
+    if(ret != 0) return -1;
+
+    store->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(store->fd < 0) goto error;
+    // a store can only be used by one server at a time
+    if(flock(store->fd, LOCK_EX | LOCK_NB) != 0) goto error;
+    if(fstat(store->fd, &st) != 0) goto error;
+
+    int created = st.st_size == 0;
+    if(created) {
+        if(capacity == 0 || capacity > UINT32_MAX) goto error;
+        st.st_size = sizeof(session_store_header_t) + capacity * sizeof(session_record_t);
+        if(ftruncate(store->fd, st.st_size) != 0) goto error;
+    }
+    if((size_t)st.st_size < sizeof(session_store_header_t)) goto error;
+    store->map_size = st.st_size;
+    void* map = mmap(NULL, store->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if(map == MAP_FAILED) goto error;
+    store->header  = (session_store_header_t*)map;
+    store->records = (session_record_t*)(store->header + 1);
+
+    if(created) {
+        store->header->magic       = SESSION_STORE_MAGIC;
+        store->header->version     = SESSION_STORE_VERSION;
+        store->header->record_size = sizeof(session_record_t);
+        store->header->capacity    = capacity;
+    }
+    if(store->header->magic != SESSION_STORE_MAGIC
+    || store->header->version != SESSION_STORE_VERSION
+    || store->header->record_size != sizeof(session_record_t)
+    || store->header->capacity > UINT32_MAX
+    || store->map_size < sizeof(session_store_header_t)
+                       + store->header->capacity * sizeof(session_record_t))
+        goto error;
+    store->capacity = store->header->capacity;
+
+    store->free_slots = (uint32_t*)malloc(store->capacity * sizeof(uint32_t));
+    if(!store->free_slots) goto error;
+    uint64_t nonce = store->header->nonce_counter;
+    for(size_t i = store->capacity; i-- > 0;) {
+        if(atomic_load(&store->records[i].session_id) == 0)
+            store->free_slots[store->num_free++] = (uint32_t)i;
+        else if(store->records[i].nonce >= nonce)
+            nonce = store->records[i].nonce + 1;
+    }
+    store->header->nonce_counter = nonce + store->capacity;
+    return 0;
+
+error:
+    if(store->header) munmap(store->header, store->map_size);
+    if(store->fd >= 0) close(store->fd);
+    aead_destroy(&store->aead);
+    memset(store, 0, sizeof(*store));
+    return -1;
+}
+
+static inline void session_store_close(session_store_t* store)
+{
+    if(!session_store_enabled(store)) return;
+    msync(store->header, store->map_size, MS_SYNC);
+    munmap(store->header, store->map_size);
+    close(store->fd);
+    free(store->free_slots);
+    aead_destroy(&store->aead);
+    memset(store, 0, sizeof(*store));
+}
+
+/* Saves a new session, returning its slot (its record index + 1), or 0
+ * if the store is full or the key could not be sealed. */
+static inline uint32_t session_store_save(session_store_t* store, const session_entry_t* entry)
+{
+    uint32_t index;
+    uint64_t nonce;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&store->mtx));
+    if(store->num_free == 0) {
+        ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&store->mtx));
+        return 0;
+    }
+    index = store->free_slots[--store->num_free];
+    nonce = store->header->nonce_counter++;
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&store->mtx));
+
+    session_record_t* record = &store->records[index];
+    unsigned char     aad[24];
+    record->seq_no    = entry->seq_no;
+    record->last_used = entry->last_used;
+    record->created   = entry->created;
+    record->nonce     = nonce;
+    record->uid       = (uint32_t)entry->uid;
+    record->mac_alg   = entry->mac_alg;
+    record->tag_len   = entry->tag_len;
+    record->aead_alg  = entry->aead_alg;
+    memcpy(record->sealed_key, entry->key, sizeof(record->sealed_key));
+    size_t aad_len = session_store_aad(record, entry->session_id, aad);
+    if(aead_crypt(&store->aead, 1, SESSION_STORE_AEAD_DIRECTION, nonce, aad, aad_len,
+                  record->sealed_key, sizeof(record->sealed_key), record->tag) != 0) {
+        OPENSSL_cleanse(record, sizeof(*record));
+        ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&store->mtx));
+        store->free_slots[store->num_free++] = index;
+        ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&store->mtx));
+        return 0;
+    }
+    atomic_store_explicit(&record->session_id, entry->session_id, memory_order_release);
+    return index + 1;
+}
+
+/* Records the progress of a session. Concurrent RPCs of the session may
+ * call it out of order, so the recorded sequence number only goes up. */
+static inline void session_store_touch(session_store_t* store, uint32_t slot,
+                                       uint64_t seq_no, double last_used)
+{
+    if(!slot) return;
+    session_record_t* record = &store->records[slot - 1];
+    uint64_t current = atomic_load_explicit(&record->seq_no, memory_order_relaxed);
+    while(current < seq_no && !atomic_compare_exchange_weak(&record->seq_no, &current, seq_no)) ;
+    atomic_store_explicit(&record->last_used, last_used, memory_order_relaxed);
+}
+
+static inline void session_store_erase(session_store_t* store, uint32_t slot)
+{
+    if(!slot) return;
+    session_record_t* record = &store->records[slot - 1];
+    atomic_store_explicit(&record->session_id, 0, memory_order_release);
+    OPENSSL_cleanse(record, sizeof(*record));
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&store->mtx));
+    store->free_slots[store->num_free++] = slot - 1;
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&store->mtx));
+}
+
+/* Reads and unseals the record at the given index. Returns 1 and the
+ * slot of the record if it holds a session, 0 if it is free, and -1 if
+ * it could not be unsealed, in which case it is erased. */
+static inline int session_store_read(session_store_t* store, size_t index,
+                                     session_entry_t* entry, uint32_t* slot)
+{
+    session_record_t* record = &store->records[index];
+    unsigned char     aad[24];
+    memset(entry, 0, sizeof(*entry));
+    entry->session_id = atomic_load_explicit(&record->session_id, memory_order_acquire);
+    if(entry->session_id == 0) return 0;
+    entry->seq_no    = record->seq_no;
+    entry->last_used = record->last_used;
+    entry->created   = record->created;
+    entry->uid       = (uid_t)record->uid;
+    entry->mac_alg   = record->mac_alg;
+    entry->tag_len   = record->tag_len;
+    entry->aead_alg  = record->aead_alg;
+    memcpy(entry->key, record->sealed_key, sizeof(entry->key));
+    size_t aad_len = session_store_aad(record, entry->session_id, aad);
+    if(aead_crypt(&store->aead, 0, SESSION_STORE_AEAD_DIRECTION, record->nonce, aad, aad_len,
+                  entry->key, sizeof(entry->key), record->tag) != 0) {
+        OPENSSL_cleanse(entry, sizeof(*entry));
+        session_store_erase(store, (uint32_t)index + 1);
+        return -1;
+    }
+    *slot = (uint32_t)index + 1;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef MARGO_AUTH_COMPLETE_TICKETS_H
+#define MARGO_AUTH_COMPLETE_TICKETS_H
+
+#include <margo.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "margo_auth_complete_types.h"
+
+/* In ticket mode, the server does not keep a session_t per client.
+ * Instead, authenticate returns a ticket containing everything the
+ * server needs to know about the session (uid, key, MAC parameters,
+ * expiry), encrypted and authenticated with AES-256-GCM under a master
+ * key that only the server knows. The client attaches the ticket to
+ * its tokens and the server decrypts it on every RPC.
+ *
+ * Replay protection still requires a sequence number per session.
+ * Tickets are therefore assigned a slot in a fixed-size array of
+ * ticket_slot_t that holds the session ID, the MAC state keyed when the
+ * ticket was issued, and the next expected sequence number, and which is
+ * indexed directly by the slot number found in the ticket: no lookup, no
+ * lock. Each issue of a slot bumps its generation, which the ticket
+ * carries and which shares a word with the sequence number, so that the
+ * sequence number is claimed with a single compare-and-swap that fails
+ * for the tickets of the slot's previous sessions. Memory is bounded by
+ * the number of slots, and slots of expired or closed tickets are
+ * reused.
+ *
+ * Issuing a ticket takes a slot in O(1): the slots of closed tickets are
+ * kept in a free list, and the others in a list in the order they were
+ * issued, which, all tickets having the same lifetime, is the order they
+ * expire in, so the only slot that may have expired is the oldest. */
+
+#define TICKET_CONTENT_SIZE (8 + 4 + 4 + 4 + 8 + 1 + 1 + 32)
+#define TICKET_IV_SIZE      12
+#define TICKET_GCM_TAG_SIZE 16
+
+_Static_assert(TICKET_IV_SIZE + TICKET_CONTENT_SIZE + TICKET_GCM_TAG_SIZE <= TICKET_MAX_SIZE,
+               "TICKET_MAX_SIZE too small for the ticket content");
+
+/* Layout of the state word of a slot: generation in the high bits, next
+ * expected sequence number in the low ones. */
+#define TICKET_SEQ_NO_BITS    40
+#define TICKET_SEQ_NO_MAX     ((UINT64_C(1) << TICKET_SEQ_NO_BITS) - 1)
+#define TICKET_GENERATION_MAX ((UINT32_C(1) << (64 - TICKET_SEQ_NO_BITS)) - 1)
+
+#define TICKET_SLOT_NONE UINT32_MAX /* end of the lists of slots */
+
+typedef struct {
+    session_id_t  session_id;
+    uint32_t      uid;
+    uint32_t      slot;
+    uint32_t      generation;
+    uint64_t      expiry; /* seconds since the epoch */
+    uint8_t       mac_alg;
+    uint8_t       tag_len;
+    unsigned char key[32];
+} ticket_content_t;
+
+typedef struct {
+    _Atomic uint64_t     state;      /* generation and next expected sequence number */
+    _Atomic session_id_t session_id; /* 0 if the slot is free */
+    _Atomic uint64_t     expiry;
+    _Atomic uint32_t     users;      /* handlers using mac */
+    uint32_t             prev, next; /* in the keeper's lists, under its mutex */
+    mac_t                mac;        /* keyed when the ticket is issued */
+} ticket_slot_t;
+
+static inline uint64_t ticket_slot_state(uint32_t generation, uint64_t seq_no)
+{
+    return ((uint64_t)generation << TICKET_SEQ_NO_BITS) | seq_no;
+}
+
+static inline uint32_t ticket_slot_generation(uint64_t state)
+{
+    return (uint32_t)(state >> TICKET_SEQ_NO_BITS);
+}
+
+typedef struct {
+    unsigned char    master_key[32];
+    uint32_t         capacity;
+    ticket_slot_t*   slots;
+    uint32_t         free;     /* slots of no ticket, linked by next */
+    uint32_t         oldest;   /* slots of issued tickets, oldest first */
+    uint32_t         newest;
+    uint64_t         lifetime; /* in seconds */
+    ABT_mutex_memory mtx;      /* protects the lists of slots */
+} ticket_keeper_t;
+
+static inline int ticket_keeper_init(ticket_keeper_t* keeper, uint32_t capacity, uint64_t lifetime)
+{
+    memset(keeper, 0, sizeof(*keeper));
+    if(capacity == 0 || capacity == TICKET_SLOT_NONE) return -1;
+    if(RAND_bytes(keeper->master_key, sizeof(keeper->master_key)) != 1) return -1;
+    keeper->slots = (ticket_slot_t*)calloc(capacity, sizeof(*keeper->slots));
+    if(!keeper->slots) return -1;
+    for(uint32_t i = 0; i < capacity; ++i)
+        keeper->slots[i].next = i + 1 < capacity ? i + 1 : TICKET_SLOT_NONE;
+    keeper->capacity = capacity;
+    keeper->free     = 0;
+    keeper->oldest   = TICKET_SLOT_NONE;
+    keeper->newest   = TICKET_SLOT_NONE;
+    keeper->lifetime = lifetime;
+    return 0;
+}
+
+/* Removes a slot from the list of issued tickets. Must be called with the
+ * keeper's mutex held. */
+static inline void ticket_slot_unlink(ticket_keeper_t* keeper, uint32_t index)
+{
+    ticket_slot_t* slot = &keeper->slots[index];
+    if(slot->prev != TICKET_SLOT_NONE) keeper->slots[slot->prev].next = slot->next;
+    else keeper->oldest = slot->next;
+    if(slot->next != TICKET_SLOT_NONE) keeper->slots[slot->next].prev = slot->prev;
+    else keeper->newest = slot->prev;
+}
+
+/* Adds a slot to the list of issued tickets, as the newest. Must be
+ * called with the keeper's mutex held. */
+static inline void ticket_slot_append(ticket_keeper_t* keeper, uint32_t index)
+{
+    ticket_slot_t* slot = &keeper->slots[index];
+    slot->prev = keeper->newest;
+    slot->next = TICKET_SLOT_NONE;
+    if(keeper->newest != TICKET_SLOT_NONE) keeper->slots[keeper->newest].next = index;
+    else keeper->oldest = index;
+    keeper->newest = index;
+}
+
+static inline void ticket_keeper_finalize(ticket_keeper_t* keeper)
+{
+    OPENSSL_cleanse(keeper->master_key, sizeof(keeper->master_key));
+    for(uint32_t i = 0; keeper->slots && i < keeper->capacity; ++i)
+        mac_destroy(&keeper->slots[i].mac);
+    free(keeper->slots);
+    keeper->slots = NULL;
+}
+
+static inline void ticket_content_serialize(const ticket_content_t* content, unsigned char* buf)
+{
+    memcpy(buf, &content->session_id, 8);  buf += 8;
+    memcpy(buf, &content->uid, 4);         buf += 4;
+    memcpy(buf, &content->slot, 4);        buf += 4;
+    memcpy(buf, &content->generation, 4);  buf += 4;
+    memcpy(buf, &content->expiry, 8);      buf += 8;
+    *buf++ = content->mac_alg;
+    *buf++ = content->tag_len;
+    memcpy(buf, content->key, sizeof(content->key));
+}
+
+static inline void ticket_content_deserialize(ticket_content_t* content, const unsigned char* buf)
+{
+    memcpy(&content->session_id, buf, 8);  buf += 8;
+    memcpy(&content->uid, buf, 4);         buf += 4;
+    memcpy(&content->slot, buf, 4);        buf += 4;
+    memcpy(&content->generation, buf, 4);  buf += 4;
+    memcpy(&content->expiry, buf, 8);      buf += 8;
+    content->mac_alg = *buf++;
+    content->tag_len = *buf++;
+    memcpy(content->key, buf, sizeof(content->key));
+}
+
+/* Encrypts len bytes of plain under key with AES-256-GCM, writing
+ * iv | ciphertext | tag to out, and authenticating the associated data
+ * along with them. */
+static inline int ticket_seal(const unsigned char key[32], const unsigned char* aad, size_t aad_len,
+                              const unsigned char* plain, size_t len, unsigned char* out)
+{
+    int ret = -1, n = 0;
+    unsigned char* iv     = out;
+    unsigned char* cipher = out + TICKET_IV_SIZE;
+    unsigned char* tag    = cipher + len;
+    EVP_CIPHER_CTX* ctx   = NULL;
+
+    if(RAND_bytes(iv, TICKET_IV_SIZE) != 1) goto finish;
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx) goto finish;
+    if(EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv) != 1) goto finish;
+    if(aad_len && EVP_EncryptUpdate(ctx, NULL, &n, aad, aad_len) != 1) goto finish;
+    if(EVP_EncryptUpdate(ctx, cipher, &n, plain, len) != 1) goto finish;
+    if(EVP_EncryptFinal_ex(ctx, cipher + n, &n) != 1) goto finish;
+    if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TICKET_GCM_TAG_SIZE, tag) != 1) goto finish;
+    ret = 0;
+
+finish:
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+
+/* Decrypts the len bytes of plaintext sealed in `in` by ticket_seal.
+ * Returns -1 if the ticket or the associated data were tampered with, in
+ * which case plain holds garbage. */
+static inline int ticket_unseal(const unsigned char key[32], const unsigned char* aad, size_t aad_len,
+                                const unsigned char* in, size_t len, unsigned char* plain)
+{
+    int ret = -1, n = 0;
+    const unsigned char* iv     = in;
+    const unsigned char* cipher = in + TICKET_IV_SIZE;
+    const unsigned char* tag    = cipher + len;
+    EVP_CIPHER_CTX* ctx         = NULL;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx) goto finish;
+    if(EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv) != 1) goto finish;
+    if(aad_len && EVP_DecryptUpdate(ctx, NULL, &n, aad, aad_len) != 1) goto finish;
+    if(EVP_DecryptUpdate(ctx, plain, &n, cipher, len) != 1) goto finish;
+    if(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TICKET_GCM_TAG_SIZE, (void*)tag) != 1) goto finish;
+    if(EVP_DecryptFinal_ex(ctx, plain + n, &n) != 1) goto finish; // forged or corrupted
+    ret = 0;
+
+finish:
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+
+/* Allocates a slot for a new session, keys its MAC state, and fills the
+ * ticket with the encrypted content. Returns -1 if all the slots are in
+ * use or if the MAC state could not be keyed. */
+static inline int ticket_issue(ticket_keeper_t* keeper, ticket_content_t* content, ticket_t* ticket)
+{
+    uint64_t now = (uint64_t)time(NULL);
+    int ret = -1;
+    unsigned char plain[TICKET_CONTENT_SIZE];
+    uint32_t index;
+    ticket_slot_t* slot;
+
+    // take a free slot, or the slot of the oldest ticket if it expired
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&keeper->mtx));
+    index = keeper->free;
+    if(index != TICKET_SLOT_NONE) {
+        keeper->free = keeper->slots[index].next;
+    } else {
+        index = keeper->oldest;
+        if(index == TICKET_SLOT_NONE || atomic_load(&keeper->slots[index].expiry) > now) {
+            ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&keeper->mtx));
+            return -1;
+        }
+        ticket_slot_unlink(keeper, index);
+    }
+    // a new generation makes the tickets of the previous session fail
+    // ticket_acquire and ticket_claim_seq_no
+    slot = &keeper->slots[index];
+    uint32_t generation = (ticket_slot_generation(atomic_load(&slot->state)) + 1)
+                        & TICKET_GENERATION_MAX;
+    atomic_store(&slot->session_id, 0);
+    atomic_store(&slot->state, ticket_slot_state(generation, 0));
+    atomic_store(&slot->expiry, now + keeper->lifetime);
+    ticket_slot_append(keeper, index);
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&keeper->mtx));
+
+    // handlers that acquired the slot before may still be using its MAC
+    // state, so wait for them before keying it again; the slot can't be
+    // revoked or taken meanwhile, since its session ID is 0 and it only
+    // expires after the lifetime of a ticket
+    while(atomic_load(&slot->users) != 0) ABT_thread_yield();
+    mac_destroy(&slot->mac);
+    if(mac_init(&slot->mac, (mac_alg_t)content->mac_alg, content->tag_len,
+                content->key, sizeof(content->key)) != 0) {
+        ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&keeper->mtx));
+        ticket_slot_unlink(keeper, index);
+        slot->next   = keeper->free;
+        keeper->free = index;
+        ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&keeper->mtx));
+        return -1;
+    }
+    atomic_store(&slot->session_id, content->session_id);
+    content->slot = index;
+    content->generation = generation;
+    content->expiry = now + keeper->lifetime;
+
+    // encrypt the content: iv | ciphertext | gcm tag
+    ticket_content_serialize(content, plain);
+    ret = ticket_seal(keeper->master_key, NULL, 0, plain, sizeof(plain), ticket->data);
+    if(ret == 0) ticket->len = TICKET_IV_SIZE + TICKET_CONTENT_SIZE + TICKET_GCM_TAG_SIZE;
+    OPENSSL_cleanse(plain, sizeof(plain));
+    return ret;
+}
+
+/* Decrypts and authenticates a ticket, and checks that it has not
+ * expired. */
+static inline int ticket_open(ticket_keeper_t* keeper, const ticket_t* ticket, ticket_content_t* content)
+{
+    int ret = -1;
+    unsigned char plain[TICKET_CONTENT_SIZE];
+
+    if(ticket->len != TICKET_IV_SIZE + TICKET_CONTENT_SIZE + TICKET_GCM_TAG_SIZE) return -1;
+    if(ticket_unseal(keeper->master_key, NULL, 0, ticket->data, TICKET_CONTENT_SIZE, plain) != 0)
+        goto finish;
+    ticket_content_deserialize(content, plain);
+
+    if(content->slot >= keeper->capacity) goto finish;
+    if(content->expiry <= (uint64_t)time(NULL)) goto finish;
+    ret = 0;
+
+finish:
+    OPENSSL_cleanse(plain, sizeof(plain));
+    return ret;
+}
+
+/* Checks that the slot of an opened ticket still belongs to it, and
+ * returns the slot's MAC state, which stays valid until ticket_release.
+ * Returns NULL if the slot was revoked or given to another session. */
+static inline const mac_t* ticket_acquire(ticket_keeper_t* keeper, const ticket_content_t* content)
+{
+    ticket_slot_t* slot = &keeper->slots[content->slot];
+    // registering as a user before checking the slot pairs with
+    // ticket_issue changing the slot before waiting for its users
+    atomic_fetch_add(&slot->users, 1);
+    if(ticket_slot_generation(atomic_load(&slot->state)) != content->generation
+    || atomic_load(&slot->session_id) != content->session_id) {
+        atomic_fetch_sub(&slot->users, 1);
+        return NULL;
+    }
+    return &slot->mac;
+}
+
+static inline void ticket_release(ticket_keeper_t* keeper, const ticket_content_t* content)
+{
+    atomic_fetch_sub(&keeper->slots[content->slot].users, 1);
+}
+
+/* Claims a sequence number for the session of an opened ticket. This
+ * should only be called once the token's MAC has been verified, so that
+ * forged tokens cannot consume sequence numbers. The generation is part
+ * of the compared word, so a ticket of a previous session of the slot
+ * can't move the sequence number of the current one. */
+static inline int ticket_claim_seq_no(ticket_keeper_t* keeper, const ticket_content_t* content, uint64_t seq_no)
+{
+    ticket_slot_t* slot = &keeper->slots[content->slot];
+    if(seq_no >= TICKET_SEQ_NO_MAX) return -1; // the client must authenticate again
+    uint64_t expected = ticket_slot_state(content->generation, seq_no);
+    return atomic_compare_exchange_strong(&slot->state, &expected, expected + 1) ? 0 : -1;
+}
+
+/* Frees the slot of a ticket, invalidating it. */
+static inline void ticket_revoke(ticket_keeper_t* keeper, const ticket_content_t* content)
+{
+    ticket_slot_t* slot     = &keeper->slots[content->slot];
+    session_id_t   expected = content->session_id;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&keeper->mtx));
+    if(atomic_compare_exchange_strong(&slot->session_id, &expected, 0)) {
+        ticket_slot_unlink(keeper, content->slot);
+        slot->next   = keeper->free;
+        keeper->free = content->slot;
+    }
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&keeper->mtx));
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef MARGO_AUTH_COMPLETE_TIMER_WHEEL_H
+#define MARGO_AUTH_COMPLETE_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Hierarchical timer wheel. Time is counted in ticks, and the wheel has
+ * TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots each, slot s of
+ * level l holding the timers whose expiry tick has s as its l-th group
+ * of TIMER_WHEEL_BITS bits and is less than SLOTS^(l+1) ticks away.
+ * Adding or removing a timer is O(1). Each tick empties one slot of the
+ * first level, and once every SLOTS^l ticks a slot of level l is
+ * cascaded, its timers moving to the lower levels, so a timer is moved
+ * at most LEVELS-1 times before it expires. Timers further away than the
+ * wheel's span expire at the end of the span, and should be re-added by
+ * their owner if they are not actually due.
+ *
+ * Timers are intrusive, doubly-linked nodes, and the wheel does no
+ * locking of its own. */
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SPAN   ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+typedef struct timer_node_t {
+    struct timer_node_t* prev; /* NULL if the timer is not in a list */
+    struct timer_node_t* next;
+    uint64_t             expires;
+} timer_node_t;
+
+typedef struct {
+    uint64_t     now; /* current tick */
+    timer_node_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /* list heads */
+} timer_wheel_t;
+
+static inline void timer_list_init(timer_node_t* head)
+{
+    head->prev = head->next = head;
+}
+
+static inline int timer_list_empty(const timer_node_t* head)
+{
+    return head->next == head;
+}
+
+static inline void timer_list_append(timer_node_t* head, timer_node_t* node)
+{
+    node->prev       = head->prev;
+    node->next       = head;
+    head->prev->next = node;
+    head->prev       = node;
+}
+
+/* Moves all the nodes of src at the end of dst. */
+static inline void timer_list_splice(timer_node_t* dst, timer_node_t* src)
+{
+    if(timer_list_empty(src)) return;
+    src->next->prev = dst->prev;
+    dst->prev->next = src->next;
+    src->prev->next = dst;
+    dst->prev       = src->prev;
+    timer_list_init(src);
+}
+
+static inline int timer_node_linked(const timer_node_t* node)
+{
+    return node->prev != NULL;
+}
+
+static inline void timer_node_unlink(timer_node_t* node)
+{
+    if(!node->prev) return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+static inline void timer_wheel_init(timer_wheel_t* wheel, uint64_t now)
+{
+    wheel->now = now;
+    for(int l = 0; l < TIMER_WHEEL_LEVELS; ++l)
+        for(int s = 0; s < TIMER_WHEEL_SLOTS; ++s)
+            timer_list_init(&wheel->slots[l][s]);
+}
+
+/* Puts a timer in the slot matching its expiry tick, which must not be
+ * in the past. */
+static inline void timer_wheel_place(timer_wheel_t* wheel, timer_node_t* node)
+{
+    uint64_t delta = node->expires - wheel->now;
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1
+       && delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+        ++level;
+    size_t slot = (node->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer_list_append(&wheel->slots[level][slot], node);
+}
+
+/* Adds a timer expiring at the given tick, or at the next tick if that
+ * one has already passed. */
+static inline void timer_wheel_add(timer_wheel_t* wheel, timer_node_t* node, uint64_t expires)
+{
+    if(expires <= wheel->now) expires = wheel->now + 1;
+    if(expires - wheel->now >= TIMER_WHEEL_SPAN) expires = wheel->now + TIMER_WHEEL_SPAN - 1;
+    node->expires = expires;
+    timer_wheel_place(wheel, node);
+}
+
+/* Advances the wheel by one tick and moves the timers expiring at this
+ * tick to the (initialized) list due. */
+static inline void timer_wheel_advance(timer_wheel_t* wheel, timer_node_t* due)
+{
+    wheel->now += 1;
+
+    // find the highest level that has a slot to cascade at this tick
+    int top = 0;
+    while(top < TIMER_WHEEL_LEVELS - 1
+       && (wheel->now & (((uint64_t)1 << (TIMER_WHEEL_BITS * (top + 1))) - 1)) == 0)
+        ++top;
+
+    // cascade from the top down, so that timers land in slots that are
+    // themselves cascaded afterwards if needed
+    for(int level = top; level > 0; --level) {
+        timer_node_t pending;
+        timer_list_init(&pending);
+        size_t slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        timer_list_splice(&pending, &wheel->slots[level][slot]);
+        while(!timer_list_empty(&pending)) {
+            timer_node_t* node = pending.next;
+            timer_node_unlink(node);
+            timer_wheel_place(wheel, node); // may be the slot emptied below
+        }
+    }
+
+    timer_list_splice(due, &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK]);
+}
+
+#endif
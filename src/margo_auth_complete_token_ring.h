@@ -0,0 +1,132 @@
+#ifndef MARGO_AUTH_COMPLETE_TOKEN_RING_H
+#define MARGO_AUTH_COMPLETE_TOKEN_RING_H
+
+#include <margo.h>
+#include "margo_auth_complete_types.h"
+
+/* Sequence numbers of a connection are predictable, so the part of a
+ * token's tag that does not depend on the RPC arguments (cloning the
+ * pre-keyed state and absorbing the session ID and sequence number, see
+ * prepare_tag) can be computed ahead of time. A token_ring_t keeps such
+ * prepared contexts for the next `depth` sequence numbers and a ULT
+ * refills it, yielding between each context, while the client waits
+ * for responses. Sending an RPC then only hashes its arguments and
+ * finalizes the tag. If the context for a sequence number is not ready
+ * (or was already used by a failed RPC), token_ring_take returns NULL
+ * and the tag is computed entirely when the token is signed. */
+
+typedef struct {
+    EVP_MAC_CTX* ctx;
+    uint64_t     seq_no;
+} prepared_slot_t;
+
+typedef struct {
+    const mac_t*     mac;
+    session_id_t     session_id;
+    size_t           depth;
+    prepared_slot_t* slots;       /* slot of seq_no is slots[seq_no % depth] */
+    uint64_t         next_seq_no; /* lowest sequence number still useful */
+    ABT_mutex_memory mtx;
+    ABT_cond_memory  cond;        /* signaled when a slot can be refilled */
+    int              stop;
+    ABT_thread       ult;
+} token_ring_t;
+
+static inline void token_ring_ult(void* arg)
+{
+    token_ring_t* ring = (token_ring_t*)arg;
+    ABT_mutex mtx      = ABT_MUTEX_MEMORY_GET_HANDLE(&ring->mtx);
+
+    ABT_mutex_lock(mtx);
+    while(!ring->stop) {
+        // find the first sequence number that has no context ready
+        uint64_t seq_no = ring->next_seq_no;
+        prepared_slot_t* slot = NULL;
+        for(size_t i = 0; i < ring->depth; ++i, ++seq_no) {
+            prepared_slot_t* s = &ring->slots[seq_no % ring->depth];
+            if(s->ctx && s->seq_no == seq_no) continue;
+            slot = s;
+            break;
+        }
+        if(!slot) {
+            ABT_cond_wait(ABT_COND_MEMORY_GET_HANDLE(&ring->cond), mtx);
+            continue;
+        }
+
+        // prepare its context without holding the lock
+        ABT_mutex_unlock(mtx);
+        EVP_MAC_CTX* ctx = prepare_tag(ring->mac, ring->session_id, seq_no);
+        ABT_mutex_lock(mtx);
+
+        if(ctx && seq_no >= ring->next_seq_no) {
+            EVP_MAC_CTX_free(slot->ctx); // context of an older sequence number
+            slot->ctx    = ctx;
+            slot->seq_no = seq_no;
+        } else {
+            EVP_MAC_CTX_free(ctx);
+        }
+
+        // let the RPCs of the client go first
+        ABT_mutex_unlock(mtx);
+        ABT_thread_yield();
+        ABT_mutex_lock(mtx);
+    }
+    ABT_mutex_unlock(mtx);
+}
+
+static inline int token_ring_start(token_ring_t* ring, margo_instance_id mid,
+                                   const mac_t* mac, session_id_t session_id,
+                                   uint64_t first_seq_no, size_t depth)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->mac         = mac;
+    ring->session_id  = session_id;
+    ring->depth       = depth;
+    ring->next_seq_no = first_seq_no;
+    ring->slots       = (prepared_slot_t*)calloc(depth, sizeof(*ring->slots));
+    if(!ring->slots) return -1;
+
+    ABT_pool pool = ABT_POOL_NULL;
+    margo_get_handler_pool(mid, &pool);
+    if(ABT_thread_create(pool, token_ring_ult, ring,
+                         ABT_THREAD_ATTR_NULL, &ring->ult) != ABT_SUCCESS) {
+        free(ring->slots);
+        ring->slots = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns the prepared context for this sequence number, which the
+ * caller now owns, or NULL if it is not ready. */
+static inline EVP_MAC_CTX* token_ring_take(token_ring_t* ring, uint64_t seq_no)
+{
+    EVP_MAC_CTX* ctx = NULL;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&ring->mtx));
+    prepared_slot_t* slot = &ring->slots[seq_no % ring->depth];
+    if(slot->ctx && slot->seq_no == seq_no) {
+        ctx       = slot->ctx;
+        slot->ctx = NULL;
+    }
+    if(seq_no + 1 > ring->next_seq_no) ring->next_seq_no = seq_no + 1;
+    ABT_cond_signal(ABT_COND_MEMORY_GET_HANDLE(&ring->cond));
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&ring->mtx));
+    return ctx;
+}
+
+static inline void token_ring_stop(token_ring_t* ring)
+{
+    if(!ring->slots) return;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&ring->mtx));
+    ring->stop = 1;
+    ABT_cond_signal(ABT_COND_MEMORY_GET_HANDLE(&ring->cond));
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&ring->mtx));
+    ABT_thread_join(ring->ult);
+    ABT_thread_free(&ring->ult);
+    for(size_t i = 0; i < ring->depth; ++i)
+        EVP_MAC_CTX_free(ring->slots[i].ctx);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+#endif
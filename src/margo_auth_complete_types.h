@@ -5,57 +5,830 @@
 #include <mercury_macros.h>
 #include <mercury_proc_string.h>
 #include <stdlib.h>
-#include <openssl/hmac.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
 #include <openssl/crypto.h>
+#include <openssl/kdf.h>
+#include "margo_auth_complete_hmac_x8.h"
 
 typedef uint64_t session_id_t;
 #define hg_proc_session_id_t hg_proc_uint64_t
 
+/* Tokens are sent in a compact, versioned encoding:
+ *
+ *   version (1 byte) | tag_len (1 byte) | session_id (varint)
+ *   | seq_no (varint) | tag (tag_len bytes)
+ *
+ * where varints are unsigned LEB128 and the tag is the MAC of the
+ * (session_id, seq_no) pair and of the digest of the RPC arguments
+ * (see hg_proc_args_field below), truncated to tag_len bytes. The tag length
+ * is chosen by the client at authentication and recorded in the session,
+ * so a token only carries as many tag bytes as the session requires
+ * instead of a fixed EVP_MAX_MD_SIZE.
+ *
+ * When the server issues tickets (see margo_auth_complete_tickets.h),
+ * tokens use version 2 of the encoding, in which the session ID is
+ * replaced by the ticket, the server reading the session ID from it:
+ *
+ *   version (1 byte) | tag_len (1 byte) | ticket_len (1 byte)
+ *   | ticket (ticket_len bytes) | seq_no (varint) | tag (tag_len bytes)
+ *
+ * The arguments of authenticated RPCs start with a byte telling whether
+ * they are sealed (see hg_proc_authenticated_args below). */
+#define TOKEN_WIRE_VERSION        1
+#define TOKEN_WIRE_VERSION_TICKET 2
+#define TICKET_MAX_SIZE           128
+#define TOKEN_MIN_TAG_LEN       8
+#define TOKEN_DEFAULT_TAG_LEN   16
+#define ARGS_DIGEST_SIZE        32
+
+/* MAC algorithms a client can propose when authenticating. The token
+ * header is only 16 bytes, so the cost of a MAC is dominated by its
+ * setup and finalization rather than by its throughput, and the cheaper
+ * algorithms below trade security margin for latency:
+ * - HMAC-SHA-512 and HMAC-SHA-256 are the conservative choices;
+ * - BLAKE2s in keyed mode is a single-pass MAC with a 256-bit tag;
+ * - SipHash-2-4 is a short-input PRF producing a 128-bit tag, and only
+ *   uses the first 16 bytes of the session key.
+ * Poly1305 is deliberately not offered: it is a one-time authenticator
+ * whose key must never be used for more than one message, which does
+ * not fit a session key used for every RPC. */
+typedef enum {
+    MAC_HMAC_SHA512 = 0,
+    MAC_HMAC_SHA256 = 1,
+    MAC_BLAKE2S     = 2,
+    MAC_SIPHASH     = 3,
+    MAC_ALG_COUNT
+} mac_alg_t;
+
+typedef struct {
+    const char* name;    // name used on command lines
+    const char* mac;     // OpenSSL EVP_MAC name
+    const char* digest;  // digest for HMAC, NULL otherwise
+    size_t      key_len; // maximum number of key bytes the MAC uses
+} mac_alg_info_t;
+
+static const mac_alg_info_t mac_algs[MAC_ALG_COUNT] = {
+    [MAC_HMAC_SHA512] = { "hmac-sha512", "HMAC",       "SHA512", 32 },
+    [MAC_HMAC_SHA256] = { "hmac-sha256", "HMAC",       "SHA256", 32 },
+    [MAC_BLAKE2S]     = { "blake2s",     "BLAKE2SMAC", NULL,     32 },
+    [MAC_SIPHASH]     = { "siphash",     "SIPHASH",    NULL,     16 },
+};
+
+static inline int mac_alg_from_name(const char* name, mac_alg_t* alg)
+{
+    for(int i = 0; i < MAC_ALG_COUNT; ++i) {
+        if(strcmp(mac_algs[i].name, name) == 0) {
+            *alg = (mac_alg_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* A mac_t holds a MAC state that has already been keyed. Keying HMAC
+ * (deriving the ipad/opad blocks from the key) costs more than hashing
+ * the 16 bytes of a token header, so it is done once when the session
+ * is established and each token then starts from a copy of this state.
+ * For HMAC-SHA-256, the midstates of the key are also kept for the
+ * multi-buffer kernel of the verifier (see margo_auth_complete_hmac_x8.h). */
 typedef struct {
-    session_id_t  session_id;            // session ID
-    uint64_t      seq_no;                // sequence number
-    unsigned char hmac[EVP_MAX_MD_SIZE]; // HMAC of the above two fields
+    EVP_MAC_CTX*   ctx;
+    mac_alg_t      alg;
+    uint8_t        tag_len; // number of bytes of MAC kept in tokens
+    hmac_x8_key_t* x8;      // midstates of the key, HMAC-SHA-256 only
+} mac_t;
+
+static inline int mac_init(mac_t* mac, mac_alg_t alg, uint8_t tag_len,
+                           const unsigned char* key, size_t key_len)
+{
+    if((unsigned)alg >= MAC_ALG_COUNT) return -1;
+    if(tag_len < TOKEN_MIN_TAG_LEN) return -1;
+    const mac_alg_info_t* info = &mac_algs[alg];
+    if(key_len > info->key_len) key_len = info->key_len;
+
+    mac->x8 = NULL;
+    EVP_MAC* evp_mac = EVP_MAC_fetch(NULL, info->mac, NULL);
+    if(!evp_mac) return -1;
+    mac->ctx = EVP_MAC_CTX_new(evp_mac);
+    mac->alg = alg;
+    EVP_MAC_free(evp_mac); // the context keeps its own reference
+    if(!mac->ctx) return -1;
+
+    OSSL_PARAM params[2] = { OSSL_PARAM_END, OSSL_PARAM_END };
+    if(info->digest)
+        params[0] = OSSL_PARAM_construct_utf8_string(
+            OSSL_MAC_PARAM_DIGEST, (char*)info->digest, 0);
+    if(EVP_MAC_init(mac->ctx, key, key_len, params) != 1
+    || tag_len > EVP_MAC_CTX_get_mac_size(mac->ctx)) {
+        EVP_MAC_CTX_free(mac->ctx);
+        mac->ctx = NULL;
+        return -1;
+    }
+    mac->tag_len = tag_len;
+    if(alg == MAC_HMAC_SHA256) {
+        mac->x8 = (hmac_x8_key_t*)malloc(sizeof(*mac->x8));
+        if(!mac->x8 || hmac_x8_key_init(mac->x8, key, key_len) != 0) {
+            free(mac->x8);
+            mac->x8 = NULL;
+            EVP_MAC_CTX_free(mac->ctx);
+            mac->ctx = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void mac_destroy(mac_t* mac)
+{
+    EVP_MAC_CTX_free(mac->ctx);
+    mac->ctx = NULL;
+    if(mac->x8) OPENSSL_cleanse(mac->x8, sizeof(*mac->x8));
+    free(mac->x8);
+    mac->x8 = NULL;
+}
+
+/* AEAD algorithms a client can ask for to seal (encrypt and
+ * authenticate) the arguments of its RPCs and their responses. The AEAD
+ * key is derived from the session key with HKDF-SHA-256, so that the
+ * session key is never used by both the MAC and the cipher. AES-256-GCM
+ * is the fastest on CPUs with AES and carry-less multiplication
+ * instructions, which OpenSSL uses when available; ChaCha20-Poly1305 is
+ * the better choice on CPUs without them. */
+typedef enum {
+    AEAD_NONE              = 0,
+    AEAD_AES_256_GCM       = 1,
+    AEAD_CHACHA20_POLY1305 = 2,
+    AEAD_ALG_COUNT
+} aead_alg_t;
+
+static const char* const aead_alg_names[AEAD_ALG_COUNT] = {
+    [AEAD_NONE]              = "none",
+    [AEAD_AES_256_GCM]       = "aes-256-gcm",
+    [AEAD_CHACHA20_POLY1305] = "chacha20-poly1305",
+};
+
+static const char* const aead_cipher_names[AEAD_ALG_COUNT] = {
+    [AEAD_NONE]              = NULL,
+    [AEAD_AES_256_GCM]       = "AES-256-GCM",
+    [AEAD_CHACHA20_POLY1305] = "ChaCha20-Poly1305",
+};
+
+#define AEAD_KEY_SIZE   32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE   16
+
+/* Messages are sealed with a nonce made of their direction and of a
+ * 64-bit counter, so requests and responses never share a nonce. */
+#define AEAD_DIRECTION_REQUEST  0
+#define AEAD_DIRECTION_RESPONSE 1
+
+static inline int aead_alg_from_name(const char* name, aead_alg_t* alg)
+{
+    for(int i = 0; i < AEAD_ALG_COUNT; ++i) {
+        if(strcmp(aead_alg_names[i], name) == 0) {
+            *alg = (aead_alg_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    aead_alg_t    alg;
+    unsigned char key[AEAD_KEY_SIZE];
+} aead_t;
+
+/* Returns the cipher implementing an AEAD algorithm. Looking it up by
+ * name for every message would cost as much as sealing a small message,
+ * so it is fetched once and kept for the lifetime of the process. */
+static inline EVP_CIPHER* aead_cipher(aead_alg_t alg)
+{
+    static _Atomic(EVP_CIPHER*) ciphers[AEAD_ALG_COUNT];
+    if((unsigned)alg >= AEAD_ALG_COUNT || !aead_cipher_names[alg]) return NULL;
+    EVP_CIPHER* cipher = atomic_load(&ciphers[alg]);
+    if(cipher) return cipher;
+    cipher = EVP_CIPHER_fetch(NULL, aead_cipher_names[alg], NULL);
+    EVP_CIPHER* expected = NULL;
+    if(cipher && !atomic_compare_exchange_strong(&ciphers[alg], &expected, cipher)) {
+        EVP_CIPHER_free(cipher); // another thread fetched it first
+        cipher = expected;
+    }
+    return cipher;
+}
+
+/* Derives out_len bytes from a key with HKDF-SHA256. */
+static inline int hkdf_sha256(const unsigned char* key, size_t key_len,
+                              const void* info, size_t info_len,
+                              unsigned char* out, size_t out_len)
+{
+    EVP_KDF* kdf = EVP_KDF_fetch(NULL, "HKDF", NULL);
+    if(!kdf) return -1;
+    EVP_KDF_CTX* kctx = EVP_KDF_CTX_new(kdf);
+    EVP_KDF_free(kdf); // the context keeps its own reference
+    if(!kctx) return -1;
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void*)key, key_len),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, (void*)info, info_len),
+        OSSL_PARAM_END
+    };
+    int ret = EVP_KDF_derive(kctx, out, out_len, params) == 1 ? 0 : -1;
+    EVP_KDF_CTX_free(kctx);
+    return ret;
+}
+
+static inline int aead_init(aead_t* aead, aead_alg_t alg,
+                            const unsigned char* session_key, size_t key_len)
+{
+    static const char info[] = "margo-auth aead key";
+
+    aead->alg = AEAD_NONE;
+    if((unsigned)alg >= AEAD_ALG_COUNT) return -1;
+    if(alg == AEAD_NONE) return 0;
+    if(!aead_cipher(alg)) return -1; // not provided by this OpenSSL
+
+    if(hkdf_sha256(session_key, key_len, info, sizeof(info) - 1,
+                   aead->key, sizeof(aead->key)) != 0) return -1;
+    aead->alg = alg;
+    return 0;
+}
+
+/* Derives the key a session uses with another server than the one it was
+ * opened with, bound to that server's address so that the tokens sent to
+ * one server are worthless to the others. */
+static inline int session_key_for_server(const unsigned char key[32], const char* address,
+                                         unsigned char server_key[32])
+{
+    static const char prefix[] = "margo-auth server key:";
+    size_t addr_len = strlen(address);
+    char*  info     = (char*)malloc(sizeof(prefix) - 1 + addr_len);
+    if(!info) return -1;
+    memcpy(info, prefix, sizeof(prefix) - 1);
+    memcpy(info + sizeof(prefix) - 1, address, addr_len);
+    int ret = hkdf_sha256(key, 32, info, sizeof(prefix) - 1 + addr_len, server_key, 32);
+    free(info);
+    return ret;
+}
+
+static inline void aead_destroy(aead_t* aead)
+{
+    OPENSSL_cleanse(aead->key, sizeof(aead->key));
+    aead->alg = AEAD_NONE;
+}
+
+/* Encrypts (or decrypts) len bytes of buf in place, authenticating them
+ * along with the associated data. When encrypting, the authentication
+ * tag is written to tag; when decrypting, it is read from tag and -1 is
+ * returned if it does not match, in which case buf holds garbage. */
+static inline int aead_crypt(const aead_t* aead, int encrypt,
+                             uint32_t direction, uint64_t counter,
+                             const unsigned char* aad, size_t aad_len,
+                             unsigned char* buf, size_t len,
+                             unsigned char* tag)
+{
+    int ret = -1, outl = 0;
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    EVP_CIPHER_CTX* ctx = NULL;
+    EVP_CIPHER* cipher = aead_cipher(aead->alg);
+
+    if(!cipher) return -1;
+    memcpy(nonce, &direction, sizeof(direction));
+    memcpy(nonce + sizeof(direction), &counter, sizeof(counter));
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(!ctx) return -1;
+    if(EVP_CipherInit_ex(ctx, cipher, NULL, aead->key, nonce, encrypt) != 1) goto finish;
+    if(!encrypt && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE, tag) != 1)
+        goto finish;
+    if(EVP_CipherUpdate(ctx, NULL, &outl, aad, (int)aad_len) != 1) goto finish;
+    // both ciphers are stream ciphers, so the output is exactly as long as
+    // the input and can overwrite it
+    while(len) {
+        int chunk = len > (1u << 30) ? (1 << 30) : (int)len;
+        if(EVP_CipherUpdate(ctx, buf, &outl, buf, chunk) != 1) goto finish;
+        buf += chunk;
+        len -= chunk;
+    }
+    if(EVP_CipherFinal_ex(ctx, buf, &outl) != 1) goto finish; // tag mismatch
+    if(encrypt && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, tag) != 1)
+        goto finish;
+    ret = 0;
+
+finish:
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+
+/* Opaque ticket issued by a server in ticket mode or group mode, empty
+ * otherwise. */
+typedef struct {
+    uint8_t       len;
+    unsigned char data[TICKET_MAX_SIZE];
+} ticket_t;
+
+static inline hg_return_t hg_proc_ticket_t(hg_proc_t proc, ticket_t* ticket)
+{
+    hg_return_t hret = hg_proc_uint8_t(proc, &ticket->len);
+    if(hret != HG_SUCCESS) return hret;
+    if(ticket->len > sizeof(ticket->data)) return HG_PROTOCOL_ERROR;
+    return hg_proc_memcpy(proc, ticket->data, ticket->len);
+}
+
+typedef struct token_t {
+    session_id_t  session_id;           // session ID
+    uint64_t      seq_no;               // sequence number
+    uint8_t       tag_len;              // number of bytes of tag sent
+    unsigned char tag[EVP_MAX_MD_SIZE]; // MAC of the above two fields and args_digest
+    // the following fields are not sent
+    unsigned char args_digest[ARGS_DIGEST_SIZE]; // digest of the RPC arguments
+    const mac_t*  mac;                           // MAC state used to sign the token
+    EVP_MAC_CTX*  prepared;                      // result of prepare_tag, if any
+    ticket_t      ticket;                        // sent instead of session_id if not empty
+    uint8_t       sealed;                        // whether the arguments are sealed
+    aead_t        aead;                          // AEAD state used to (un)seal them
+    uint64_t      aead_counter;                  // nonce counter chosen by the client
+    // called when decoding sealed arguments, to get the AEAD state of the
+    // token's session (returns 0 and fills aead if the session is found,
+    // and session_id if the token carries a group ticket)
+    int         (*aead_lookup)(void* arg, struct token_t* token);
+    void*         aead_lookup_arg;
 } token_t;
 
+static inline hg_return_t hg_proc_varint(hg_proc_t proc, uint64_t* value)
+{
+    hg_return_t hret = HG_SUCCESS;
+    uint8_t byte;
+    switch(hg_proc_get_op(proc)) {
+    case HG_ENCODE: {
+        uint64_t v = *value;
+        do {
+            byte = v & 0x7f;
+            v >>= 7;
+            if(v) byte |= 0x80;
+            hret = hg_proc_uint8_t(proc, &byte);
+        } while(v && hret == HG_SUCCESS);
+        return hret;
+    }
+    case HG_DECODE: {
+        uint64_t v = 0;
+        for(unsigned shift = 0; shift < 64; shift += 7) {
+            hret = hg_proc_uint8_t(proc, &byte);
+            if(hret != HG_SUCCESS) return hret;
+            // the 10th byte can only carry the most significant bit
+            if(shift == 63 && byte > 1) return HG_PROTOCOL_ERROR;
+            v |= (uint64_t)(byte & 0x7f) << shift;
+            if(!(byte & 0x80)) {
+                *value = v;
+                return HG_SUCCESS;
+            }
+        }
+        return HG_PROTOCOL_ERROR;
+    }
+    default:
+        return HG_SUCCESS;
+    }
+}
+
 static inline hg_return_t hg_proc_token_t(hg_proc_t proc, token_t *token)
 {
-    return hg_proc_memcpy(proc, token, sizeof(*token));
+    hg_return_t hret;
+    uint8_t version = token->ticket.len ? TOKEN_WIRE_VERSION_TICKET : TOKEN_WIRE_VERSION;
+
+    if(hg_proc_get_op(proc) == HG_FREE) return HG_SUCCESS;
+
+    hret = hg_proc_uint8_t(proc, &version);
+    if(hret != HG_SUCCESS) return hret;
+    if(version != TOKEN_WIRE_VERSION && version != TOKEN_WIRE_VERSION_TICKET)
+        return HG_PROTOCOL_ERROR;
+
+    hret = hg_proc_uint8_t(proc, &token->tag_len);
+    if(hret != HG_SUCCESS) return hret;
+    if(token->tag_len > sizeof(token->tag)) return HG_PROTOCOL_ERROR;
+
+    if(version == TOKEN_WIRE_VERSION_TICKET) {
+        hret = hg_proc_ticket_t(proc, &token->ticket);
+        if(hret == HG_SUCCESS && token->ticket.len == 0) hret = HG_PROTOCOL_ERROR;
+    } else {
+        token->ticket.len = 0;
+        hret = hg_proc_varint(proc, &token->session_id);
+    }
+    if(hret != HG_SUCCESS) return hret;
+    hret = hg_proc_varint(proc, &token->seq_no);
+    if(hret != HG_SUCCESS) return hret;
+
+    return hg_proc_memcpy(proc, token->tag, token->tag_len);
+}
+
+/* The tag is computed in two steps: prepare_tag clones the pre-keyed
+ * state and absorbs the (session_id, seq_no) header, which only depends
+ * on values known in advance, and finish_tag absorbs the digest of the
+ * arguments and produces the tag. finish_tag always frees the context. */
+static inline EVP_MAC_CTX* prepare_tag(const mac_t* mac,
+                                       session_id_t session_id,
+                                       uint64_t seq_no)
+{
+    uint64_t header[2] = { session_id, seq_no };
+
+    // clone the pre-keyed state so that concurrent RPCs can share the mac_t
+    EVP_MAC_CTX* ctx = EVP_MAC_CTX_dup(mac->ctx);
+    if(!ctx) return NULL;
+    if(EVP_MAC_update(ctx, (unsigned char *)header, sizeof(header)) != 1) {
+        EVP_MAC_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static inline int finish_tag(EVP_MAC_CTX* ctx,
+                             const mac_t* mac,
+                             const unsigned char* args_digest,
+                             unsigned char* tag)
+{
+    int ret = -1;
+    size_t len = 0;
+    unsigned char full_tag[EVP_MAX_MD_SIZE];
+
+    if(!ctx) return -1;
+    if(EVP_MAC_update(ctx, args_digest, ARGS_DIGEST_SIZE) != 1)
+        goto finish;
+    if(EVP_MAC_final(ctx, full_tag, &len, sizeof(full_tag)) != 1)
+        goto finish;
+    memcpy(tag, full_tag, mac->tag_len);
+    ret = 0;
+
+finish:
+    EVP_MAC_CTX_free(ctx);
+    return ret;
+}
+
+static inline int compute_tag(const mac_t* mac,
+                              session_id_t session_id,
+                              uint64_t seq_no,
+                              const unsigned char* args_digest,
+                              unsigned char* tag)
+{
+    return finish_tag(prepare_tag(mac, session_id, seq_no), mac, args_digest, tag);
 }
 
-static inline void create_token(token_t* token,
-                                session_id_t session_id,
-                                uint64_t seq_no,
-                                const char* key,
-                                size_t key_len)
+/* Prepares a token for an RPC. The tag is not computed here but by
+ * sign_token when the token is serialized, after the arguments it
+ * covers have been hashed. If the caller already has a context returned
+ * by prepare_tag for this session_id and seq_no, it can hand it over
+ * through the token's prepared field. */
+static inline int create_token(token_t* token,
+                               session_id_t session_id,
+                               uint64_t seq_no,
+                               const mac_t* mac)
 {
     token->session_id = session_id;
     token->seq_no = seq_no;
-    unsigned int len = 0;
-    HMAC(EVP_sha512(), key, key_len,
-         (unsigned char *)token, sizeof(token->session_id) + sizeof(token->seq_no),
-         token->hmac, &len);
-    for(unsigned i = len; i < EVP_MAX_MD_SIZE; ++i)
-        token->hmac[i] = 0;
+    token->tag_len = mac->tag_len;
+    token->mac = mac;
+    token->prepared = NULL;
+    token->ticket.len = 0;
+    token->sealed = 0;
+    token->aead.alg = AEAD_NONE;
+    token->aead_lookup = NULL;
+    return 0;
+}
+
+static inline int sign_token(token_t* token)
+{
+    if(!token->mac) return -1;
+    EVP_MAC_CTX* ctx = token->prepared;
+    token->prepared = NULL;
+    if(!ctx) ctx = prepare_tag(token->mac, token->session_id, token->seq_no);
+    return finish_tag(ctx, token->mac, token->args_digest, token->tag);
 }
 
-static inline int check_token(token_t* token,
+/* Releases the prepared context of a token that was never signed,
+ * and erases the copy of the AEAD key it may hold. */
+static inline void release_token(token_t* token)
+{
+    EVP_MAC_CTX_free(token->prepared);
+    token->prepared = NULL;
+    aead_destroy(&token->aead);
+}
+
+static inline int check_token(const token_t* token,
                               session_id_t session_id,
                               uint64_t seq_no,
-                              const char* key,
-                              size_t key_len)
+                              const mac_t* mac)
+{
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    if(token->tag_len != mac->tag_len) return -1;
+    if(compute_tag(mac, session_id, seq_no, token->args_digest, expected) != 0) return -1;
+    // only the tag_len bytes actually sent are compared, in constant time
+    return CRYPTO_memcmp(expected, token->tag, mac->tag_len) == 0 ? 0 : -1;
+}
+
+/* The arguments of authenticated RPCs are covered by the token's tag.
+ * Rather than serializing them twice or copying them, the proc of such
+ * RPCs passes each field through hg_proc_args_field, which feeds the
+ * bytes Mercury has just encoded (or decoded) into a running SHA-256
+ * digest. The token is processed last: when encoding, its tag is then
+ * computed over this digest; when decoding, the digest is stored in the
+ * token for check_token to verify once the session's key is known. */
+typedef struct {
+    EVP_MD_CTX* ctx;
+} args_hasher_t;
+
+static inline hg_return_t args_hasher_begin(hg_proc_t proc, args_hasher_t* hasher)
+{
+    hasher->ctx = NULL;
+    if(hg_proc_get_op(proc) == HG_FREE) return HG_SUCCESS;
+    hasher->ctx = EVP_MD_CTX_new();
+    if(!hasher->ctx) return HG_NOMEM;
+    if(EVP_DigestInit_ex(hasher->ctx, EVP_sha256(), NULL) != 1) return HG_OTHER_ERROR;
+    return HG_SUCCESS;
+}
+
+static inline void args_hasher_end(args_hasher_t* hasher)
 {
-    token_t expected = {0};
-    create_token(&expected, session_id, seq_no, key, key_len);
-    return CRYPTO_memcmp(&expected, token, sizeof(expected)) == 0 ? 0 : -1;
+    EVP_MD_CTX_free(hasher->ctx);
+    hasher->ctx = NULL;
 }
 
+static inline hg_return_t hg_proc_args_field(hg_proc_t proc, args_hasher_t* hasher,
+                                             hg_proc_cb_t proc_field, void* field)
+{
+    if(hg_proc_get_op(proc) == HG_FREE || !hasher) return proc_field(proc, field);
+
+    hg_size_t before = hg_proc_get_size_used(proc);
+    hg_return_t hret = proc_field(proc, field);
+    if(hret != HG_SUCCESS) return hret;
+    hg_size_t size = hg_proc_get_size_used(proc) - before;
+
+    // the field's bytes are contiguous right before the current position,
+    // even if Mercury switched to its extra buffer while processing it,
+    // since the content of the eager buffer is copied over when it does
+    const unsigned char* end = (const unsigned char*)hg_proc_save_ptr(proc, 0);
+    if(EVP_DigestUpdate(hasher->ctx, end - size, size) != 1) return HG_OTHER_ERROR;
+    return HG_SUCCESS;
+}
+
+static inline hg_return_t hg_proc_args_token(hg_proc_t proc, args_hasher_t* hasher, token_t* token)
+{
+    if(hg_proc_get_op(proc) == HG_FREE) return hg_proc_token_t(proc, token);
+
+    unsigned int len = 0;
+    if(EVP_DigestFinal_ex(hasher->ctx, token->args_digest, &len) != 1)
+        return HG_OTHER_ERROR;
+    if(hg_proc_get_op(proc) == HG_ENCODE && sign_token(token) != 0)
+        return HG_OTHER_ERROR;
+    return hg_proc_token_t(proc, token);
+}
+
+/* Sealed arguments
+ *
+ * When a session uses an AEAD algorithm, the fields of its RPCs' inputs
+ * and outputs are encrypted and authenticated in place, in Mercury's own
+ * buffer: the fields are serialized as usual, then the bytes they
+ * occupy are encrypted where they are, and the receiver decrypts them
+ * where they are before deserializing them. No intermediate buffer is
+ * allocated and the data is only touched once by the cipher. A sealed
+ * region is encoded as:
+ *
+ *   counter (varint) | len (4 bytes, little endian)
+ *   | encrypted fields (len bytes) | AEAD tag (16 bytes)
+ *
+ * The nonce is built from the direction of the message and the counter,
+ * and the (session_id, seq_no) pair of the RPC is the associated data,
+ * which binds the sealed fields to the token they were sent with. The
+ * token's own tag then does not need to cover the arguments, so they are
+ * not hashed. Mercury copies the content of its eager buffer into its
+ * extra buffer when it needs one, and decodes large inputs from the
+ * extra buffer only, so a sealed region is always contiguous. */
+
+typedef hg_return_t (*proc_fields_fn)(hg_proc_t proc, args_hasher_t* hasher, void* data);
+
+/* Information about a sealed region that is not sent but set by the
+ * caller before the structure is serialized or deserialized. */
+typedef struct {
+    const aead_t* aead;       // NULL if the region is not sealed
+    uint32_t      direction;  // AEAD_DIRECTION_REQUEST or AEAD_DIRECTION_RESPONSE
+    uint64_t      counter;    // nonce counter, only used when encoding
+    session_id_t  session_id; // associated data
+    uint64_t      seq_no;     // associated data
+} sealing_t;
+
+static inline hg_return_t hg_proc_sealed_fields(hg_proc_t proc, const sealing_t* sealing,
+                                                proc_fields_fn fields, void* data)
+{
+    hg_return_t    hret;
+    uint64_t       counter = sealing->counter;
+    uint64_t       aad[2]  = { sealing->session_id, sealing->seq_no };
+    unsigned char  len_buf[4] = {0};
+    unsigned char  tag[AEAD_TAG_SIZE];
+    unsigned char* region;
+    uint32_t       len;
+
+    switch(hg_proc_get_op(proc)) {
+    case HG_ENCODE: {
+        hret = hg_proc_varint(proc, &counter);
+        if(hret != HG_SUCCESS) return hret;
+        hg_size_t start = hg_proc_get_size_used(proc);
+        hret = hg_proc_memcpy(proc, len_buf, sizeof(len_buf)); // filled in below
+        if(hret != HG_SUCCESS) return hret;
+        hret = fields(proc, NULL, data);
+        if(hret != HG_SUCCESS) return hret;
+
+        hg_size_t size = hg_proc_get_size_used(proc) - start;
+        if(size - sizeof(len_buf) > UINT32_MAX) return HG_OVERFLOW;
+        len    = (uint32_t)(size - sizeof(len_buf));
+        region = (unsigned char*)hg_proc_save_ptr(proc, 0) - len;
+        for(int i = 0; i < 4; ++i) region[i - 4] = (unsigned char)(len >> (8 * i));
+        if(aead_crypt(sealing->aead, 1, sealing->direction, counter,
+                      (unsigned char*)aad, sizeof(aad), region, len, tag) != 0)
+            return HG_OTHER_ERROR;
+        return hg_proc_memcpy(proc, tag, sizeof(tag));
+    }
+    case HG_DECODE: {
+        hret = hg_proc_varint(proc, &counter);
+        if(hret != HG_SUCCESS) return hret;
+        hret = hg_proc_memcpy(proc, len_buf, sizeof(len_buf));
+        if(hret != HG_SUCCESS) return hret;
+        len = 0;
+        for(int i = 0; i < 4; ++i) len |= (uint32_t)len_buf[i] << (8 * i);
+        if((hg_size_t)len + AEAD_TAG_SIZE > hg_proc_get_size_left(proc)) return HG_OVERFLOW;
+
+        region = (unsigned char*)hg_proc_save_ptr(proc, 0);
+        memcpy(tag, region + len, sizeof(tag));
+        if(aead_crypt(sealing->aead, 0, sealing->direction, counter,
+                      (unsigned char*)aad, sizeof(aad), region, len, tag) != 0)
+            return HG_PROTOCOL_ERROR; // forged, corrupted, or replayed under another token
+
+        hg_size_t start = hg_proc_get_size_used(proc);
+        hret = fields(proc, NULL, data);
+        if(hret != HG_SUCCESS) return hret;
+        if(hg_proc_get_size_used(proc) - start != len) return HG_PROTOCOL_ERROR;
+        return hg_proc_memcpy(proc, tag, sizeof(tag));
+    }
+    default:
+        return fields(proc, NULL, data);
+    }
+}
+
+/* Moves past a sealed region that can't be opened while decoding, leaving
+ * its fields zeroed. */
+static inline hg_return_t hg_proc_skip_sealed_fields(hg_proc_t proc)
+{
+    uint64_t      counter;
+    unsigned char len_buf[4];
+    uint32_t      len = 0;
+
+    hg_return_t hret = hg_proc_varint(proc, &counter);
+    if(hret != HG_SUCCESS) return hret;
+    hret = hg_proc_memcpy(proc, len_buf, sizeof(len_buf));
+    if(hret != HG_SUCCESS) return hret;
+    for(int i = 0; i < 4; ++i) len |= (uint32_t)len_buf[i] << (8 * i);
+    if((hg_size_t)len + AEAD_TAG_SIZE > hg_proc_get_size_left(proc)) return HG_OVERFLOW;
+    hg_proc_save_ptr(proc, (hg_size_t)len + AEAD_TAG_SIZE);
+    return HG_SUCCESS;
+}
+
+/* Processes the arguments of an authenticated RPC, which start with a
+ * byte telling whether they are sealed. If not, the fields are hashed and
+ * followed by the token. If they are, the token comes first, so that the
+ * receiver knows which session's key opens the fields that follow. If no
+ * session can open them, they are skipped and token->aead is left unset,
+ * so that the handler can still tell the client why its RPC failed. */
+static inline hg_return_t hg_proc_authenticated_args(hg_proc_t proc, token_t* token,
+                                                     proc_fields_fn fields, void* data)
+{
+    hg_return_t   hret;
+    args_hasher_t hasher;
+
+    if(hg_proc_get_op(proc) == HG_FREE) {
+        aead_destroy(&token->aead);
+        return fields(proc, NULL, data);
+    }
+
+    hret = hg_proc_uint8_t(proc, &token->sealed);
+    if(hret != HG_SUCCESS) return hret;
+
+    if(!token->sealed) {
+        hret = args_hasher_begin(proc, &hasher);
+        if(hret == HG_SUCCESS)
+            hret = fields(proc, &hasher, data);
+        if(hret == HG_SUCCESS)
+            hret = hg_proc_args_token(proc, &hasher, token);
+        args_hasher_end(&hasher);
+        return hret;
+    }
+
+    // the sealed fields are covered by the AEAD tag instead
+    memset(token->args_digest, 0, sizeof(token->args_digest));
+    if(hg_proc_get_op(proc) == HG_ENCODE && sign_token(token) != 0)
+        return HG_OTHER_ERROR;
+    hret = hg_proc_token_t(proc, token);
+    if(hret != HG_SUCCESS) return hret;
+    if(hg_proc_get_op(proc) == HG_DECODE) {
+        // the sessions of ticket mode are not in the server's table and
+        // can't be sealed, the lookup refuses them
+        if(!token->aead_lookup || token->aead_lookup(token->aead_lookup_arg, token) != 0)
+            return hg_proc_skip_sealed_fields(proc);
+    }
+
+    sealing_t sealing = {
+        .aead       = &token->aead,
+        .direction  = AEAD_DIRECTION_REQUEST,
+        .counter    = token->aead_counter,
+        .session_id = token->session_id,
+        .seq_no     = token->seq_no
+    };
+    return hg_proc_sealed_fields(proc, &sealing, fields, data);
+}
+
+/* Processes the fields of a response, sealed if sealing->aead is set.
+ * The client sets it before margo_get_output when it expects a sealed
+ * response, and a response that is not sealed as expected is rejected,
+ * except an error: the server can't seal the response to an RPC whose
+ * session it no longer has, so errors are always sent unsealed, and *ret
+ * must then be nonzero. Forging one only makes the client fail an RPC,
+ * which dropping the response does as well. */
+static inline hg_return_t hg_proc_sealed_output(hg_proc_t proc, const sealing_t* sealing,
+                                                proc_fields_fn fields, void* data,
+                                                const int32_t* ret)
+{
+    uint8_t sealed = sealing->aead != NULL;
+    if(hg_proc_get_op(proc) == HG_FREE) return fields(proc, NULL, data);
+
+    hg_return_t hret = hg_proc_uint8_t(proc, &sealed);
+    if(hret != HG_SUCCESS) return hret;
+    if(sealed && !sealing->aead) return HG_PROTOCOL_ERROR;
+    if(!sealed) {
+        hret = fields(proc, NULL, data);
+        if(hret == HG_SUCCESS && sealing->aead && *ret == 0) return HG_PROTOCOL_ERROR;
+        return hret;
+    }
+    return hg_proc_sealed_fields(proc, sealing, fields, data);
+}
+
+/* Values of the ret field of the outputs other than 0 (success) and -1
+ * (any other error). */
+#define RPC_ERR_SESSION_EVICTED -2 /* the session was evicted, authenticate again */
+#define RPC_ERR_RETRY_AFTER     -3 /* the server is busy, authenticate again after retry_after ms */
+
 MERCURY_GEN_PROC(auth_in_t, ((hg_string_t)(credential)))
-MERCURY_GEN_PROC(auth_out_t, ((session_id_t)(session_id))((int32_t)(ret)))
+MERCURY_GEN_PROC(auth_out_t, ((session_id_t)(session_id))((ticket_t)(ticket))((uint8_t)(group))((int32_t)(ret))((uint32_t)(retry_after)))
+
+typedef struct {
+    token_t     token;
+    hg_string_t name;
+} hello_in_t;
+
+static inline hg_return_t hello_in_fields(hg_proc_t proc, args_hasher_t* hasher, void* data)
+{
+    hello_in_t* in = (hello_in_t*)data;
+    return hg_proc_args_field(proc, hasher, hg_proc_hg_string_t, &in->name);
+}
+
+static inline hg_return_t hg_proc_hello_in_t(hg_proc_t proc, void* data)
+{
+    hello_in_t* in = (hello_in_t*)data;
+    return hg_proc_authenticated_args(proc, &in->token, hello_in_fields, in);
+}
+
+typedef struct {
+    sealing_t sealing; // not sent
+    int32_t   ret;
+} hello_out_t;
 
-MERCURY_GEN_PROC(hello_in_t, ((token_t)(token))((hg_string_t)(name)))
-MERCURY_GEN_PROC(hello_out_t, ((int32_t)(ret)))
+static inline hg_return_t hello_out_fields(hg_proc_t proc, args_hasher_t* hasher, void* data)
+{
+    hello_out_t* out = (hello_out_t*)data;
+    return hg_proc_args_field(proc, hasher, hg_proc_int32_t, &out->ret);
+}
+
+static inline hg_return_t hg_proc_hello_out_t(hg_proc_t proc, void* data)
+{
+    hello_out_t* out = (hello_out_t*)data;
+    return hg_proc_sealed_output(proc, &out->sealing, hello_out_fields, out, &out->ret);
+}
+
+typedef struct {
+    token_t token;
+} close_in_t;
+
+static inline hg_return_t close_in_fields(hg_proc_t proc, args_hasher_t* hasher, void* data)
+{
+    (void)proc;
+    (void)hasher;
+    (void)data;
+    return HG_SUCCESS;
+}
+
+static inline hg_return_t hg_proc_close_in_t(hg_proc_t proc, void* data)
+{
+    close_in_t* in = (close_in_t*)data;
+    return hg_proc_authenticated_args(proc, &in->token, close_in_fields, in);
+}
 
-MERCURY_GEN_PROC(close_in_t, ((token_t)(token)))
 MERCURY_GEN_PROC(close_out_t, ((int32_t)(ret)))
 
 #endif
@@ -0,0 +1,168 @@
+#ifndef MARGO_AUTH_COMPLETE_VERIFIER_H
+#define MARGO_AUTH_COMPLETE_VERIFIER_H
+
+#include <margo.h>
+#include <time.h>
+#include "margo_auth_complete_types.h"
+#include "margo_auth_complete_hmac_x8.h"
+
+/* The verifier collects the tokens that handler ULTs need checked and
+ * verifies them in batches. The handler whose token opens a batch leads
+ * it: it waits until batch_size tokens are pending or until its token
+ * has waited for window seconds, whichever comes first, takes the batch,
+ * verifies it in its own ULT, and wakes up the other handlers of the
+ * batch. Handlers arriving in the meantime open the next batch, so
+ * several batches can be verified at once by the execution streams of
+ * the handler pool, and no single ULT serializes the checks.
+ *
+ * The HMAC-SHA-256 tokens of a batch are verified eight at a time by the
+ * multi-buffer kernel of margo_auth_complete_hmac_x8.h, if the CPU has
+ * AVX2, and the other tokens one after the other by check_token. The
+ * wire format is not affected. With a batch_size of 0, verifier_check
+ * simply calls check_token in the calling ULT. */
+
+typedef struct verify_request_t {
+    const token_t*           token;
+    session_id_t             session_id;
+    uint64_t                 seq_no;
+    const mac_t*             mac;
+    int                      result;
+    int                      done;
+    struct verify_request_t* next;
+} verify_request_t;
+
+typedef struct {
+    size_t            batch_size;
+    double            window;
+    int               use_x8;       /* whether the CPU can run the kernel */
+    ABT_mutex_memory  mtx;
+    ABT_cond_memory   full_cond;    /* signaled when the open batch is full */
+    ABT_cond_memory   done_cond;    /* broadcast when a batch is verified */
+    verify_request_t* head;         /* open batch */
+    verify_request_t* tail;
+    size_t            num_pending;
+    int               stop;
+} verifier_t;
+
+/* Verifies the HMAC-SHA-256 tokens of a batch with the multi-buffer
+ * kernel, up to HMAC_X8_LANES at a time, and the others with check_token. */
+static inline void verify_batch(const verifier_t* verifier, verify_request_t* batch)
+{
+    verify_request_t* lanes[HMAC_X8_LANES];
+    hmac_x8_job_t     jobs[HMAC_X8_LANES];
+    unsigned char     messages[HMAC_X8_LANES][HMAC_X8_MESSAGE_SIZE];
+    unsigned char     tags[HMAC_X8_LANES][HMAC_X8_TAG_SIZE];
+    size_t            n = 0;
+
+    for(verify_request_t* req = batch; req; req = req->next) {
+        const token_t* token = req->token;
+        if(!verifier->use_x8 || !req->mac->x8 || token->tag_len != req->mac->tag_len) {
+            req->result = check_token(token, req->session_id, req->seq_no, req->mac);
+        } else {
+            uint64_t header[2] = { req->session_id, req->seq_no };
+            memcpy(messages[n], header, sizeof(header));
+            memcpy(messages[n] + sizeof(header), token->args_digest, ARGS_DIGEST_SIZE);
+            jobs[n]    = (hmac_x8_job_t){ req->mac->x8, messages[n], tags[n] };
+            lanes[n++] = req;
+        }
+        if(n == HMAC_X8_LANES || (!req->next && n > 0)) {
+            hmac_x8_tags(jobs, n);
+            // only the tag_len bytes actually sent are compared, in constant time
+            for(size_t i = 0; i < n; ++i)
+                lanes[i]->result = CRYPTO_memcmp(tags[i], lanes[i]->token->tag,
+                                                 lanes[i]->mac->tag_len) == 0 ? 0 : -1;
+            n = 0;
+        }
+    }
+    OPENSSL_cleanse(tags, sizeof(tags));
+}
+
+static inline int verifier_start(verifier_t* verifier, size_t batch_size, double window)
+{
+    verifier->batch_size = batch_size;
+    verifier->window     = window;
+    verifier->use_x8     = hmac_x8_available();
+    return 0;
+}
+
+/* Refuses new tokens and flushes the open batch. Batches being verified
+ * are still completed by their leaders. */
+static inline void verifier_stop(verifier_t* verifier)
+{
+    if(verifier->batch_size == 0) return;
+    ABT_mutex_lock(ABT_MUTEX_MEMORY_GET_HANDLE(&verifier->mtx));
+    verifier->stop = 1;
+    ABT_cond_signal(ABT_COND_MEMORY_GET_HANDLE(&verifier->full_cond));
+    ABT_mutex_unlock(ABT_MUTEX_MEMORY_GET_HANDLE(&verifier->mtx));
+}
+
+/* Checks the token against the given MAC state, blocking the calling
+ * ULT until the batch it was added to has been verified. Returns 0 if
+ * the token is valid, -1 otherwise. */
+static inline int verifier_check(verifier_t* verifier,
+                                 const token_t* token,
+                                 session_id_t session_id,
+                                 uint64_t seq_no,
+                                 const mac_t* mac)
+{
+    if(verifier->batch_size == 0)
+        return check_token(token, session_id, seq_no, mac);
+
+    verify_request_t req = {
+        .token = token, .session_id = session_id, .seq_no = seq_no,
+        .mac = mac, .result = -1, .done = 0, .next = NULL
+    };
+    ABT_mutex mtx  = ABT_MUTEX_MEMORY_GET_HANDLE(&verifier->mtx);
+    ABT_cond  full = ABT_COND_MEMORY_GET_HANDLE(&verifier->full_cond);
+    ABT_cond  done = ABT_COND_MEMORY_GET_HANDLE(&verifier->done_cond);
+
+    ABT_mutex_lock(mtx);
+    if(verifier->stop) {
+        ABT_mutex_unlock(mtx);
+        return -1;
+    }
+    if(verifier->tail) verifier->tail->next = &req;
+    else verifier->head = &req;
+    verifier->tail = &req;
+    verifier->num_pending += 1;
+
+    if(verifier->head != &req) {
+        // wait for the leader of the batch
+        if(verifier->num_pending >= verifier->batch_size) ABT_cond_signal(full);
+        while(!req.done) ABT_cond_wait(done, mtx);
+        ABT_mutex_unlock(mtx);
+        return req.result;
+    }
+
+    // lead the batch: give it some time to fill up
+    if(verifier->num_pending < verifier->batch_size && !verifier->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        long nsec = deadline.tv_nsec + (long)(verifier->window * 1e9);
+        deadline.tv_sec  += nsec / 1000000000L;
+        deadline.tv_nsec  = nsec % 1000000000L;
+        while(verifier->num_pending < verifier->batch_size && !verifier->stop) {
+            if(ABT_cond_timedwait(full, mtx, &deadline) != ABT_SUCCESS) break;
+        }
+    }
+
+    // close the batch and verify it without holding the lock
+    verify_request_t* batch = verifier->head;
+    verifier->head = verifier->tail = NULL;
+    verifier->num_pending = 0;
+    ABT_mutex_unlock(mtx);
+
+    verify_batch(verifier, batch);
+
+    // the other handlers can't return before the lock is released, so
+    // their requests are still valid
+    ABT_mutex_lock(mtx);
+    for(verify_request_t* r = batch; r; r = r->next)
+        r->done = 1;
+    ABT_cond_broadcast(done);
+    ABT_mutex_unlock(mtx);
+
+    return req.result;
+}
+
+#endif
@@ -99,8 +99,7 @@ void authenticate(hg_handle_t handle)
     ASSERT(key_len == 32,
            "Key length is expected to be 32\n");
 
-    struct passwd *pws = getpwuid(uid);
-    printf("Authenticated with uid=%d (%s) and gid=%d\n", uid, pws->pw_name, gid);
+    printf("Authenticated with uid=%d (%s) and gid=%d\n", uid, user_name(uid), gid);
 
     memcpy(server->client.key, key, 32);
     server->client.uid = (uint64_t)uid;
@@ -141,7 +140,7 @@ void hello(hg_handle_t handle)
 
     if(ret == 0) {
         server->client.seq_no += 1;
-        printf("Hello %s (username %s)\n", in.name, getpwuid(in.token.uid)->pw_name);
+        printf("Hello %s (username %s)\n", in.name, user_name(in.token.uid));
     } else {
         printf("Unauthorized attempt to call the hello RPC\n");
     }
@@ -107,8 +107,7 @@ void authenticate(hg_handle_t handle)
            "Error generating random session ID\n");
     ret = 0;
 
-    struct passwd *pws = getpwuid(uid);
-    printf("Authenticated with uid=%d (%s) and gid=%d\n", uid, pws->pw_name, gid);
+    printf("Authenticated with uid=%d (%s) and gid=%d\n", uid, user_name(uid), gid);
 
     memcpy(server->client.key, key, 32);
     server->client.uid        = (uint64_t)uid;
@@ -150,7 +149,7 @@ void hello(hg_handle_t handle)
 
     if(ret == 0) {
         server->client.seq_no += 1;
-        printf("Hello %s (username %s)\n", in.name, getpwuid(server->client.uid)->pw_name);
+        printf("Hello %s (username %s)\n", in.name, user_name(server->client.uid));
     } else {
         printf("Unauthorized attempt to call the hello RPC\n");
     }
@@ -72,8 +72,7 @@ void authenticate(hg_handle_t handle)
     ASSERT(err == 0,
            "Failed to decode credential\n");
 
-    struct passwd *pws = getpwuid(uid);
-    printf("Authendicated with uid=%d (%s) and gid=%d\n", uid, pws->pw_name, gid);
+    printf("Authendicated with uid=%d (%s) and gid=%d\n", uid, user_name(uid), gid);
 
 finish:
     out.ret = ret;